@@ -3,6 +3,7 @@
 #include <linux/bio.h>
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/log2.h>
 #include <linux/slab.h>
 
 enum { ASYNC, SYNC };
@@ -14,6 +15,19 @@ static const int async_write_expire = HZ * 16;	/* ditto for async, these limits
 static const int writes_starved = 4;		/* max times reads can starve a write */
 static const int fifo_batch     = 1;		/* # of sequential requests treated as one
 						   by the above parameters. For throughput. */
+static const int batch_bytes    = 0;		/* if set, batch by bytes, not fifo_batch */
+static const int read_latency_target = 0;	/* ms; throttle writes to keep reads under */
+
+/*
+ * While reads are waiting and a read latency target is set, no more than
+ * write_window bytes of writes are in the driver at once. The window halves
+ * whenever a read completes late and grows back a step at a time.
+ */
+#define SIO_WRITE_WINDOW_MAX	(4 << 20)
+#define SIO_WRITE_WINDOW_STEP	(64 << 10)
+
+/* Dispatch latency buckets are powers of two in ms: <1, <2, ... >= 512 */
+#define SIO_LAT_BUCKETS		11
 
 struct sio_data {
 	struct list_head fifo_list[2][2];
@@ -22,8 +36,19 @@ struct sio_data {
 	int fifo_expire[2][2];
 	int fifo_batch;
 	int writes_starved;
+	int batch_bytes;
+	int read_latency_target;
+
+	unsigned int write_window;
+	unsigned int writes_in_flight;	/* bytes */
+	unsigned long writes_throttled;
+	unsigned long dispatch_hist[2][SIO_LAT_BUCKETS];
 };
 
+/* The size of a request as it was dispatched, kept for completion */
+#define rq_sio_bytes(rq)	((unsigned long) (rq)->elevator_private)
+#define rq_set_sio_bytes(rq, b)	((rq)->elevator_private = (void *) (b))
+
 static void
 sio_merged_requests(struct request_queue *q, struct request *rq,
 		    struct request *next)
@@ -112,13 +137,33 @@ sio_choose_request(struct sio_data *sd, int data_dir)
 	return NULL;
 }
 
+static int
+sio_latency_bucket(unsigned long delay)
+{
+	unsigned int ms = jiffies_to_msecs(delay);
+	int bucket = ms ? ilog2(ms) + 1 : 0;
+
+	return min(bucket, SIO_LAT_BUCKETS - 1);
+}
+
 static inline void
 sio_dispatch_request(struct sio_data *sd, struct request *rq)
 {
+	const unsigned int bytes = blk_rq_bytes(rq);
+
 	rq_fifo_clear(rq);
 	elv_dispatch_add_tail(rq->q, rq);
 
-	sd->batched++;
+	sd->dispatch_hist[rq_data_dir(rq)]
+		[sio_latency_bucket(jiffies - rq->start_time)]++;
+	rq_set_sio_bytes(rq, bytes);
+	if (rq_data_dir(rq))
+		sd->writes_in_flight += bytes;
+
+	if (sd->batch_bytes)
+		sd->batched += bytes;
+	else
+		sd->batched++;
 
 	if (rq_data_dir(rq)) {
 		sd->starved = 0;
@@ -129,14 +174,35 @@ sio_dispatch_request(struct sio_data *sd, struct request *rq)
 	}
 }
 
+static int
+sio_reads_waiting(struct sio_data *sd)
+{
+	return !list_empty(&sd->fifo_list[SYNC][READ]) ||
+	       !list_empty(&sd->fifo_list[ASYNC][READ]);
+}
+
+/*
+ * Whether a write must wait so that waiting reads meet the latency target.
+ * A write is never held back if no write is in flight, so writes can
+ * always make progress.
+ */
+static int
+sio_write_throttled(struct sio_data *sd)
+{
+	return sd->read_latency_target && sd->writes_in_flight &&
+	       sd->writes_in_flight >= sd->write_window &&
+	       sio_reads_waiting(sd);
+}
+
 static int
 sio_dispatch_requests(struct request_queue *q, int force)
 {
 	struct sio_data *sd = q->elevator->elevator_data;
 	struct request *rq = NULL;
 	int data_dir = READ;
+	int batch = sd->batch_bytes ? sd->batch_bytes : sd->fifo_batch;
 
-	if (sd->batched > sd->fifo_batch) {
+	if (sd->batched > batch) {
 		sd->batched = 0;
 		rq = sio_choose_expired_request(sd);
 	}
@@ -150,10 +216,41 @@ sio_dispatch_requests(struct request_queue *q, int force)
 			return 0;
 	}
 
+	if (rq_data_dir(rq) == WRITE && !force && sio_write_throttled(sd)) {
+		sd->writes_throttled++;
+		rq = sio_choose_request(sd, READ);
+	}
+
 	sio_dispatch_request(sd, rq);
 	return 1;
 }
 
+static void
+sio_completed_request(struct request_queue *q, struct request *rq)
+{
+	struct sio_data *sd = q->elevator->elevator_data;
+	unsigned int target;
+
+	if (rq_data_dir(rq)) {
+		sd->writes_in_flight -= min_t(unsigned int, rq_sio_bytes(rq),
+					      sd->writes_in_flight);
+		return;
+	}
+
+	if (!sd->read_latency_target)
+		return;
+
+	/* Adjust the write window by how long this read took, end to end. */
+	target = msecs_to_jiffies(sd->read_latency_target);
+	if (time_after(jiffies, rq->start_time + target))
+		sd->write_window = max_t(unsigned int, sd->write_window / 2,
+					 SIO_WRITE_WINDOW_STEP);
+	else if (time_before_eq(jiffies, rq->start_time + target / 2))
+		sd->write_window = min_t(unsigned int,
+					 sd->write_window + SIO_WRITE_WINDOW_STEP,
+					 SIO_WRITE_WINDOW_MAX);
+}
+
 static struct request *
 sio_former_request(struct request_queue *q, struct request *rq)
 {
@@ -199,6 +296,13 @@ sio_init_queue(struct request_queue *q)
 	sd->fifo_expire[ASYNC][WRITE] = async_write_expire;
 	sd->fifo_batch = fifo_batch;
 	sd->writes_starved = writes_starved;
+	sd->batch_bytes = batch_bytes;
+	sd->read_latency_target = read_latency_target;
+	sd->starved = 0;
+	sd->write_window = SIO_WRITE_WINDOW_MAX;
+	sd->writes_in_flight = 0;
+	sd->writes_throttled = 0;
+	memset(sd->dispatch_hist, 0, sizeof(sd->dispatch_hist));
 	return sd;
 }
 
@@ -243,6 +347,8 @@ SHOW_FUNCTION(sio_async_read_expire_show, sd->fifo_expire[ASYNC][READ], 1);
 SHOW_FUNCTION(sio_async_write_expire_show, sd->fifo_expire[ASYNC][WRITE], 1);
 SHOW_FUNCTION(sio_fifo_batch_show, sd->fifo_batch, 0);
 SHOW_FUNCTION(sio_writes_starved_show, sd->writes_starved, 0);
+SHOW_FUNCTION(sio_batch_bytes_show, sd->batch_bytes, 0);
+SHOW_FUNCTION(sio_read_latency_target_show, sd->read_latency_target, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -267,8 +373,43 @@ STORE_FUNCTION(sio_async_read_expire_store, &sd->fifo_expire[ASYNC][READ], 0, IN
 STORE_FUNCTION(sio_async_write_expire_store, &sd->fifo_expire[ASYNC][WRITE], 0, INT_MAX, 1);
 STORE_FUNCTION(sio_fifo_batch_store, &sd->fifo_batch, 0, INT_MAX, 0);
 STORE_FUNCTION(sio_writes_starved_store, &sd->writes_starved, 0, INT_MAX, 0);
+STORE_FUNCTION(sio_batch_bytes_store, &sd->batch_bytes, 0, INT_MAX, 0);
+STORE_FUNCTION(sio_read_latency_target_store, &sd->read_latency_target, 0, INT_MAX, 0);
 #undef STORE_FUNCTION
 
+static ssize_t
+sio_hist_show(struct sio_data *sd, int data_dir, char *page)
+{
+	int b, len = 0;
+
+	len += sprintf(page + len, "<1ms");
+	for (b = 1; b < SIO_LAT_BUCKETS - 1; b++)
+		len += sprintf(page + len, "\t<%dms", 1 << b);
+	len += sprintf(page + len, "\t>=%dms\n", 1 << (SIO_LAT_BUCKETS - 2));
+
+	for (b = 0; b < SIO_LAT_BUCKETS; b++)
+		len += sprintf(page + len, "%s%lu", b ? "\t" : "",
+			       sd->dispatch_hist[data_dir][b]);
+	len += sprintf(page + len, "\n");
+
+	if (data_dir == WRITE)
+		len += sprintf(page + len, "throttled %lu window %u\n",
+			       sd->writes_throttled, sd->write_window);
+	return len;
+}
+
+static ssize_t
+sio_read_dispatch_latency_show(struct elevator_queue *e, char *page)
+{
+	return sio_hist_show(e->elevator_data, READ, page);
+}
+
+static ssize_t
+sio_write_dispatch_latency_show(struct elevator_queue *e, char *page)
+{
+	return sio_hist_show(e->elevator_data, WRITE, page);
+}
+
 #define DD_ATTR(name) \
 	__ATTR(name, S_IRUGO|S_IWUSR, sio_##name##_show, \
 				      sio_##name##_store)
@@ -280,6 +421,12 @@ static struct elv_fs_entry sio_attrs[] = {
 	DD_ATTR(async_write_expire),
 	DD_ATTR(fifo_batch),
 	DD_ATTR(writes_starved),
+	DD_ATTR(batch_bytes),
+	DD_ATTR(read_latency_target),
+	__ATTR(read_dispatch_latency, S_IRUGO,
+	       sio_read_dispatch_latency_show, NULL),
+	__ATTR(write_dispatch_latency, S_IRUGO,
+	       sio_write_dispatch_latency_show, NULL),
 	__ATTR_NULL
 };
 
@@ -289,6 +436,7 @@ static struct elevator_type iosched_sio = {
 		.elevator_dispatch_fn		= sio_dispatch_requests,
 		.elevator_add_req_fn		= sio_add_request,
 		.elevator_queue_empty_fn	= sio_queue_empty,
+		.elevator_completed_req_fn	= sio_completed_request,
 		.elevator_former_req_fn		= sio_former_request,
 		.elevator_latter_req_fn		= sio_latter_request,
 		.elevator_init_fn		= sio_init_queue,
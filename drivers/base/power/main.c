@@ -23,6 +23,7 @@
 #include <linux/pm.h>
 #include <linux/resume-trace.h>
 #include <linux/rwsem.h>
+#include <linux/suspend_latency.h>
 #include <linux/timer.h>
 
 #include "../base.h"
@@ -453,12 +454,16 @@ static void dpm_resume(pm_message_t state)
 
 		get_device(dev);
 		if (dev->power.status >= DPM_OFF) {
+			ktime_t start;
 			int error;
 
 			dev->power.status = DPM_RESUMING;
 			mutex_unlock(&dpm_list_mtx);
 
+			start = suspend_latency_start();
 			error = resume_device(dev, state);
+			suspend_latency_record(SUSPEND_LATENCY_DEV_RESUME, NULL,
+					       dev_name(dev), start, error);
 
 			mutex_lock(&dpm_list_mtx);
 			if (error)
@@ -693,12 +698,16 @@ static int dpm_suspend(pm_message_t state)
 	mutex_lock(&dpm_list_mtx);
 	while (!list_empty(&dpm_list)) {
 		struct device *dev = to_device(dpm_list.prev);
+		ktime_t start;
 
 		get_device(dev);
 		mutex_unlock(&dpm_list_mtx);
 
 		dpm_drv_wdset(dev);
+		start = suspend_latency_start();
 		error = suspend_device(dev, state);
+		suspend_latency_record(SUSPEND_LATENCY_DEV_SUSPEND, NULL,
+				       dev_name(dev), start, error);
 		dpm_drv_wdclr(dev);
 
 		mutex_lock(&dpm_list_mtx);
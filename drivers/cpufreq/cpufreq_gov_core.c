@@ -0,0 +1,453 @@
+/*
+ * drivers/cpufreq/cpufreq_gov_core.c
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/kthread.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/tick.h>
+#include <asm/cputime.h>
+
+#include "cpufreq_gov_core.h"
+
+#define GOV_TRACE_SIZE	256
+
+static DEFINE_PER_CPU(struct cpufreq_gov_cpu, gov_core_cpu);
+
+/* All speed changes are made by ramp_task, for the CPUs in ramp_cpumask */
+static struct task_struct *ramp_task;
+static cpumask_t ramp_cpumask;
+static DEFINE_MUTEX(ramp_mutex);	/* held around each speed change */
+static DEFINE_MUTEX(gov_core_mutex);	/* start/stop vs. ramp_task setup */
+
+/* Every speed change any governor asked for, for debugfs */
+struct gov_trace_entry {
+	u64 time;			/* us, on the idle time clock */
+	const char *gov;
+	u16 cpu;
+	s16 load;			/* -1 if not from a sample */
+	unsigned int from;
+	unsigned int to;
+};
+
+static DEFINE_SPINLOCK(trace_lock);
+static struct gov_trace_entry trace[GOV_TRACE_SIZE];
+static unsigned int trace_head;		/* total entries ever recorded */
+
+static struct dentry *debugfs_dir;
+
+static void gov_trace(struct cpufreq_gov_cpu *gc, u64 time, int load,
+		      unsigned int to)
+{
+	struct gov_trace_entry *e;
+	unsigned long flags;
+
+	spin_lock_irqsave(&trace_lock, flags);
+	e = &trace[trace_head++ % GOV_TRACE_SIZE];
+	e->time = time;
+	e->gov = gc->gov->name;
+	e->cpu = gc->cpu;
+	e->load = load;
+	e->from = gc->target_freq;
+	e->to = to;
+	spin_unlock_irqrestore(&trace_lock, flags);
+}
+
+static void gov_core_request(struct cpufreq_gov_cpu *gc, unsigned int freq,
+			     unsigned int relation)
+{
+	gc->target_freq = freq;
+	gc->relation = relation;
+	gc->ramps++;
+	cpumask_set_cpu(gc->cpu, &ramp_cpumask);
+	wake_up_process(ramp_task);
+}
+
+static unsigned int gov_core_validate(struct cpufreq_policy *policy,
+				      unsigned int freq)
+{
+	if (freq > policy->max)
+		return policy->max;
+	if (freq < policy->min)
+		return policy->min;
+	return freq;
+}
+
+static unsigned int gov_core_load(unsigned int busy, unsigned int time)
+{
+	return time ? div_u64((u64) busy * 100, time) : 0;
+}
+
+static void cpufreq_gov_core_timer(unsigned long data)
+{
+	struct cpufreq_gov_cpu *gc = &per_cpu(gov_core_cpu, data);
+	struct cpufreq_gov_sample s;
+	unsigned int delta_idle, new_freq;
+	unsigned int relation = CPUFREQ_RELATION_H;
+	u64 now, now_idle;
+
+	if (!gc->enabled)
+		return;
+
+	now_idle = get_cpu_idle_time_us(data, &now);
+	s.window_us = (unsigned int) cputime64_sub(now, gc->sample_time);
+	delta_idle = (unsigned int) cputime64_sub(now_idle, gc->time_in_idle);
+
+	/* Less than 1ms says too little; let the window grow. */
+	if (s.window_us < 1000)
+		goto rearm;
+
+	s.busy_us = delta_idle > s.window_us ? 0 : s.window_us - delta_idle;
+	s.load = gov_core_load(s.busy_us, s.window_us);
+
+	s.since_change_us = cputime64_sub(now, gc->freq_change_time);
+	delta_idle = (unsigned int) cputime64_sub(now_idle,
+						  gc->freq_change_time_in_idle);
+	if (delta_idle > (unsigned int) s.since_change_us)
+		s.load_since_change = 0;
+	else
+		s.load_since_change = gov_core_load(
+			(unsigned int) s.since_change_us - delta_idle,
+			(unsigned int) s.since_change_us);
+
+	gc->time_in_idle = now_idle;
+	gc->sample_time = now;
+	gc->samples++;
+
+	new_freq = gc->gov->sample(gc, &s, &relation);
+	if (new_freq) {
+		new_freq = gov_core_validate(gc->policy, new_freq);
+		if (new_freq != gc->target_freq) {
+			gov_trace(gc, now, s.load, new_freq);
+			gov_core_request(gc, new_freq, relation);
+		}
+	}
+
+rearm:
+	mod_timer(&gc->timer, jiffies + gc->gov->sample_jiffies);
+}
+
+static int cpufreq_gov_core_ramp_task(void *data)
+{
+	struct cpufreq_gov_cpu *gc;
+	cpumask_t tmp_mask;
+	unsigned int cpu;
+
+	while (1) {
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		if (cpumask_empty(&ramp_cpumask))
+			schedule();
+
+		set_current_state(TASK_RUNNING);
+
+		if (kthread_should_stop())
+			break;
+
+		tmp_mask = ramp_cpumask;
+
+		for_each_cpu(cpu, &tmp_mask) {
+			cpumask_clear_cpu(cpu, &ramp_cpumask);
+			gc = &per_cpu(gov_core_cpu, cpu);
+
+			mutex_lock(&ramp_mutex);
+			if (gc->enabled) {
+				__cpufreq_driver_target(gc->policy,
+							gc->target_freq,
+							gc->relation);
+				gc->freq_change_time_in_idle =
+					get_cpu_idle_time_us(cpu,
+						&gc->freq_change_time);
+			}
+			mutex_unlock(&ramp_mutex);
+		}
+	}
+
+	return 0;
+}
+
+struct cpufreq_gov_cpu *cpufreq_gov_core_cpu(unsigned int cpu)
+{
+	return &per_cpu(gov_core_cpu, cpu);
+}
+EXPORT_SYMBOL_GPL(cpufreq_gov_core_cpu);
+
+void cpufreq_gov_core_set_target(struct cpufreq_gov_cpu *gc,
+				 unsigned int freq, unsigned int relation)
+{
+	u64 now;
+
+	if (!gc->enabled)
+		return;
+
+	freq = gov_core_validate(gc->policy, freq);
+	if (freq == gc->target_freq)
+		return;
+
+	get_cpu_idle_time_us(gc->cpu, &now);
+	gov_trace(gc, now, -1, freq);
+	gov_core_request(gc, freq, relation);
+}
+EXPORT_SYMBOL_GPL(cpufreq_gov_core_set_target);
+
+static int gov_core_start_ramp_task(void)
+{
+	struct sched_param param = { .sched_priority = MAX_RT_PRIO-1 };
+	struct task_struct *task;
+
+	if (ramp_task)
+		return 0;
+
+	task = kthread_create(cpufreq_gov_core_ramp_task, NULL,
+			      "kcpufreq_ramp");
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+
+	sched_setscheduler_nocheck(task, SCHED_FIFO, &param);
+	get_task_struct(task);
+	ramp_task = task;
+	return 0;
+}
+
+static int gov_core_start(struct cpufreq_gov_policy *gov,
+			  struct cpufreq_policy *policy)
+{
+	unsigned int cpu = policy->cpu;
+	struct cpufreq_gov_cpu *gc = &per_cpu(gov_core_cpu, cpu);
+	int rc;
+
+	if (!cpu_online(cpu) || !policy->cur)
+		return -EINVAL;
+
+	if (gc->enabled)	/* Already enabled */
+		return 0;
+
+	mutex_lock(&gov_core_mutex);
+	rc = gov_core_start_ramp_task();
+	if (rc)
+		goto out;
+
+	gc->gov = gov;
+	gc->policy = policy;
+	gc->freq_table = cpufreq_frequency_get_table(cpu);
+	gc->target_freq = policy->cur;
+	gc->relation = CPUFREQ_RELATION_H;
+	gc->time_in_idle = get_cpu_idle_time_us(cpu, &gc->sample_time);
+	gc->freq_change_time_in_idle = gc->time_in_idle;
+	gc->freq_change_time = gc->sample_time;
+
+	if (gov->attr_group) {
+		rc = sysfs_create_group(&policy->kobj, gov->attr_group);
+		if (rc)
+			goto out;
+	}
+
+	if (gov->start) {
+		rc = gov->start(gc);
+		if (rc) {
+			if (gov->attr_group)
+				sysfs_remove_group(&policy->kobj,
+						   gov->attr_group);
+			goto out;
+		}
+	}
+
+	gc->enabled = 1;
+	smp_wmb();
+	gc->timer.expires = jiffies + gov->sample_jiffies;
+	add_timer_on(&gc->timer, cpu);
+out:
+	mutex_unlock(&gov_core_mutex);
+	return rc;
+}
+
+static void gov_core_stop(struct cpufreq_gov_policy *gov,
+			  struct cpufreq_policy *policy)
+{
+	struct cpufreq_gov_cpu *gc = &per_cpu(gov_core_cpu, policy->cpu);
+
+	mutex_lock(&gov_core_mutex);
+	if (!gc->enabled)
+		goto out;
+
+	gc->enabled = 0;
+	smp_wmb();
+	del_timer_sync(&gc->timer);
+
+	/* Wait out a speed change the ramp thread may be making for us. */
+	cpumask_clear_cpu(policy->cpu, &ramp_cpumask);
+	mutex_lock(&ramp_mutex);
+	mutex_unlock(&ramp_mutex);
+
+	if (gov->stop)
+		gov->stop(gc);
+	if (gov->attr_group)
+		sysfs_remove_group(&policy->kobj, gov->attr_group);
+out:
+	mutex_unlock(&gov_core_mutex);
+}
+
+static void gov_core_limits(struct cpufreq_gov_policy *gov,
+			    struct cpufreq_policy *policy)
+{
+	struct cpufreq_gov_cpu *gc = &per_cpu(gov_core_cpu, policy->cpu);
+
+	if (policy->max < policy->cur)
+		__cpufreq_driver_target(policy, policy->max,
+					CPUFREQ_RELATION_H);
+	else if (policy->min > policy->cur)
+		__cpufreq_driver_target(policy, policy->min,
+					CPUFREQ_RELATION_L);
+
+	if (!gc->enabled)
+		return;
+
+	gc->target_freq = policy->cur;
+	if (gov->limits)
+		gov->limits(gc);
+}
+
+int cpufreq_gov_core_event(struct cpufreq_gov_policy *gov,
+			   struct cpufreq_policy *policy, unsigned int event)
+{
+	switch (event) {
+	case CPUFREQ_GOV_START:
+		return gov_core_start(gov, policy);
+
+	case CPUFREQ_GOV_STOP:
+		gov_core_stop(gov, policy);
+		break;
+
+	case CPUFREQ_GOV_LIMITS:
+		gov_core_limits(gov, policy);
+		break;
+	}
+	return 0;
+}
+EXPORT_SYMBOL_GPL(cpufreq_gov_core_event);
+
+static int gov_core_trace_show(struct seq_file *m, void *unused)
+{
+	struct gov_trace_entry *e;
+	unsigned int i, start;
+
+	e = kmalloc(sizeof(trace), GFP_KERNEL);
+	if (!e)
+		return -ENOMEM;
+	spin_lock_irq(&trace_lock);
+	memcpy(e, trace, sizeof(trace));
+	i = trace_head;
+	spin_unlock_irq(&trace_lock);
+
+	start = i > GOV_TRACE_SIZE ? i - GOV_TRACE_SIZE : 0;
+	seq_puts(m, "time_us\tcpu\tgovernor\tload\tfrom\tto\n");
+	for (; start < i; start++) {
+		struct gov_trace_entry *entry = &e[start % GOV_TRACE_SIZE];
+
+		seq_printf(m, "%llu\t%u\t%s\t%d\t%u\t%u\n",
+			   (unsigned long long) entry->time, entry->cpu,
+			   entry->gov, entry->load, entry->from, entry->to);
+	}
+	kfree(e);
+	return 0;
+}
+
+static int gov_core_stats_show(struct seq_file *m, void *unused)
+{
+	struct cpufreq_gov_cpu *gc;
+	unsigned int cpu;
+
+	seq_puts(m, "cpu\tgovernor\tsamples\tramps\n");
+	for_each_possible_cpu(cpu) {
+		gc = &per_cpu(gov_core_cpu, cpu);
+		if (!gc->gov)
+			continue;
+		seq_printf(m, "%u\t%s\t%lu\t%lu\n", cpu,
+			   gc->enabled ? gc->gov->name : "-",
+			   gc->samples, gc->ramps);
+	}
+	return 0;
+}
+
+static int gov_core_trace_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gov_core_trace_show, NULL);
+}
+
+static int gov_core_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gov_core_stats_show, NULL);
+}
+
+static const struct file_operations gov_core_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = gov_core_trace_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations gov_core_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = gov_core_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init cpufreq_gov_core_init(void)
+{
+	struct cpufreq_gov_cpu *gc;
+	unsigned int i;
+
+	for_each_possible_cpu(i) {
+		gc = &per_cpu(gov_core_cpu, i);
+		gc->cpu = i;
+		init_timer_deferrable(&gc->timer);
+		gc->timer.function = cpufreq_gov_core_timer;
+		gc->timer.data = i;
+	}
+
+	debugfs_dir = debugfs_create_dir("cpufreq_gov", NULL);
+	if (debugfs_dir) {
+		debugfs_create_file("trace", S_IRUGO, debugfs_dir, NULL,
+				    &gov_core_trace_fops);
+		debugfs_create_file("stats", S_IRUGO, debugfs_dir, NULL,
+				    &gov_core_stats_fops);
+	}
+	return 0;
+}
+
+static void __exit cpufreq_gov_core_exit(void)
+{
+	debugfs_remove_recursive(debugfs_dir);
+	if (ramp_task) {
+		kthread_stop(ramp_task);
+		put_task_struct(ramp_task);
+	}
+}
+
+/* Ahead of the governors, which may be registered from fs_initcall */
+core_initcall(cpufreq_gov_core_init);
+module_exit(cpufreq_gov_core_exit);
+
+MODULE_DESCRIPTION("Load sampling and ramping shared by cpufreq governors");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,97 @@
+/*
+ * drivers/cpufreq/cpufreq_gov_core.h
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef _CPUFREQ_GOV_CORE_H
+#define _CPUFREQ_GOV_CORE_H
+
+#include <linux/cpufreq.h>
+#include <linux/sysfs.h>
+#include <linux/timer.h>
+
+/*
+ * Shared machinery for the load sampling governors. The core samples each
+ * CPU's load from a deferrable timer, so an idle CPU is not woken up to be
+ * sampled, and makes every speed change from a single SCHED_FIFO thread.
+ * A governor only supplies the policy: given a sample, which speed next.
+ */
+
+/* One load sample, as handed to cpufreq_gov_policy.sample */
+struct cpufreq_gov_sample {
+	unsigned int load;		/* percent busy over the window */
+	unsigned int load_since_change;	/* percent busy at the current speed */
+	unsigned int window_us;		/* length of the window */
+	unsigned int busy_us;		/* non-idle time in the window */
+	u64 since_change_us;		/* time since the last speed change */
+};
+
+struct cpufreq_gov_policy;
+
+struct cpufreq_gov_cpu {
+	struct cpufreq_gov_policy *gov;
+	struct cpufreq_policy *policy;
+	struct cpufreq_frequency_table *freq_table;
+	struct timer_list timer;
+	unsigned int cpu;
+	int enabled;
+
+	unsigned int target_freq;	/* last speed asked of the ramp thread */
+	unsigned int relation;
+	u64 time_in_idle;		/* start of the current window */
+	u64 sample_time;
+	u64 freq_change_time;		/* when the speed last changed */
+	u64 freq_change_time_in_idle;
+
+	unsigned long samples;
+	unsigned long ramps;
+};
+
+struct cpufreq_gov_policy {
+	const char *name;
+
+	/*
+	 * Runs from the sampling timer on gc->cpu. Returns the speed to run at
+	 * next and sets *relation, or returns 0 to keep the current one.
+	 */
+	unsigned int (*sample)(struct cpufreq_gov_cpu *gc,
+			       const struct cpufreq_gov_sample *s,
+			       unsigned int *relation);
+
+	/*
+	 * Optional, from CPUFREQ_GOV_START, _STOP and _LIMITS. Start and
+	 * stop of all cpus and governors are serialized by the core.
+	 */
+	int (*start)(struct cpufreq_gov_cpu *gc);
+	void (*stop)(struct cpufreq_gov_cpu *gc);
+	void (*limits)(struct cpufreq_gov_cpu *gc);
+
+	/* Created in the directory of each policy the governor runs */
+	struct attribute_group *attr_group;
+
+	unsigned long sample_jiffies;
+};
+
+/* Handles a cpufreq_governor.governor event on behalf of 'gov' */
+int cpufreq_gov_core_event(struct cpufreq_gov_policy *gov,
+			   struct cpufreq_policy *policy, unsigned int event);
+
+struct cpufreq_gov_cpu *cpufreq_gov_core_cpu(unsigned int cpu);
+
+/*
+ * Asks the ramp thread to move gc->cpu to 'freq'. Safe from any context,
+ * for speed changes a governor makes outside of its sample callback.
+ */
+void cpufreq_gov_core_set_target(struct cpufreq_gov_cpu *gc,
+				 unsigned int freq, unsigned int relation);
+
+#endif
@@ -15,51 +15,26 @@
  * Author: Mike Chan (mike@android.com)
  *
  * Adaptation for 2.6.29 kernel: Nadlabak (pavel@doshaska.net)
- * requires to add
- * EXPORT_SYMBOL_GPL(nr_running);
- * at the end of kernel/sched.c
  *
  */
 
-#include <linux/cpu.h>
-#include <linux/cpumask.h>
 #include <linux/cpufreq.h>
-#include <linux/mutex.h>
-#include <linux/sched.h>
-#include <linux/tick.h>
-#include <linux/timer.h>
-#include <linux/workqueue.h>
-#include <linux/moduleparam.h>
-#include <linux/kthread.h>
-#include <asm/cputime.h>
-
-static void (*pm_idle_old)(void);
-static atomic_t active_count = ATOMIC_INIT(0);
+#include <linux/input.h>
+#include <linux/jiffies.h>
+#include <linux/slab.h>
+
+#include "cpufreq_gov_core.h"
+
+/* cpus running the governor, serialized by the governor core */
+static unsigned int active_count;
 
 struct cpufreq_interactive_cpuinfo {
-	struct timer_list cpu_timer;
-	int timer_idlecancel;
-	u64 time_in_idle;
-	u64 idle_exit_time;
-	u64 timer_run_time;
-	int idling;
-	u64 freq_change_time;
-	u64 freq_change_time_in_idle;
-	struct cpufreq_policy *policy;
-	struct cpufreq_frequency_table *freq_table;
-	unsigned int target_freq;
-	int governor_enabled;
+	int load_ewma;			/* predicted load, in 1/256 % */
+	unsigned long boost_hits;	/* samples raised to the boost freq */
 };
 
 static DEFINE_PER_CPU(struct cpufreq_interactive_cpuinfo, cpuinfo);
 
-/* Workqueues handle frequency scaling */
-static struct task_struct *up_task;
-static struct workqueue_struct *down_wq;
-static struct work_struct freq_scale_down_work;
-static cpumask_t up_cpumask;
-static cpumask_t down_cpumask;
-
 /*
  * The minimum amount of time to spend at a frequency before we can ramp down.
  */
@@ -68,92 +43,28 @@ static unsigned long min_sample_time;
 
 #define LOAD_SCALE_MAX 85
 
-#define DEBUG 0
-#define BUFSZ 128
-
-#if DEBUG
-#include <linux/proc_fs.h>
-
-struct dbgln {
-	int cpu;
-	unsigned long jiffy;
-	unsigned long run;
-	char buf[BUFSZ];
-};
-
-#define NDBGLNS 256
-
-static struct dbgln dbgbuf[NDBGLNS];
-static int dbgbufs;
-static int dbgbufe;
-static struct proc_dir_entry	*dbg_proc;
-static spinlock_t dbgpr_lock;
-
-static u64 up_request_time;
-static unsigned int up_max_latency;
-
-static void dbgpr(char *fmt, ...)
-{
-	va_list args;
-	int n;
-	unsigned long flags;
-
-	spin_lock_irqsave(&dbgpr_lock, flags);
-	n = dbgbufe;
-        va_start(args, fmt);
-        vsnprintf(dbgbuf[n].buf, BUFSZ, fmt, args);
-        va_end(args);
-	dbgbuf[n].cpu = smp_processor_id();
-	dbgbuf[n].run = nr_running();
-	dbgbuf[n].jiffy = jiffies;
-
-	if (++dbgbufe >= NDBGLNS)
-		dbgbufe = 0;
-
-	if (dbgbufe == dbgbufs)
-		if (++dbgbufs >= NDBGLNS)
-			dbgbufs = 0;
-
-	spin_unlock_irqrestore(&dbgpr_lock, flags);
-}
-
-static void dbgdump(void)
-{
-	int i, j;
-	unsigned long flags;
-	static struct dbgln prbuf[NDBGLNS];
-
-	spin_lock_irqsave(&dbgpr_lock, flags);
-	i = dbgbufs;
-	j = dbgbufe;
-	memcpy(prbuf, dbgbuf, sizeof(dbgbuf));
-	dbgbufs = 0;
-	dbgbufe = 0;
-	spin_unlock_irqrestore(&dbgpr_lock, flags);
-
-	while (i != j)
-	{
-		printk("%lu %d %lu %s",
-		       prbuf[i].jiffy, prbuf[i].cpu, prbuf[i].run,
-		       prbuf[i].buf);
-		if (++i == NDBGLNS)
-			i = 0;
-	}
-}
+/*
+ * Input boost: on input events, run at no less than boost_freq (kHz) for
+ * boost_duration (us). A boost_freq of 0 disables it.
+ */
+static unsigned long boost_freq;
+#define DEFAULT_BOOST_DURATION 500000
+static unsigned long boost_duration;
+static unsigned long boost_until;
+static unsigned long boost_count;
+static unsigned long boost_input_events;
 
-static int dbg_proc_read(char *buffer, char **start, off_t offset,
-			       int count, int *peof, void *dat)
-{
-	printk("max up_task latency=%uus\n", up_max_latency);
-	dbgdump();
-	*peof = 1;
-	return 0;
-}
+/*
+ * Weight, in percent, of the newest sample in the predicted load. 100 makes
+ * every decision on the last sample alone, as before.
+ */
+#define DEFAULT_LOAD_EWMA_WEIGHT 50
+static unsigned long load_ewma_weight;
 
+/* Sample every 2 ticks; the timer is deferred while the CPU idles. */
+#define SAMPLE_JIFFIES 2
 
-#else
-#define dbgpr(...) do {} while (0)
-#endif
+static struct cpufreq_gov_policy interactive_gov;
 
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event);
@@ -168,459 +79,341 @@ struct cpufreq_governor cpufreq_gov_interactive = {
 	.owner = THIS_MODULE,
 };
 
-static void cpufreq_interactive_timer(unsigned long data)
+/*
+ * Returns the lowest table frequency at or above the boost frequency that
+ * the policy allows, or 0 if no boost is in effect.
+ */
+static unsigned int cpufreq_interactive_boost_floor(struct cpufreq_gov_cpu *gc)
 {
-	unsigned int delta_idle;
-	unsigned int delta_time;
-	int cpu_load;
-	int load_since_change;
-	u64 time_in_idle;
-	u64 idle_exit_time;
-	struct cpufreq_interactive_cpuinfo *pcpu =
-		&per_cpu(cpuinfo, data);
-	u64 now_idle;
-	unsigned int new_freq;
 	unsigned int index;
 
-	/*
-	 * Once pcpu->timer_run_time is updated to >= pcpu->idle_exit_time,
-	 * this lets idle exit know the current idle time sample has
-	 * been processed, and idle exit can generate a new sample and
-	 * re-arm the timer.  This prevents a concurrent idle
-	 * exit on that CPU from writing a new set of info at the same time
-	 * the timer function runs (the timer function can't use that info
-	 * until more time passes).
-	 */
-	time_in_idle = pcpu->time_in_idle;
-	idle_exit_time = pcpu->idle_exit_time;
-	now_idle = get_cpu_idle_time_us(data, &pcpu->timer_run_time);
-	smp_wmb();
-
-	/* If we raced with cancelling a timer, skip. */
-	if (!idle_exit_time) {
-		dbgpr("timer %d: no valid idle exit sample\n", (int) data);
-		goto exit;
-	}
-
-#if DEBUG
-	if ((int) jiffies - (int) pcpu->cpu_timer.expires >= 10)
-		dbgpr("timer %d: late by %d ticks\n",
-		      (int) data, jiffies - pcpu->cpu_timer.expires);
-#endif
+	if (!boost_freq || !time_before(jiffies, boost_until))
+		return 0;
 
-	delta_idle = (unsigned int) cputime64_sub(now_idle, time_in_idle);
-	delta_time = (unsigned int) cputime64_sub(pcpu->timer_run_time,
-						  idle_exit_time);
+	if (cpufreq_frequency_table_target(gc->policy, gc->freq_table,
+					   min_t(unsigned int, boost_freq,
+						 gc->policy->max),
+					   CPUFREQ_RELATION_L, &index))
+		return 0;
 
-	/*
-	 * If timer ran less than 1ms after short-term sample started, retry.
-	 */
-	if (delta_time < 1000) {
-		dbgpr("timer %d: time delta %u too short exit=%llu now=%llu\n", (int) data,
-		      delta_time, idle_exit_time, pcpu->timer_run_time);
-		goto rearm;
-	}
+	return gc->freq_table[index].frequency;
+}
 
-	if (delta_idle > delta_time)
-		cpu_load = 0;
-	else
-		cpu_load = 100 * (delta_time - delta_idle) / delta_time;
+/*
+ * Folds a load sample into the per-cpu average and returns the load to
+ * pick a speed for. A sample at or above LOAD_SCALE_MAX is taken as is, so
+ * that bursts still ramp to max at once.
+ */
+static int cpufreq_interactive_predict_load(
+	struct cpufreq_interactive_cpuinfo *pcpu, int cpu_load)
+{
+	pcpu->load_ewma += (cpu_load * 256 - pcpu->load_ewma) *
+		(int) load_ewma_weight / 100;
 
-	delta_idle = (unsigned int) cputime64_sub(now_idle,
-						 pcpu->freq_change_time_in_idle);
-	delta_time = (unsigned int) cputime64_sub(pcpu->timer_run_time,
-						  pcpu->freq_change_time);
+	if (cpu_load >= LOAD_SCALE_MAX)
+		return cpu_load;
+	return (pcpu->load_ewma + 128) / 256;
+}
 
-	if (delta_idle > delta_time)
-		load_since_change = 0;
-	else
-		load_since_change =
-			100 * (delta_time - delta_idle) / delta_time;
+static unsigned int cpufreq_interactive_sample(struct cpufreq_gov_cpu *gc,
+		const struct cpufreq_gov_sample *s, unsigned int *relation)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu = &per_cpu(cpuinfo, gc->cpu);
+	unsigned int new_freq;
+	unsigned int boost_floor;
+	unsigned int index;
+	int cpu_load;
 
 	/*
-	 * Choose greater of short-term load (since last idle timer
-	 * started or timer function re-armed itself) or long-term load
-	 * (since last frequency change).
+	 * Choose greater of short-term load (since the last sample) or
+	 * long-term load (since last frequency change).
 	 */
-	if (load_since_change > cpu_load)
-		cpu_load = load_since_change;
+	cpu_load = max(s->load, s->load_since_change);
+	cpu_load = cpufreq_interactive_predict_load(pcpu, cpu_load);
 
 	if (cpu_load >= LOAD_SCALE_MAX)
-		new_freq = pcpu->policy->max;
+		new_freq = gc->policy->max;
 	else
-		new_freq = pcpu->policy->max * cpu_load / 100;
+		new_freq = gc->policy->max * cpu_load / 100;
 
-	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
+	if (cpufreq_frequency_table_target(gc->policy, gc->freq_table,
 					   new_freq, CPUFREQ_RELATION_H,
-					   &index)) {
-		dbgpr("timer %d: cpufreq_frequency_table_target error\n", (int) data);
-		goto rearm;
-	}
+					   &index))
+		return 0;
 
-	new_freq = pcpu->freq_table[index].frequency;
+	new_freq = gc->freq_table[index].frequency;
 
-	if (pcpu->target_freq == new_freq)
-	{
-		dbgpr("timer %d: load=%d, already at %d\n", (int) data, cpu_load, new_freq);
-		goto rearm_if_notmax;
+	boost_floor = cpufreq_interactive_boost_floor(gc);
+	if (new_freq < boost_floor) {
+		new_freq = boost_floor;
+		pcpu->boost_hits++;
 	}
 
 	/*
 	 * Do not scale down unless we have been at this frequency for the
 	 * minimum sample time.
 	 */
-	if (new_freq < pcpu->target_freq) {
-		if (cputime64_sub(pcpu->timer_run_time, pcpu->freq_change_time) <
-		    min_sample_time) {
-			dbgpr("timer %d: load=%d cur=%d tgt=%d not yet\n", (int) data, cpu_load, pcpu->target_freq, new_freq);
-			goto rearm;
-		}
-	}
-
-	dbgpr("timer %d: load=%d cur=%d tgt=%d queue\n", (int) data, cpu_load, pcpu->target_freq, new_freq);
+	if (new_freq < gc->target_freq && s->since_change_us < min_sample_time)
+		return 0;
 
-	if (new_freq < pcpu->target_freq) {
-		pcpu->target_freq = new_freq;
-		cpumask_set_cpu(data, &down_cpumask);
-		queue_work(down_wq, &freq_scale_down_work);
-	} else {
-		pcpu->target_freq = new_freq;
-#if DEBUG
-		up_request_time = ktime_to_us(ktime_get());
-#endif
-		cpumask_set_cpu(data, &up_cpumask);
-		wake_up_process(up_task);
-	}
+	*relation = CPUFREQ_RELATION_H;
+	return new_freq;
+}
 
-rearm_if_notmax:
-	/*
-	 * Already set max speed and don't see a need to change that,
-	 * wait until next idle to re-evaluate, don't need timer.
-	 */
-	if (pcpu->target_freq == pcpu->policy->max)
-		goto exit;
-
-rearm:
-	if (!timer_pending(&pcpu->cpu_timer)) {
-		/*
-		 * If already at min: if that CPU is idle, don't set timer.
-		 * Else cancel the timer if that CPU goes idle.  We don't
-		 * need to re-evaluate speed until the next idle exit.
-		 */
-		if (pcpu->target_freq == pcpu->policy->min) {
-			smp_rmb();
-
-			if (pcpu->idling) {
-				dbgpr("timer %d: cpu idle, don't re-arm\n", (int) data);
-				goto exit;
-			}
-
-			pcpu->timer_idlecancel = 1;
-		}
+static ssize_t show_min_sample_time(struct cpufreq_policy *policy, char *buf)
+{
+	return sprintf(buf, "%lu\n", min_sample_time);
+}
 
-		pcpu->time_in_idle = get_cpu_idle_time_us(
-			data, &pcpu->idle_exit_time);
-		mod_timer(&pcpu->cpu_timer, jiffies + 2);
-		dbgpr("timer %d: set timer for %lu exit=%llu\n", (int) data, pcpu->cpu_timer.expires, pcpu->idle_exit_time);
-	}
+static ssize_t store_min_sample_time(struct cpufreq_policy *policy, const char *buf, size_t count)
+{
+	int ret = strict_strtoul(buf, 0, &min_sample_time);
 
-exit:
-	return;
+	return ret ? ret : count;
 }
 
-static void cpufreq_interactive_idle(void)
+static struct freq_attr min_sample_time_attr = __ATTR(min_sample_time, 0644,
+		show_min_sample_time, store_min_sample_time);
+
+static ssize_t show_boost_freq(struct cpufreq_policy *policy, char *buf)
 {
-	struct cpufreq_interactive_cpuinfo *pcpu =
-		&per_cpu(cpuinfo, smp_processor_id());
-	int pending;
+	return sprintf(buf, "%lu\n", boost_freq);
+}
 
-	if (!pcpu->governor_enabled) {
-		pm_idle_old();
-		return;
-	}
+static ssize_t store_boost_freq(struct cpufreq_policy *policy, const char *buf, size_t count)
+{
+	int ret = strict_strtoul(buf, 0, &boost_freq);
 
-	pcpu->idling = 1;
-	smp_wmb();
-	pending = timer_pending(&pcpu->cpu_timer);
-
-	if (pcpu->target_freq != pcpu->policy->min) {
-#ifdef CONFIG_SMP
-		/*
-		 * Entering idle while not at lowest speed.  On some
-		 * platforms this can hold the other CPU(s) at that speed
-		 * even though the CPU is idle. Set a timer to re-evaluate
-		 * speed so this idle CPU doesn't hold the other CPUs above
-		 * min indefinitely.  This should probably be a quirk of
-		 * the CPUFreq driver.
-		 */
-		if (!pending) {
-			pcpu->time_in_idle = get_cpu_idle_time_us(
-				smp_processor_id(), &pcpu->idle_exit_time);
-			pcpu->timer_idlecancel = 0;
-			mod_timer(&pcpu->cpu_timer, jiffies + 2);
-			dbgpr("idle: enter at %d, set timer for %lu exit=%llu\n",
-			      pcpu->target_freq, pcpu->cpu_timer.expires,
-			      pcpu->idle_exit_time);
-		}
-#endif
-	} else {
-		/*
-		 * If at min speed and entering idle after load has
-		 * already been evaluated, and a timer has been set just in
-		 * case the CPU suddenly goes busy, cancel that timer.  The
-		 * CPU didn't go busy; we'll recheck things upon idle exit.
-		 */
-		if (pending && pcpu->timer_idlecancel) {
-			dbgpr("idle: cancel timer for %lu\n", pcpu->cpu_timer.expires);
-			del_timer(&pcpu->cpu_timer);
-			/*
-			 * Ensure last timer run time is after current idle
-			 * sample start time, so next idle exit will always
-			 * start a new idle sampling period.
-			 */
-			pcpu->idle_exit_time = 0;
-			pcpu->timer_idlecancel = 0;
-		}
-	}
+	return ret ? ret : count;
+}
 
-	pm_idle_old();
-	pcpu->idling = 0;
-	smp_wmb();
-
-	/*
-	 * Arm the timer for 1-2 ticks later if not already, and if the timer
-	 * function has already processed the previous load sampling
-	 * interval.  (If the timer is not pending but has not processed
-	 * the previous interval, it is probably racing with us on another
-	 * CPU.  Let it compute load based on the previous sample and then
-	 * re-arm the timer for another interval when it's done, rather
-	 * than updating the interval start time to be "now", which doesn't
-	 * give the timer function enough time to make a decision on this
-	 * run.)
-	 */
-	if (timer_pending(&pcpu->cpu_timer) == 0 &&
-	    pcpu->timer_run_time >= pcpu->idle_exit_time) {
-		pcpu->time_in_idle =
-			get_cpu_idle_time_us(smp_processor_id(),
-					     &pcpu->idle_exit_time);
-		pcpu->timer_idlecancel = 0;
-		mod_timer(&pcpu->cpu_timer, jiffies + 2);
-		dbgpr("idle: exit, set timer for %lu exit=%llu\n", pcpu->cpu_timer.expires, pcpu->idle_exit_time);
-#if DEBUG
-	} else if (timer_pending(&pcpu->cpu_timer) == 0 &&
-		   pcpu->timer_run_time < pcpu->idle_exit_time) {
-		dbgpr("idle: timer not run yet: exit=%llu tmrrun=%llu\n",
-		      pcpu->idle_exit_time, pcpu->timer_run_time);
-#endif
-	}
+static struct freq_attr boost_freq_attr = __ATTR(boost_freq, 0644,
+		show_boost_freq, store_boost_freq);
 
+static ssize_t show_boost_duration(struct cpufreq_policy *policy, char *buf)
+{
+	return sprintf(buf, "%lu\n", boost_duration);
 }
 
-static int cpufreq_interactive_up_task(void *data)
+static ssize_t store_boost_duration(struct cpufreq_policy *policy, const char *buf, size_t count)
 {
-	unsigned int cpu;
-	cpumask_t tmp_mask;
-	struct cpufreq_interactive_cpuinfo *pcpu;
+	int ret = strict_strtoul(buf, 0, &boost_duration);
 
-#if DEBUG
-	u64 now;
-	u64 then;
-	unsigned int lat;
-#endif
+	return ret ? ret : count;
+}
 
-	while (1) {
-		set_current_state(TASK_INTERRUPTIBLE);
+static struct freq_attr boost_duration_attr = __ATTR(boost_duration, 0644,
+		show_boost_duration, store_boost_duration);
 
-		if (cpumask_empty(&up_cpumask))
-			schedule();
+static ssize_t show_load_ewma_weight(struct cpufreq_policy *policy, char *buf)
+{
+	return sprintf(buf, "%lu\n", load_ewma_weight);
+}
 
-		set_current_state(TASK_RUNNING);
+static ssize_t store_load_ewma_weight(struct cpufreq_policy *policy, const char *buf, size_t count)
+{
+	unsigned long val;
+	int ret = strict_strtoul(buf, 0, &val);
+
+	if (ret)
+		return ret;
+	if (val < 1 || val > 100)
+		return -EINVAL;
+	load_ewma_weight = val;
+	return count;
+}
 
-		if (kthread_should_stop())
-			break;
-#if DEBUG
-		then = up_request_time;
-		now = ktime_to_us(ktime_get());
+static struct freq_attr load_ewma_weight_attr = __ATTR(load_ewma_weight, 0644,
+		show_load_ewma_weight, store_load_ewma_weight);
 
-		if (now > then) {
-			lat = ktime_to_us(ktime_get()) - then;
+/* Laid out like cpufreq_stats' files: one "key value" pair per line */
+static ssize_t show_boost_stats(struct cpufreq_policy *policy, char *buf)
+{
+	unsigned long hits = 0;
+	unsigned int cpu;
 
-			if (lat > up_max_latency)
-				up_max_latency = lat;
-		}
-#endif
+	for_each_possible_cpu(cpu)
+		hits += per_cpu(cpuinfo, cpu).boost_hits;
 
-		tmp_mask = up_cpumask;
+	return sprintf(buf, "input_events %lu\nboosts %lu\nboost_hits %lu\n",
+		       boost_input_events, boost_count, hits);
+}
 
-		for_each_cpu(cpu, &tmp_mask) {
-			cpumask_clear_cpu(cpu, &up_cpumask);
-			pcpu = &per_cpu(cpuinfo, cpu);
+static struct freq_attr boost_stats_attr = __ATTR(boost_stats, 0444,
+		show_boost_stats, NULL);
 
-			if (nr_running() == 1) {
-				dbgpr("up %d: tgt=%d nothing else running\n", cpu,
-				      pcpu->target_freq);
-			}
+static struct attribute * interactive_attributes[] = {
+	&min_sample_time_attr.attr,
+	&boost_freq_attr.attr,
+	&boost_duration_attr.attr,
+	&load_ewma_weight_attr.attr,
+	&boost_stats_attr.attr,
+	NULL,
+};
 
-			__cpufreq_driver_target(pcpu->policy,
-						pcpu->target_freq,
-						CPUFREQ_RELATION_H);
-			pcpu->freq_change_time_in_idle =
-				get_cpu_idle_time_us(cpu,
-						     &pcpu->freq_change_time);
-			dbgpr("up %d: set tgt=%d (actual=%d)\n", cpu, pcpu->target_freq, pcpu->policy->cur);
+static struct attribute_group interactive_attr_group = {
+	.attrs = interactive_attributes,
+	.name = "interactive",
+};
+
+/*
+ * Raises every CPU running this governor to the boost frequency, from the
+ * input event path. Sampling keeps them there until boost_until passes.
+ */
+static void cpufreq_interactive_boost(void)
+{
+	struct cpufreq_gov_cpu *gc;
+	unsigned int cpu, freq;
+	int kick = 0;
+
+	boost_until = jiffies + usecs_to_jiffies(boost_duration);
+
+	for_each_online_cpu(cpu) {
+		gc = cpufreq_gov_core_cpu(cpu);
+		if (!gc->enabled || gc->gov != &interactive_gov)
+			continue;
+
+		freq = cpufreq_interactive_boost_floor(gc);
+		if (gc->target_freq < freq) {
+			cpufreq_gov_core_set_target(gc, freq,
+						    CPUFREQ_RELATION_H);
+			kick = 1;
 		}
 	}
 
-	return 0;
+	if (kick)
+		boost_count++;
 }
 
-static void cpufreq_interactive_freq_down(struct work_struct *work)
+static void cpufreq_interactive_input_event(struct input_handle *handle,
+		unsigned int type, unsigned int code, int value)
 {
-	unsigned int cpu;
-	cpumask_t tmp_mask = down_cpumask;
-	struct cpufreq_interactive_cpuinfo *pcpu;
-
-	for_each_cpu(cpu, &tmp_mask) {
-		cpumask_clear_cpu(cpu, &down_cpumask);
-		pcpu = &per_cpu(cpuinfo, cpu);
+	if (!boost_freq || !boost_duration)
+		return;
 
-		__cpufreq_driver_target(pcpu->policy,
-					pcpu->target_freq,
-					CPUFREQ_RELATION_H);
+	boost_input_events++;
+	/* a touch reports many coordinates, one boost per half period */
+	if (time_before(jiffies, boost_until -
+			usecs_to_jiffies(boost_duration) / 2))
+		return;
 
-		pcpu->freq_change_time_in_idle =
-			get_cpu_idle_time_us(cpu,
-					     &pcpu->freq_change_time);
-		dbgpr("down %d: set tgt=%d (actual=%d)\n", cpu, pcpu->target_freq, pcpu->policy->cur);
-	}
+	cpufreq_interactive_boost();
 }
 
-static ssize_t show_min_sample_time(struct cpufreq_policy *policy, char *buf)
+static int cpufreq_interactive_input_connect(struct input_handler *handler,
+		struct input_dev *dev, const struct input_device_id *id)
 {
-	return sprintf(buf, "%lu\n", min_sample_time);
+	struct input_handle *handle;
+	int error;
+
+	handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_interactive";
+
+	error = input_register_handle(handle);
+	if (error)
+		goto err_register;
+
+	error = input_open_device(handle);
+	if (error)
+		goto err_open;
+
+	return 0;
+
+err_open:
+	input_unregister_handle(handle);
+err_register:
+	kfree(handle);
+	return error;
 }
 
-static ssize_t store_min_sample_time(struct cpufreq_policy *policy, const char *buf, size_t count)
+static void cpufreq_interactive_input_disconnect(struct input_handle *handle)
 {
-	return strict_strtoul(buf, 0, &min_sample_time);
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
 }
 
-static struct freq_attr min_sample_time_attr = __ATTR(min_sample_time, 0644,
-		show_min_sample_time, store_min_sample_time);
-
-static struct attribute * interactive_attributes[] = {
-	&min_sample_time_attr.attr,
-	NULL,
+/* Touchscreens and keys: whatever a user touches before expecting a frame */
+static const struct input_device_id cpufreq_interactive_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_MT_POSITION_X)] =
+			    BIT_MASK(ABS_MT_POSITION_X) },
+	},
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_X)] = BIT_MASK(ABS_X) },
+	},
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
 };
 
-static struct attribute_group interactive_attr_group = {
-	.attrs = interactive_attributes,
-	.name = "interactive",
+static struct input_handler cpufreq_interactive_input_handler = {
+	.event = cpufreq_interactive_input_event,
+	.connect = cpufreq_interactive_input_connect,
+	.disconnect = cpufreq_interactive_input_disconnect,
+	.name = "cpufreq_interactive",
+	.id_table = cpufreq_interactive_ids,
 };
 
-static int cpufreq_governor_interactive(struct cpufreq_policy *new_policy,
-		unsigned int event)
+/* The governor runs without input boost if registering the handler failed */
+static bool input_registered;
+
+static int cpufreq_interactive_start(struct cpufreq_gov_cpu *gc)
 {
-	int rc;
-	struct cpufreq_interactive_cpuinfo *pcpu =
-		&per_cpu(cpuinfo, new_policy->cpu);
-
-	switch (event) {
-	case CPUFREQ_GOV_START:
-		if (!cpu_online(new_policy->cpu))
-			return -EINVAL;
-
-		pcpu->policy = new_policy;
-		pcpu->freq_table = cpufreq_frequency_get_table(new_policy->cpu);
-		pcpu->target_freq = new_policy->cur;
-		pcpu->freq_change_time_in_idle =
-			get_cpu_idle_time_us(new_policy->cpu,
-					     &pcpu->freq_change_time);
-		pcpu->governor_enabled = 1;
-		/*
-		 * Do not register the idle hook and create sysfs
-		 * entries if we have already done so.
-		 */
-		if (atomic_inc_return(&active_count) > 1)
-			return 0;
-
-		rc = sysfs_create_group(&new_policy->kobj, &interactive_attr_group);
-		if (rc)
-			return rc;
-		pm_idle_old = pm_idle;
-		pm_idle = cpufreq_interactive_idle;
-		break;
-
-	case CPUFREQ_GOV_STOP:
-		pcpu->governor_enabled = 0;
-
-		if (atomic_dec_return(&active_count) > 0)
-			return 0;
-		sysfs_remove_group(&new_policy->kobj,
-				&interactive_attr_group);
-
-		pm_idle = pm_idle_old;
-		del_timer(&pcpu->cpu_timer);
-		break;
-
-	case CPUFREQ_GOV_LIMITS:
-		if (new_policy->max < new_policy->cur)
-			__cpufreq_driver_target(new_policy,
-					new_policy->max, CPUFREQ_RELATION_H);
-		else if (new_policy->min > new_policy->cur)
-			__cpufreq_driver_target(new_policy,
-					new_policy->min, CPUFREQ_RELATION_L);
-		break;
+	per_cpu(cpuinfo, gc->cpu).load_ewma = 0;
+
+	if (++active_count == 1) {
+		input_registered = !input_register_handler(
+					&cpufreq_interactive_input_handler);
+		if (!input_registered)
+			pr_warning("cpufreq_interactive: no input boost\n");
 	}
 	return 0;
 }
 
-
-static int __init cpufreq_interactive_init(void)
-{	
-	unsigned int i;
-	struct cpufreq_interactive_cpuinfo *pcpu;
-	struct sched_param param = { .sched_priority = MAX_RT_PRIO-1 };
-
-	min_sample_time = DEFAULT_MIN_SAMPLE_TIME;
-
-	/* Initalize per-cpu timers */
-	for_each_possible_cpu(i) {
-		pcpu = &per_cpu(cpuinfo, i);
-		init_timer(&pcpu->cpu_timer);
-		pcpu->cpu_timer.function = cpufreq_interactive_timer;
-		pcpu->cpu_timer.data = i;
+static void cpufreq_interactive_stop(struct cpufreq_gov_cpu *gc)
+{
+	if (--active_count == 0 && input_registered) {
+		input_unregister_handler(&cpufreq_interactive_input_handler);
+		input_registered = false;
 	}
+}
 
-	up_task = kthread_create(cpufreq_interactive_up_task, NULL,
-				 "kinteractiveup");
-	if (IS_ERR(up_task))
-		return PTR_ERR(up_task);
-
-	sched_setscheduler_nocheck(up_task, SCHED_FIFO, &param);
-	get_task_struct(up_task);
-
-	/* No rescuer thread, bind to CPU queuing the work for possibly
-	   warm cache (probably doesn't matter much). */
-	down_wq = create_workqueue("knteractive_down");
-
-	if (! down_wq)
-		goto err_freeuptask;
+static struct cpufreq_gov_policy interactive_gov = {
+	.name = "interactive",
+	.sample = cpufreq_interactive_sample,
+	.start = cpufreq_interactive_start,
+	.stop = cpufreq_interactive_stop,
+	.attr_group = &interactive_attr_group,
+	.sample_jiffies = SAMPLE_JIFFIES,
+};
 
-	INIT_WORK(&freq_scale_down_work,
-		  cpufreq_interactive_freq_down);
+static int cpufreq_governor_interactive(struct cpufreq_policy *new_policy,
+		unsigned int event)
+{
+	return cpufreq_gov_core_event(&interactive_gov, new_policy, event);
+}
 
-#if DEBUG
-	spin_lock_init(&dbgpr_lock);
-	dbg_proc = create_proc_entry("igov", S_IWUSR | S_IRUGO, NULL);
-	dbg_proc->read_proc = dbg_proc_read;
-#endif
+static int __init cpufreq_interactive_init(void)
+{
+	min_sample_time = DEFAULT_MIN_SAMPLE_TIME;
+	boost_duration = DEFAULT_BOOST_DURATION;
+	load_ewma_weight = DEFAULT_LOAD_EWMA_WEIGHT;
 
 	return cpufreq_register_governor(&cpufreq_gov_interactive);
-
-err_freeuptask:
-	put_task_struct(up_task);
-	return -ENOMEM;
 }
 
 #ifdef CONFIG_CPU_FREQ_DEFAULT_GOV_INTERACTIVE
@@ -632,9 +425,6 @@ module_init(cpufreq_interactive_init);
 static void __exit cpufreq_interactive_exit(void)
 {
 	cpufreq_unregister_governor(&cpufreq_gov_interactive);
-	kthread_stop(up_task);
-	put_task_struct(up_task);
-	destroy_workqueue(down_wq);
 }
 
 module_exit(cpufreq_interactive_exit);
@@ -27,9 +27,13 @@
 #include <linux/workqueue.h>
 #include <linux/jiffies.h>
 #include <linux/kernel_stat.h>
+#include <linux/math64.h>
 #include <linux/percpu.h>
 #include <linux/mutex.h>
 #include <linux/earlysuspend.h>
+
+#include "cpufreq_gov_core.h"
+
 /*
  * dbs is used in this file as a shortform for demandbased switching
  * It helps to keep variable names smaller, simpler
@@ -53,7 +57,7 @@
  * All times here are in uS.
  */
 static unsigned int def_sampling_rate;
-unsigned int suspended = 0;
+static unsigned int suspended = 0;
 #define MIN_SAMPLING_RATE_RATIO			(2)
 /* for correct statistics, we need at least 10 ticks between each measure */
 #define MIN_STAT_SAMPLING_RATE			\
@@ -65,30 +69,21 @@ unsigned int suspended = 0;
 #define MAX_SAMPLING_DOWN_FACTOR		(10)
 #define TRANSITION_LATENCY_LIMIT		(10 * 1000 * 1000)
 
-static void do_dbs_timer(struct work_struct *work);
-
 struct cpu_dbs_info_s {
-	struct cpufreq_policy *cur_policy;
-	unsigned int prev_cpu_idle_up;
-	unsigned int prev_cpu_idle_down;
-	unsigned int enable;
+	cputime64_t prev_cpu_nice;
 	unsigned int down_skip;
+	unsigned int down_busy_us;	/* busy time over the down samples */
+	unsigned int down_window_us;
 	unsigned int requested_freq;
 };
 static DEFINE_PER_CPU(struct cpu_dbs_info_s, cpu_dbs_info);
 
 static unsigned int dbs_enable;	/* number of CPUs using this policy */
 
-/*
- * DEADLOCK ALERT! There is a ordering requirement between cpu_hotplug
- * lock and dbs_mutex. cpu_hotplug lock should always be held before
- * dbs_mutex. If any function that can potentially take cpu_hotplug lock
- * (like __cpufreq_driver_target()) is being called with dbs_mutex taken, then
- * cpu_hotplug lock should be taken before that. Note that cpu_hotplug lock
- * is recursive for the same process. -Venki
- */
+/* Serializes the tunables */
 static DEFINE_MUTEX (dbs_mutex);
-static DECLARE_DELAYED_WORK(dbs_work, do_dbs_timer);
+
+static struct cpufreq_gov_policy lagfree_gov;
 
 struct dbs_tuners {
 	unsigned int sampling_rate;
@@ -107,41 +102,26 @@ static struct dbs_tuners dbs_tuners_ins = {
 	//.freq_step = 5,
 };
 
-static inline unsigned int get_cpu_idle_time(unsigned int cpu)
-{
-	unsigned int add_nice = 0, ret;
-
-	if (dbs_tuners_ins.ignore_nice)
-		add_nice = kstat_cpu(cpu).cpustat.nice;
-
-	ret = kstat_cpu(cpu).cpustat.idle +
-		kstat_cpu(cpu).cpustat.iowait +
-		add_nice;
-
-	return ret;
-}
-
-/* keep track of frequency transitions */
-static int
-dbs_cpufreq_notifier(struct notifier_block *nb, unsigned long val,
-		     void *data)
+/*
+ * The core counts nice time as busy. With ignore_nice, take the nice time
+ * since the last sample back out of the busy time.
+ */
+static unsigned int get_cpu_busy_us(unsigned int cpu,
+				    const struct cpufreq_gov_sample *s)
 {
-	struct cpufreq_freqs *freq = data;
-	struct cpu_dbs_info_s *this_dbs_info = &per_cpu(cpu_dbs_info,
-							freq->cpu);
-
-	if (!this_dbs_info->enable)
-		return 0;
+	struct cpu_dbs_info_s *this_dbs_info = &per_cpu(cpu_dbs_info, cpu);
+	cputime64_t cur_nice = kstat_cpu(cpu).cpustat.nice;
+	unsigned int nice_us;
 
-	this_dbs_info->requested_freq = freq->new;
+	nice_us = jiffies_to_usecs(cputime64_to_jiffies64(
+		cputime64_sub(cur_nice, this_dbs_info->prev_cpu_nice)));
+	this_dbs_info->prev_cpu_nice = cur_nice;
 
-	return 0;
+	if (!dbs_tuners_ins.ignore_nice)
+		return s->busy_us;
+	return nice_us > s->busy_us ? 0 : s->busy_us - nice_us;
 }
 
-static struct notifier_block dbs_cpufreq_notifier_block = {
-	.notifier_call = dbs_cpufreq_notifier
-};
-
 /************************** sysfs interface ************************/
 static ssize_t show_sampling_rate_max(struct cpufreq_policy *policy, char *buf)
 {
@@ -204,6 +184,7 @@ static ssize_t store_sampling_rate(struct cpufreq_policy *unused,
 	}
 
 	dbs_tuners_ins.sampling_rate = input;
+	lagfree_gov.sample_jiffies = usecs_to_jiffies(input);
 	mutex_unlock(&dbs_mutex);
 
 	return count;
@@ -269,12 +250,12 @@ static ssize_t store_ignore_nice_load(struct cpufreq_policy *policy,
 	}
 	dbs_tuners_ins.ignore_nice = input;
 
-	/* we need to re-evaluate prev_cpu_idle_up and prev_cpu_idle_down */
+	/* we need to re-evaluate the down samples taken so far */
 	for_each_online_cpu(j) {
 		struct cpu_dbs_info_s *j_dbs_info;
 		j_dbs_info = &per_cpu(cpu_dbs_info, j);
-		j_dbs_info->prev_cpu_idle_up = get_cpu_idle_time(j);
-		j_dbs_info->prev_cpu_idle_down = j_dbs_info->prev_cpu_idle_up;
+		j_dbs_info->down_busy_us = 0;
+		j_dbs_info->down_window_us = 0;
 	}
 	mutex_unlock(&dbs_mutex);
 
@@ -334,19 +315,13 @@ static struct attribute_group dbs_attr_group = {
 
 /************************** sysfs end ************************/
 
-static void dbs_check_cpu(int cpu)
+static unsigned int dbs_check_cpu(struct cpufreq_gov_cpu *gc,
+		const struct cpufreq_gov_sample *s, unsigned int *relation)
 {
-	unsigned int idle_ticks, up_idle_ticks, down_idle_ticks;
-	unsigned int tmp_idle_ticks, total_idle_ticks;
+	unsigned int busy_us, load;
 	unsigned int freq_target;
-	unsigned int freq_down_sampling_rate;
-	struct cpu_dbs_info_s *this_dbs_info = &per_cpu(cpu_dbs_info, cpu);
-	struct cpufreq_policy *policy;
-
-	if (!this_dbs_info->enable)
-		return;
-
-	policy = this_dbs_info->cur_policy;
+	struct cpu_dbs_info_s *this_dbs_info = &per_cpu(cpu_dbs_info, gc->cpu);
+	struct cpufreq_policy *policy = gc->policy;
 
 	/*
 	 * The default safe range is 20% to 80%
@@ -362,31 +337,20 @@ static void dbs_check_cpu(int cpu)
 	 * 5% (default) of max_frequency
 	 */
 
-	/* Check for frequency increase */
-	idle_ticks = UINT_MAX;
+	*relation = CPUFREQ_RELATION_H;
 
 	/* Check for frequency increase */
-	total_idle_ticks = get_cpu_idle_time(cpu);
-	tmp_idle_ticks = total_idle_ticks -
-		this_dbs_info->prev_cpu_idle_up;
-	this_dbs_info->prev_cpu_idle_up = total_idle_ticks;
+	busy_us = get_cpu_busy_us(gc->cpu, s);
+	load = div_u64((u64) busy_us * 100, s->window_us);
 
-	if (tmp_idle_ticks < idle_ticks)
-		idle_ticks = tmp_idle_ticks;
-
-	/* Scale idle ticks by 100 and compare with up and down ticks */
-	idle_ticks *= 100;
-	up_idle_ticks = (100 - dbs_tuners_ins.up_threshold) *
-			usecs_to_jiffies(dbs_tuners_ins.sampling_rate);
-
-	if (idle_ticks < up_idle_ticks) {
+	if (load > dbs_tuners_ins.up_threshold) {
 		this_dbs_info->down_skip = 0;
-		this_dbs_info->prev_cpu_idle_down =
-			this_dbs_info->prev_cpu_idle_up;
+		this_dbs_info->down_busy_us = 0;
+		this_dbs_info->down_window_us = 0;
 
 		/* if we are already at full speed then break out early */
 		if (this_dbs_info->requested_freq == policy->max && !suspended)
-			return;
+			return 0;
 
 		//freq_target = (dbs_tuners_ins.freq_step * policy->max) / 100;
 		if (suspended)
@@ -410,35 +374,24 @@ static void dbs_check_cpu(int cpu)
 		if (!suspended && this_dbs_info->requested_freq < FREQ_AWAKE_MIN)
 		    this_dbs_info->requested_freq = FREQ_AWAKE_MIN;
 
-		__cpufreq_driver_target(policy, this_dbs_info->requested_freq,
-			CPUFREQ_RELATION_H);
-		return;
+		return this_dbs_info->requested_freq;
 	}
 
 	/* Check for frequency decrease */
+	this_dbs_info->down_busy_us += busy_us;
+	this_dbs_info->down_window_us += s->window_us;
 	this_dbs_info->down_skip++;
 	if (this_dbs_info->down_skip < dbs_tuners_ins.sampling_down_factor)
-		return;
+		return 0;
 
 	/* Check for frequency decrease */
-	total_idle_ticks = this_dbs_info->prev_cpu_idle_up;
-	tmp_idle_ticks = total_idle_ticks -
-		this_dbs_info->prev_cpu_idle_down;
-	this_dbs_info->prev_cpu_idle_down = total_idle_ticks;
-
-	if (tmp_idle_ticks < idle_ticks)
-		idle_ticks = tmp_idle_ticks;
-
-	/* Scale idle ticks by 100 and compare with up and down ticks */
-	idle_ticks *= 100;
+	load = div_u64((u64) this_dbs_info->down_busy_us * 100,
+		       this_dbs_info->down_window_us);
 	this_dbs_info->down_skip = 0;
+	this_dbs_info->down_busy_us = 0;
+	this_dbs_info->down_window_us = 0;
 
-	freq_down_sampling_rate = dbs_tuners_ins.sampling_rate *
-		dbs_tuners_ins.sampling_down_factor;
-	down_idle_ticks = (100 - dbs_tuners_ins.down_threshold) *
-		usecs_to_jiffies(freq_down_sampling_rate);
-
-	if (idle_ticks > down_idle_ticks) {
+	if (load < dbs_tuners_ins.down_threshold) {
 		/*
 		 * if we are already at the lowest speed then break out early
 		 * or if we 'cannot' reduce the speed as the user might want
@@ -446,7 +399,7 @@ static void dbs_check_cpu(int cpu)
 		 */
 		if (this_dbs_info->requested_freq == policy->min && suspended
 				/*|| dbs_tuners_ins.freq_step == 0*/)
-			return;
+			return 0;
 
 		//freq_target = (dbs_tuners_ins.freq_step * policy->max) / 100;
 		freq_target = FREQ_STEP_DOWN; //policy->max;
@@ -472,139 +425,72 @@ static void dbs_check_cpu(int cpu)
 		if (suspended && this_dbs_info->requested_freq > FREQ_SLEEP_MAX)
 		    this_dbs_info->requested_freq = FREQ_SLEEP_MAX;
 
-		__cpufreq_driver_target(policy, this_dbs_info->requested_freq,
-				CPUFREQ_RELATION_H);
-		return;
+		return this_dbs_info->requested_freq;
 	}
+	return 0;
 }
 
-static void do_dbs_timer(struct work_struct *work)
+static int dbs_start(struct cpufreq_gov_cpu *gc)
 {
-	int i;
+	struct cpu_dbs_info_s *this_dbs_info = &per_cpu(cpu_dbs_info, gc->cpu);
+
 	mutex_lock(&dbs_mutex);
-	for_each_online_cpu(i)
-		dbs_check_cpu(i);
-	schedule_delayed_work(&dbs_work,
-			usecs_to_jiffies(dbs_tuners_ins.sampling_rate));
+	this_dbs_info->prev_cpu_nice = kstat_cpu(gc->cpu).cpustat.nice;
+	this_dbs_info->down_skip = 0;
+	this_dbs_info->down_busy_us = 0;
+	this_dbs_info->down_window_us = 0;
+	this_dbs_info->requested_freq = gc->policy->cur;
+
+	dbs_enable++;
+	/*
+	 * Pick the sampling rate when this governor is used for the
+	 * first time
+	 */
+	if (dbs_enable == 1) {
+		unsigned int latency;
+		/* policy latency is in nS. Convert it to uS first */
+		latency = gc->policy->cpuinfo.transition_latency / 1000;
+		if (latency == 0)
+			latency = 1;
+
+		def_sampling_rate = 10 * latency *
+			CONFIG_CPU_FREQ_SAMPLING_LATENCY_MULTIPLIER;
+
+		if (def_sampling_rate < MIN_STAT_SAMPLING_RATE)
+			def_sampling_rate = MIN_STAT_SAMPLING_RATE;
+
+		dbs_tuners_ins.sampling_rate = def_sampling_rate;
+		lagfree_gov.sample_jiffies = usecs_to_jiffies(def_sampling_rate);
+	}
 	mutex_unlock(&dbs_mutex);
+	return 0;
 }
 
-static inline void dbs_timer_init(void)
+static void dbs_stop(struct cpufreq_gov_cpu *gc)
 {
-	init_timer_deferrable(&dbs_work.timer);
-	schedule_delayed_work(&dbs_work,
-			usecs_to_jiffies(dbs_tuners_ins.sampling_rate));
-	return;
+	mutex_lock(&dbs_mutex);
+	dbs_enable--;
+	mutex_unlock(&dbs_mutex);
 }
 
-static inline void dbs_timer_exit(void)
+static void dbs_limits(struct cpufreq_gov_cpu *gc)
 {
-	cancel_delayed_work(&dbs_work);
-	return;
+	per_cpu(cpu_dbs_info, gc->cpu).requested_freq = gc->policy->cur;
 }
 
+static struct cpufreq_gov_policy lagfree_gov = {
+	.name = "lagfree",
+	.sample = dbs_check_cpu,
+	.start = dbs_start,
+	.stop = dbs_stop,
+	.limits = dbs_limits,
+	.attr_group = &dbs_attr_group,
+};
+
 static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 				   unsigned int event)
 {
-	unsigned int cpu = policy->cpu;
-	struct cpu_dbs_info_s *this_dbs_info;
-	unsigned int j;
-	int rc;
-
-	this_dbs_info = &per_cpu(cpu_dbs_info, cpu);
-
-	switch (event) {
-	case CPUFREQ_GOV_START:
-		if ((!cpu_online(cpu)) || (!policy->cur))
-			return -EINVAL;
-
-		if (this_dbs_info->enable) /* Already enabled */
-			break;
-
-		mutex_lock(&dbs_mutex);
-
-		rc = sysfs_create_group(&policy->kobj, &dbs_attr_group);
-		if (rc) {
-			mutex_unlock(&dbs_mutex);
-			return rc;
-		}
-
-		for_each_cpu(j, policy->cpus) {
-			struct cpu_dbs_info_s *j_dbs_info;
-			j_dbs_info = &per_cpu(cpu_dbs_info, j);
-			j_dbs_info->cur_policy = policy;
-
-			j_dbs_info->prev_cpu_idle_up = get_cpu_idle_time(cpu);
-			j_dbs_info->prev_cpu_idle_down
-				= j_dbs_info->prev_cpu_idle_up;
-		}
-		this_dbs_info->enable = 1;
-		this_dbs_info->down_skip = 0;
-		this_dbs_info->requested_freq = policy->cur;
-
-		dbs_enable++;
-		/*
-		 * Start the timerschedule work, when this governor
-		 * is used for first time
-		 */
-		if (dbs_enable == 1) {
-			unsigned int latency;
-			/* policy latency is in nS. Convert it to uS first */
-			latency = policy->cpuinfo.transition_latency / 1000;
-			if (latency == 0)
-				latency = 1;
-
-			def_sampling_rate = 10 * latency *
-				CONFIG_CPU_FREQ_SAMPLING_LATENCY_MULTIPLIER;
-
-			if (def_sampling_rate < MIN_STAT_SAMPLING_RATE)
-				def_sampling_rate = MIN_STAT_SAMPLING_RATE;
-
-			dbs_tuners_ins.sampling_rate = def_sampling_rate;
-
-			dbs_timer_init();
-			cpufreq_register_notifier(
-					&dbs_cpufreq_notifier_block,
-					CPUFREQ_TRANSITION_NOTIFIER);
-		}
-
-		mutex_unlock(&dbs_mutex);
-		break;
-
-	case CPUFREQ_GOV_STOP:
-		mutex_lock(&dbs_mutex);
-		this_dbs_info->enable = 0;
-		sysfs_remove_group(&policy->kobj, &dbs_attr_group);
-		dbs_enable--;
-		/*
-		 * Stop the timerschedule work, when this governor
-		 * is used for first time
-		 */
-		if (dbs_enable == 0) {
-			dbs_timer_exit();
-			cpufreq_unregister_notifier(
-					&dbs_cpufreq_notifier_block,
-					CPUFREQ_TRANSITION_NOTIFIER);
-		}
-
-		mutex_unlock(&dbs_mutex);
-
-		break;
-
-	case CPUFREQ_GOV_LIMITS:
-		mutex_lock(&dbs_mutex);
-		if (policy->max < this_dbs_info->cur_policy->cur)
-			__cpufreq_driver_target(
-					this_dbs_info->cur_policy,
-					policy->max, CPUFREQ_RELATION_H);
-		else if (policy->min > this_dbs_info->cur_policy->cur)
-			__cpufreq_driver_target(
-					this_dbs_info->cur_policy,
-					policy->min, CPUFREQ_RELATION_L);
-		mutex_unlock(&dbs_mutex);
-		break;
-	}
-	return 0;
+	return cpufreq_gov_core_event(&lagfree_gov, policy, event);
 }
 
 #ifndef CONFIG_CPU_FREQ_DEFAULT_GOV_LAGFREE
@@ -639,9 +525,6 @@ static int __init cpufreq_gov_dbs_init(void)
 
 static void __exit cpufreq_gov_dbs_exit(void)
 {
-	/* Make sure that the scheduled work is indeed not running */
-	flush_scheduled_work();
-
 	unregister_early_suspend(&lagfree_power_suspend);
 	cpufreq_unregister_governor(&cpufreq_gov_lagfree);
 }
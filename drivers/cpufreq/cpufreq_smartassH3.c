@@ -4,13 +4,11 @@
 #include <linux/cpumask.h>
 #include <linux/cpufreq.h>
 #include <linux/sched.h>
-#include <linux/tick.h>
-#include <linux/timer.h>
-#include <linux/workqueue.h>
 #include <linux/moduleparam.h>
-#include <asm/cputime.h>
 #include <linux/earlysuspend.h>
 
+#include "cpufreq_gov_core.h"
+
 #define DEFAULT_AWAKE_IDEAL_FREQ 768000
 static unsigned int awake_ideal_freq;
 #define DEFAULT_SLEEP_IDEAL_FREQ 245760
@@ -30,32 +28,12 @@ static unsigned long down_rate_us;
 #define DEFAULT_SLEEP_WAKEUP_FREQ 998400
 static unsigned int sleep_wakeup_freq;
 #define DEFAULT_SAMPLE_RATE_JIFFIES 2
-static unsigned int sample_rate_jiffies;
-
-static void (*pm_idle_old)(void);
-static atomic_t active_count = ATOMIC_INIT(0);
 
 struct smartass_info_s {
-	struct cpufreq_policy *cur_policy;
-	struct cpufreq_frequency_table *freq_table;
-	struct timer_list timer;
-	u64 time_in_idle;
-	u64 idle_exit_time;
-	u64 freq_change_time;
-	u64 freq_change_time_in_idle;
-	int cur_cpu_load;
-	int old_freq;
-	int ramp_dir;
-	unsigned int enable;
 	int ideal_speed;
 };
 
 static DEFINE_PER_CPU(struct smartass_info_s, smartass_info);
-static struct workqueue_struct *up_wq;
-static struct workqueue_struct *down_wq;
-static struct work_struct freq_scale_work;
-static cpumask_t work_cpumask;
-static spinlock_t cpumask_lock;
 static unsigned int suspended;
 
 enum {
@@ -65,6 +43,8 @@ enum {
 };
 
 static unsigned long debug_mask;
+static struct cpufreq_gov_policy smartass_gov;
+
 static int cpufreq_governor_smartass_h3(struct cpufreq_policy *policy,
 		unsigned int event);
 
@@ -94,9 +74,9 @@ inline static void smartass_update_min_max(struct smartass_info_s *this_smartass
 inline static void smartass_update_min_max_allcpus(void) {
 	unsigned int i;
 	for_each_online_cpu(i) {
-		struct smartass_info_s *this_smartass = &per_cpu(smartass_info, i);
-		if (this_smartass->enable)
-			smartass_update_min_max(this_smartass,this_smartass->cur_policy,suspended);
+		struct cpufreq_gov_cpu *gc = cpufreq_gov_core_cpu(i);
+		if (gc->enabled && gc->gov == &smartass_gov)
+			smartass_update_min_max(&per_cpu(smartass_info, i),gc->policy,suspended);
 	}
 }
 
@@ -108,31 +88,10 @@ inline static unsigned int validate_freq(struct cpufreq_policy *policy, int freq
 	return freq;
 }
 
-inline static void reset_timer(unsigned long cpu, struct smartass_info_s *this_smartass) {
-	this_smartass->time_in_idle = get_cpu_idle_time_us(cpu, &this_smartass->idle_exit_time);
-	mod_timer(&this_smartass->timer, jiffies + sample_rate_jiffies);
-}
-
-inline static void work_cpumask_set(unsigned long cpu) {
-	unsigned long flags;
-	spin_lock_irqsave(&cpumask_lock, flags);
-	cpumask_set_cpu(cpu, &work_cpumask);
-	spin_unlock_irqrestore(&cpumask_lock, flags);
-}
-
-inline static int work_cpumask_test_and_clear(unsigned long cpu) {
-	unsigned long flags;
-	int res = 0;
-	spin_lock_irqsave(&cpumask_lock, flags);
-	res = test_and_clear_bit(cpu, work_cpumask.bits);
-	spin_unlock_irqrestore(&cpumask_lock, flags);
-	return res;
-}
-
-inline static int target_freq(struct cpufreq_policy *policy, struct smartass_info_s *this_smartass,
+inline static int target_freq(struct cpufreq_policy *policy, struct cpufreq_gov_cpu *gc,
 			      int new_freq, int old_freq, int prefered_relation) {
 	int index, target;
-	struct cpufreq_frequency_table *table = this_smartass->freq_table;
+	struct cpufreq_frequency_table *table = gc->freq_table;
 
 	if (new_freq == old_freq)
 		return 0;
@@ -160,153 +119,60 @@ inline static int target_freq(struct cpufreq_policy *policy, struct smartass_inf
 		}
 	}
 	else target = new_freq;
-	__cpufreq_driver_target(policy, target, prefered_relation);
 	return target;
 }
 
-static void cpufreq_smartass_timer(unsigned long cpu)
+static unsigned int cpufreq_smartass_sample(struct cpufreq_gov_cpu *gc,
+		const struct cpufreq_gov_sample *s, unsigned int *relation)
 {
-	u64 delta_idle;
-	u64 delta_time;
-	int cpu_load;
-	int old_freq;
-	u64 update_time;
-	u64 now_idle;
-	int queued_work = 0;
-	struct smartass_info_s *this_smartass = &per_cpu(smartass_info, cpu);
-	struct cpufreq_policy *policy = this_smartass->cur_policy;
-
-	now_idle = get_cpu_idle_time_us(cpu, &update_time);
-	old_freq = policy->cur;
-
-	if (this_smartass->idle_exit_time == 0 || update_time == this_smartass->idle_exit_time)
-		return;
-
-	delta_idle = cputime64_sub(now_idle, this_smartass->time_in_idle);
-	delta_time = cputime64_sub(update_time, this_smartass->idle_exit_time);
-
-	if (delta_time < 1000) {
-		if (!timer_pending(&this_smartass->timer))
-			reset_timer(cpu,this_smartass);
-		return;
-	}
+	struct smartass_info_s *this_smartass = &per_cpu(smartass_info, gc->cpu);
+	struct cpufreq_policy *policy = gc->policy;
+	int cpu_load = s->load;
+	int old_freq = policy->cur;
+	int new_freq;
 
-	if (delta_idle > delta_time)
-		cpu_load = 0;
-	else
-		cpu_load = 100 * (unsigned int)(delta_time - delta_idle) / (unsigned int)delta_time;
-	this_smartass->cur_cpu_load = cpu_load;
-	this_smartass->old_freq = old_freq;
+	*relation = CPUFREQ_RELATION_L;
 
-	if (cpu_load > max_cpu_load || delta_idle == 0)
+	if (cpu_load > max_cpu_load || s->busy_us == s->window_us)
 	{
-		if (old_freq < policy->max &&
-			 (old_freq < this_smartass->ideal_speed || delta_idle == 0 ||
-			  cputime64_sub(update_time, this_smartass->freq_change_time) >= up_rate_us))
-		{
-			this_smartass->ramp_dir = 1;
-			work_cpumask_set(cpu);
-			queue_work(up_wq, &freq_scale_work);
-			queued_work = 1;
+		if (old_freq >= policy->max ||
+		    (old_freq >= this_smartass->ideal_speed && s->busy_us != s->window_us &&
+		     s->since_change_us < up_rate_us))
+			return 0;
+		if (nr_running() <= 1)
+			return 0;
+
+		if (old_freq < this_smartass->ideal_speed)
+			new_freq = this_smartass->ideal_speed;
+		else if (ramp_up_step) {
+			new_freq = old_freq + ramp_up_step;
+			*relation = CPUFREQ_RELATION_H;
+		}
+		else {
+			new_freq = policy->max;
+			*relation = CPUFREQ_RELATION_H;
 		}
-		else this_smartass->ramp_dir = 0;
 	}
 	else if (cpu_load < min_cpu_load && old_freq > policy->min &&
 		 (old_freq > this_smartass->ideal_speed ||
-		  cputime64_sub(update_time, this_smartass->freq_change_time) >= down_rate_us))
+		  s->since_change_us >= down_rate_us))
 	{
-		this_smartass->ramp_dir = -1;
-		work_cpumask_set(cpu);
-		queue_work(down_wq, &freq_scale_work);
-		queued_work = 1;
-	}
-	else this_smartass->ramp_dir = 0;
-
-	if (!queued_work && old_freq < policy->max)
-		reset_timer(cpu,this_smartass);
-}
-
-static void cpufreq_idle(void)
-{
-	struct smartass_info_s *this_smartass = &per_cpu(smartass_info, smp_processor_id());
-	struct cpufreq_policy *policy = this_smartass->cur_policy;
-
-	if (!this_smartass->enable) {
-		pm_idle_old();
-		return;
-	}
-
-	if (policy->cur == policy->min && timer_pending(&this_smartass->timer))
-		del_timer(&this_smartass->timer);
-
-	pm_idle_old();
-
-	if (!timer_pending(&this_smartass->timer))
-		reset_timer(smp_processor_id(), this_smartass);
-}
-
-static void cpufreq_smartass_freq_change_time_work(struct work_struct *work)
-{
-	unsigned int cpu;
-	int new_freq;
-	int old_freq;
-	int ramp_dir;
-	struct smartass_info_s *this_smartass;
-	struct cpufreq_policy *policy;
-	unsigned int relation = CPUFREQ_RELATION_L;
-	for_each_possible_cpu(cpu) {
-		this_smartass = &per_cpu(smartass_info, cpu);
-		if (!work_cpumask_test_and_clear(cpu))
-			continue;
-
-		ramp_dir = this_smartass->ramp_dir;
-		this_smartass->ramp_dir = 0;
-
-		old_freq = this_smartass->old_freq;
-		policy = this_smartass->cur_policy;
-
-		if (old_freq != policy->cur) {
-			new_freq = old_freq;
-		}
-		else if (ramp_dir > 0 && nr_running() > 1) {
-			if (old_freq < this_smartass->ideal_speed)
-				new_freq = this_smartass->ideal_speed;
-			else if (ramp_up_step) {
-				new_freq = old_freq + ramp_up_step;
-				relation = CPUFREQ_RELATION_H;
-			}
-			else {
-				new_freq = policy->max;
-				relation = CPUFREQ_RELATION_H;
-			}
-		}
-		else if (ramp_dir < 0) {
-			if (old_freq > this_smartass->ideal_speed) {
-				new_freq = this_smartass->ideal_speed;
-				relation = CPUFREQ_RELATION_H;
-			}
-			else if (ramp_down_step)
-				new_freq = old_freq - ramp_down_step;
-			else {
-				new_freq = old_freq * this_smartass->cur_cpu_load / max_cpu_load;
-				if (new_freq > old_freq)
-					new_freq = old_freq -1;
-			}
+		if (old_freq > this_smartass->ideal_speed) {
+			new_freq = this_smartass->ideal_speed;
+			*relation = CPUFREQ_RELATION_H;
 		}
+		else if (ramp_down_step)
+			new_freq = old_freq - ramp_down_step;
 		else {
-			new_freq = old_freq;
+			new_freq = old_freq * cpu_load / max_cpu_load;
+			if (new_freq > old_freq)
+				new_freq = old_freq -1;
 		}
-
-		new_freq = target_freq(policy,this_smartass,new_freq,old_freq,relation);
-		if (new_freq)
-			this_smartass->freq_change_time_in_idle =
-				get_cpu_idle_time_us(cpu,&this_smartass->freq_change_time);
-
-		if (new_freq < policy->max)
-			reset_timer(cpu,this_smartass);
-		else if (timer_pending(&this_smartass->timer))
-			del_timer(&this_smartass->timer);
 	}
+	else
+		return 0;
+
+	return target_freq(policy,gc,new_freq,old_freq,*relation);
 }
 
 static ssize_t show_debug_mask(struct cpufreq_policy *policy, char *buf)
@@ -407,7 +273,7 @@ static ssize_t store_awake_ideal_freq(struct cpufreq_policy *policy, const char
 
 static ssize_t show_sample_rate_jiffies(struct cpufreq_policy *policy, char *buf)
 {
-	return sprintf(buf, "%u\n", sample_rate_jiffies);
+	return sprintf(buf, "%lu\n", smartass_gov.sample_jiffies);
 }
 
 static ssize_t store_sample_rate_jiffies(struct cpufreq_policy *policy, const char *buf, size_t count)
@@ -416,7 +282,7 @@ static ssize_t store_sample_rate_jiffies(struct cpufreq_policy *policy, const ch
 	unsigned long input;
 	res = strict_strtoul(buf, 0, &input);
 	if (res >= 0 && input > 0 && input <= 1000)
-		sample_rate_jiffies = input;
+		smartass_gov.sample_jiffies = input;
 	return count;
 }
 
@@ -516,96 +382,43 @@ static struct attribute_group smartass_attr_group = {
 	.name = "smartassH3",
 };
 
-static int cpufreq_governor_smartass_h3(struct cpufreq_policy *new_policy, unsigned int event)
+static int smartass_start(struct cpufreq_gov_cpu *gc)
 {
-	unsigned int cpu = new_policy->cpu;
-	int rc;
-	struct smartass_info_s *this_smartass = &per_cpu(smartass_info, cpu);
-
-	switch (event) {
-	case CPUFREQ_GOV_START:
-		if ((!cpu_online(cpu)) || (!new_policy->cur))
-			return -EINVAL;
-
-		this_smartass->cur_policy = new_policy;
-
-		this_smartass->enable = 1;
-
-		smartass_update_min_max(this_smartass,new_policy,suspended);
-
-		this_smartass->freq_table = cpufreq_frequency_get_table(cpu);
-		if (!this_smartass->freq_table)
-		smp_wmb();
-
-		if (atomic_inc_return(&active_count) <= 1) {
-			rc = sysfs_create_group(&new_policy->kobj, &smartass_attr_group);
-			if (rc)
-				return rc;
-
-			pm_idle_old = pm_idle;
-			pm_idle = cpufreq_idle;
-		}
-
-		if (this_smartass->cur_policy->cur < new_policy->max && !timer_pending(&this_smartass->timer))
-			reset_timer(cpu,this_smartass);
-
-		break;
-
-	case CPUFREQ_GOV_LIMITS:
-		smartass_update_min_max(this_smartass,new_policy,suspended);
-
-		if (this_smartass->cur_policy->cur > new_policy->max) {
-			__cpufreq_driver_target(this_smartass->cur_policy,
-						new_policy->max, CPUFREQ_RELATION_H);
-		}
-		else if (this_smartass->cur_policy->cur < new_policy->min) {
-			__cpufreq_driver_target(this_smartass->cur_policy,
-						new_policy->min, CPUFREQ_RELATION_L);
-		}
-
-		if (this_smartass->cur_policy->cur < new_policy->max && !timer_pending(&this_smartass->timer))
-			reset_timer(cpu,this_smartass);
-
-		break;
+	smartass_update_min_max(&per_cpu(smartass_info, gc->cpu),gc->policy,suspended);
+	return 0;
+}
 
-	case CPUFREQ_GOV_STOP:
-		this_smartass->enable = 0;
-		smp_wmb();
-		del_timer(&this_smartass->timer);
-		flush_work(&freq_scale_work);
-		this_smartass->idle_exit_time = 0;
+static void smartass_limits(struct cpufreq_gov_cpu *gc)
+{
+	smartass_update_min_max(&per_cpu(smartass_info, gc->cpu),gc->policy,suspended);
+}
 
-		if (atomic_dec_return(&active_count) <= 1) {
-			sysfs_remove_group(&new_policy->kobj,
-					   &smartass_attr_group);
-			pm_idle = pm_idle_old;
-		}
-		break;
-	}
+static struct cpufreq_gov_policy smartass_gov = {
+	.name = "smartassH3",
+	.sample = cpufreq_smartass_sample,
+	.start = smartass_start,
+	.limits = smartass_limits,
+	.attr_group = &smartass_attr_group,
+	.sample_jiffies = DEFAULT_SAMPLE_RATE_JIFFIES,
+};
 
-	return 0;
+static int cpufreq_governor_smartass_h3(struct cpufreq_policy *new_policy, unsigned int event)
+{
+	return cpufreq_gov_core_event(&smartass_gov, new_policy, event);
 }
 
 static void smartass_suspend(int cpu, int suspend)
 {
-	struct smartass_info_s *this_smartass = &per_cpu(smartass_info, smp_processor_id());
-	struct cpufreq_policy *policy = this_smartass->cur_policy;
-	unsigned int new_freq;
+	struct cpufreq_gov_cpu *gc = cpufreq_gov_core_cpu(cpu);
 
-	if (!this_smartass->enable)
+	if (!gc->enabled || gc->gov != &smartass_gov)
 		return;
 
-	smartass_update_min_max(this_smartass,policy,suspend);
-	if (!suspend) {
-		new_freq = validate_freq(policy,sleep_wakeup_freq);
-		__cpufreq_driver_target(policy, new_freq,
-					CPUFREQ_RELATION_L);
-	} else {
-		this_smartass->freq_change_time_in_idle =
-			get_cpu_idle_time_us(cpu,&this_smartass->freq_change_time);
-	}
-
-	reset_timer(smp_processor_id(),this_smartass);
+	smartass_update_min_max(&per_cpu(smartass_info, cpu),gc->policy,suspend);
+	if (!suspend)
+		cpufreq_gov_core_set_target(gc,
+					    validate_freq(gc->policy,sleep_wakeup_freq),
+					    CPUFREQ_RELATION_L);
 }
 
 static void smartass_early_suspend(struct early_suspend *handler) {
@@ -633,45 +446,18 @@ static struct early_suspend smartass_power_suspend = {
 
 static int __init cpufreq_smartass_init(void)
 {
-	unsigned int i;
-	struct smartass_info_s *this_smartass;
 	debug_mask = 0;
 	up_rate_us = DEFAULT_UP_RATE_US;
 	down_rate_us = DEFAULT_DOWN_RATE_US;
 	sleep_ideal_freq = DEFAULT_SLEEP_IDEAL_FREQ;
 	sleep_wakeup_freq = DEFAULT_SLEEP_WAKEUP_FREQ;
 	awake_ideal_freq = DEFAULT_AWAKE_IDEAL_FREQ;
-	sample_rate_jiffies = DEFAULT_SAMPLE_RATE_JIFFIES;
 	ramp_up_step = DEFAULT_RAMP_UP_STEP;
 	ramp_down_step = DEFAULT_RAMP_DOWN_STEP;
 	max_cpu_load = DEFAULT_MAX_CPU_LOAD;
 	min_cpu_load = DEFAULT_MIN_CPU_LOAD;
-	spin_lock_init(&cpumask_lock);
 	suspended = 0;
 
-	for_each_possible_cpu(i) {
-		this_smartass = &per_cpu(smartass_info, i);
-		this_smartass->enable = 0;
-		this_smartass->cur_policy = 0;
-		this_smartass->ramp_dir = 0;
-		this_smartass->time_in_idle = 0;
-		this_smartass->idle_exit_time = 0;
-		this_smartass->freq_change_time = 0;
-		this_smartass->freq_change_time_in_idle = 0;
-		this_smartass->cur_cpu_load = 0;
-		init_timer_deferrable(&this_smartass->timer);
-		this_smartass->timer.function = cpufreq_smartass_timer;
-		this_smartass->timer.data = i;
-		work_cpumask_test_and_clear(i);
-	}
-
-	up_wq = create_rt_workqueue("ksmartass_up");
-	down_wq = create_workqueue("ksmartass_down");
-	if (!up_wq || !down_wq)
-		return -ENOMEM;
-
-	INIT_WORK(&freq_scale_work, cpufreq_smartass_freq_change_time_work);
-
 	register_early_suspend(&smartass_power_suspend);
 
 	return cpufreq_register_governor(&cpufreq_gov_smartass_h3);
@@ -685,13 +471,11 @@ module_init(cpufreq_smartass_init);
 
 static void __exit cpufreq_smartass_exit(void)
 {
+	unregister_early_suspend(&smartass_power_suspend);
 	cpufreq_unregister_governor(&cpufreq_gov_smartass_h3);
-	destroy_workqueue(up_wq);
-	destroy_workqueue(down_wq);
 }
 
 module_exit(cpufreq_smartass_exit);
 MODULE_AUTHOR ("Erasmux, moded by FeraVolt");
 MODULE_DESCRIPTION ("'cpufreq_smartassH3' - A smart cpufreq governor");
 MODULE_LICENSE ("GPL");
-
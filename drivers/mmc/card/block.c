@@ -22,6 +22,7 @@
 #include <linux/init.h>
 
 #include <linux/kernel.h>
+#include <linux/debugfs.h>
 #include <linux/fs.h>
 #include <linux/errno.h>
 #include <linux/hdreg.h>
@@ -29,6 +30,7 @@
 #include <linux/blkdev.h>
 #include <linux/mutex.h>
 #include <linux/scatterlist.h>
+#include <linux/seq_file.h>
 #include <linux/string_helpers.h>
 
 #include <linux/mmc/card.h>
@@ -49,6 +51,11 @@ MODULE_ALIAS("mmc:block");
 #define MMC_SHIFT	4
 #define MMC_NUM_MINORS	(256 >> MMC_SHIFT)
 
+/*
+ * Default cap on the write requests coalesced into one transfer.
+ */
+#define MMC_BLK_PACKED_MAX	16
+
 static DECLARE_BITMAP(dev_use, MMC_NUM_MINORS);
 
 /*
@@ -61,6 +68,15 @@ struct mmc_blk_data {
 
 	unsigned int	usage;
 	unsigned int	read_only;
+
+	/* Write coalescing, see mmc_blk_pack_writes() */
+	u32		packed_max;	/* 0 or 1 turns it off */
+	unsigned long	write_transfers;
+	unsigned long	packed_transfers;
+	unsigned long	packed_reqs;
+	unsigned long	packed_fallbacks;
+	unsigned int	packed_most;
+	struct dentry	*debugfs_root;
 };
 
 static DEFINE_MUTEX(open_lock);
@@ -144,13 +160,6 @@ static struct block_device_operations mmc_bdops = {
 	.owner			= THIS_MODULE,
 };
 
-struct mmc_blk_request {
-	struct mmc_request	mrq;
-	struct mmc_command	cmd;
-	struct mmc_command	stop;
-	struct mmc_data		data;
-};
-
 static u32 mmc_sd_num_wr_blocks(struct mmc_card *card)
 {
 	int err;
@@ -268,208 +277,339 @@ mmc_blk_set_blksize(struct mmc_blk_data *md, struct mmc_card *card)
 }
 
 
-static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
+/*
+ * Waits for the card to leave programming mode after a write.
+ */
+static int mmc_blk_wait_for_ready(struct mmc_card *card, struct request *req)
 {
-	struct mmc_blk_data *md = mq->data;
-	struct mmc_card *card = md->queue.card;
-	struct mmc_blk_request brq;
-	int ret = 1, disable_multi = 0;
-
-#ifdef CONFIG_MMC_BLOCK_DEFERRED_RESUME
-	if (mmc_bus_needs_resume(card->host)) {
-		mmc_resume_bus(card->host);
-		mmc_blk_set_blksize(md, card);
-	}
-#endif
-
-	mmc_claim_host(card->host);
+	struct mmc_command cmd;
 
 	do {
-		struct mmc_command cmd;
-		u32 readcmd, writecmd, status = 0;
-
-		memset(&brq, 0, sizeof(struct mmc_blk_request));
-		brq.mrq.cmd = &brq.cmd;
-		brq.mrq.data = &brq.data;
-
-		brq.cmd.arg = req->sector;
-		if (!mmc_card_blockaddr(card))
-			brq.cmd.arg <<= 9;
-		brq.cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-		brq.data.blksz = 512;
-		brq.stop.opcode = MMC_STOP_TRANSMISSION;
-		brq.stop.arg = 0;
-		brq.stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
-		brq.data.blocks = req->nr_sectors;
+		int err;
 
+		cmd.opcode = MMC_SEND_STATUS;
+		cmd.arg = card->rca << 16;
+		cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
+		err = mmc_wait_for_cmd(card->host, &cmd, 5);
+		if (err) {
+			printk(KERN_ERR "%s: error %d requesting status\n",
+			       req->rq_disk->disk_name, err);
+			return err;
+		}
 		/*
-		 * The block layer doesn't support all sector count
-		 * restrictions, so we need to be prepared for too big
-		 * requests.
+		 * Some cards mishandle the status bits,
+		 * so make sure to check both the busy
+		 * indication and the card state.
 		 */
-		if (brq.data.blocks > card->host->max_blk_count)
-			brq.data.blocks = card->host->max_blk_count;
+	} while (!(cmd.resp[0] & R1_READY_FOR_DATA) ||
+		(R1_CURRENT_STATE(cmd.resp[0]) == 7));
 
-		/*
-		 * After a read error, we redo the request one sector at a time
-		 * in order to accurately determine which sectors can be read
-		 * successfully.
-		 */
-		if (disable_multi && brq.data.blocks > 1)
-			brq.data.blocks = 1;
+#if 0
+	if (cmd.resp[0] & ~0x00000900)
+		printk(KERN_ERR "%s: status = %08x\n",
+		       req->rq_disk->disk_name, cmd.resp[0]);
+	if (mmc_decode_status(cmd.resp))
+		return -EIO;
+#endif
+	return 0;
+}
 
-		if (brq.data.blocks > 1) {
-			/* SPI multiblock writes terminate using a special
-			 * token, not a STOP_TRANSMISSION request.
-			 */
-			if (!mmc_host_is_spi(card->host)
-					|| rq_data_dir(req) == READ)
-				brq.mrq.stop = &brq.stop;
-			readcmd = MMC_READ_MULTIPLE_BLOCK;
-			writecmd = MMC_WRITE_MULTIPLE_BLOCK;
-		} else {
-			brq.mrq.stop = NULL;
-			readcmd = MMC_READ_SINGLE_BLOCK;
-			writecmd = MMC_WRITE_BLOCK;
-		}
+/*
+ * Small writes each pay for a command, a stop and the status polling that
+ * waits out programming. Writes queued back to back on the card are taken
+ * off the queue along with mqrq->req and sent as one multiple block write,
+ * up to what the host can take in a single transfer. Returns the number of
+ * sectors in the transfer.
+ */
+static unsigned int mmc_blk_pack_writes(struct mmc_queue *mq,
+					struct mmc_queue_req *mqrq,
+					struct mmc_card *card)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_host *host = card->host;
+	struct request *req = mqrq->req, *next;
+	unsigned int max_sectors, max_segs, sectors, segs;
 
-		if (rq_data_dir(req) == READ) {
-			brq.cmd.opcode = readcmd;
-			brq.data.flags |= MMC_DATA_READ;
-		} else {
-			brq.cmd.opcode = writecmd;
-			brq.data.flags |= MMC_DATA_WRITE;
-		}
+	mqrq->packed_nr = 1;
+	sectors = req->nr_sectors;
 
-		mmc_set_data_timeout(&brq.data, card);
+	if (rq_data_dir(req) != WRITE)
+		return sectors;
+	md->write_transfers++;
 
-		brq.data.sg = mq->sg;
-		brq.data.sg_len = mmc_queue_map_sg(mq);
+	/*
+	 * Nothing is coalesced through a bounce buffer, into a barrier or
+	 * while the requests of a failed coalesced write are redone one by
+	 * one. Nor is anything pulled ahead of a request already taken for
+	 * the next transfer.
+	 */
+	if (md->packed_max < 2 || mqrq->bounce_buf || blk_barrier_rq(req) ||
+	    !list_empty(&mqrq->packed_list) ||
+	    (mqrq == mq->mqrq_cur && mq->mqrq_next->req))
+		return sectors;
+
+	max_sectors = min(host->max_blk_count, host->max_req_size / 512);
+	max_segs = min_t(unsigned int, mq->queue->max_hw_segments,
+			 mq->queue->max_phys_segments);
+	segs = req->nr_phys_segments;
+
+	while (mqrq->packed_nr < md->packed_max &&
+	       sectors < max_sectors && segs < max_segs) {
+		next = mmc_queue_fetch_adjacent(mq, req, max_sectors - sectors,
+						max_segs - segs);
+		if (!next)
+			break;
+		list_add_tail(&next->queuelist, &mqrq->packed_list);
+		mqrq->packed_nr++;
+		sectors += next->nr_sectors;
+		segs += next->nr_phys_segments;
+		req = next;
+	}
 
-		/*
-		 * Adjust the sg list so it is the same size as the
-		 * request.
-		 */
-		if (brq.data.blocks != req->nr_sectors) {
-			int i, data_size = brq.data.blocks << 9;
-			struct scatterlist *sg;
-
-			for_each_sg(brq.data.sg, sg, brq.data.sg_len, i) {
-				data_size -= sg->length;
-				if (data_size <= 0) {
-					sg->length += data_size;
-					i++;
-					break;
-				}
-			}
-			brq.data.sg_len = i;
+	if (mqrq->packed_nr > 1) {
+		md->packed_transfers++;
+		md->packed_reqs += mqrq->packed_nr;
+		if (mqrq->packed_nr > md->packed_most)
+			md->packed_most = mqrq->packed_nr;
+	}
+	return sectors;
+}
+
+/*
+ * Completes the requests of a coalesced write, in order, as far as the
+ * host reports data transferred. Returns 1 if part of the first request
+ * is left to do; what is left of the others stays on packed_list, to be
+ * redone one request at a time.
+ */
+static int mmc_blk_packed_end(struct mmc_blk_data *md,
+			      struct mmc_queue_req *mqrq)
+{
+	unsigned int bytes = mqrq->brq.data.bytes_xfered;
+	struct request *req = mqrq->req;
+	unsigned int n;
+	int ret;
+
+	mqrq->packed_nr = 1;
+
+	spin_lock_irq(&md->lock);
+	n = min(bytes, blk_rq_bytes(req));
+	bytes -= n;
+	ret = n < blk_rq_bytes(req);
+	if (n)
+		__blk_end_request(req, 0, n);
+
+	while (!ret && bytes && !list_empty(&mqrq->packed_list)) {
+		req = list_entry(mqrq->packed_list.next, struct request,
+				 queuelist);
+		n = min(bytes, blk_rq_bytes(req));
+		bytes -= n;
+		if (n < blk_rq_bytes(req)) {
+			__blk_end_request(req, 0, n);
+			break;
 		}
+		list_del_init(&req->queuelist);
+		__blk_end_request(req, 0, n);
+	}
+	spin_unlock_irq(&md->lock);
 
-		mmc_queue_bounce_pre(mq);
+	return ret;
+}
 
-		mmc_wait_for_req(card->host, &brq.mrq);
+/*
+ * Builds the transfer for what is left of mqrq->req and maps its data.
+ * This is the CPU-side work the queue overlaps with the transfer before.
+ */
+static void mmc_blk_rw_rq_prep(struct mmc_queue *mq, struct mmc_queue_req *mqrq,
+			       struct mmc_card *card, int disable_multi)
+{
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
+	u32 readcmd, writecmd;
+
+	memset(brq, 0, sizeof(struct mmc_blk_request));
+	brq->mrq.cmd = &brq->cmd;
+	brq->mrq.data = &brq->data;
+
+	brq->cmd.arg = req->sector;
+	if (!mmc_card_blockaddr(card))
+		brq->cmd.arg <<= 9;
+	brq->cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	brq->data.blksz = 512;
+	brq->stop.opcode = MMC_STOP_TRANSMISSION;
+	brq->stop.arg = 0;
+	brq->stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	brq->data.blocks = mmc_blk_pack_writes(mq, mqrq, card);
 
-		mmc_queue_bounce_post(mq);
+	/*
+	 * The block layer doesn't support all sector count
+	 * restrictions, so we need to be prepared for too big
+	 * requests.
+	 */
+	if (brq->data.blocks > card->host->max_blk_count)
+		brq->data.blocks = card->host->max_blk_count;
 
-		/*
-		 * Check for errors here, but don't jump to cmd_err
-		 * until later as we need to wait for the card to leave
-		 * programming mode even when things go wrong.
+	/*
+	 * After a read error, we redo the request one sector at a time
+	 * in order to accurately determine which sectors can be read
+	 * successfully.
+	 */
+	if (disable_multi && brq->data.blocks > 1)
+		brq->data.blocks = 1;
+
+	if (brq->data.blocks > 1) {
+		/* SPI multiblock writes terminate using a special
+		 * token, not a STOP_TRANSMISSION request.
 		 */
-		if (brq.cmd.error || brq.data.error || brq.stop.error) {
-			if (brq.data.blocks > 1 && rq_data_dir(req) == READ) {
-				/* Redo read one sector at a time */
-				printk(KERN_WARNING "%s: retrying using single "
-				       "block read\n", req->rq_disk->disk_name);
-				disable_multi = 1;
-				continue;
+		if (!mmc_host_is_spi(card->host)
+				|| rq_data_dir(req) == READ)
+			brq->mrq.stop = &brq->stop;
+		readcmd = MMC_READ_MULTIPLE_BLOCK;
+		writecmd = MMC_WRITE_MULTIPLE_BLOCK;
+	} else {
+		brq->mrq.stop = NULL;
+		readcmd = MMC_READ_SINGLE_BLOCK;
+		writecmd = MMC_WRITE_BLOCK;
+	}
+
+	if (rq_data_dir(req) == READ) {
+		brq->cmd.opcode = readcmd;
+		brq->data.flags |= MMC_DATA_READ;
+	} else {
+		brq->cmd.opcode = writecmd;
+		brq->data.flags |= MMC_DATA_WRITE;
+	}
+
+	mmc_set_data_timeout(&brq->data, card);
+
+	brq->data.sg = mqrq->sg;
+	brq->data.sg_len = mmc_queue_map_sg(mq, mqrq);
+
+	/*
+	 * Adjust the sg list so it is the same size as the
+	 * request.
+	 */
+	if (brq->data.blocks != req->nr_sectors) {
+		int i, data_size = brq->data.blocks << 9;
+		struct scatterlist *sg;
+
+		for_each_sg(brq->data.sg, sg, brq->data.sg_len, i) {
+			data_size -= sg->length;
+			if (data_size <= 0) {
+				sg->length += data_size;
+				i++;
+				break;
 			}
-			status = get_card_status(card, req);
-		} else if (disable_multi == 1) {
-			disable_multi = 0;
 		}
+		brq->data.sg_len = i;
+	}
 
-		if (brq.cmd.error) {
-			printk(KERN_ERR "%s: error %d sending read/write "
-			       "command, response %#x, card status %#x\n",
-			       req->rq_disk->disk_name, brq.cmd.error,
-			       brq.cmd.resp[0], status);
-		}
+	mmc_queue_bounce_pre(mq, mqrq);
+}
 
-		if (brq.data.error) {
-			if (brq.data.error == -ETIMEDOUT && brq.mrq.stop)
-				/* 'Stop' response contains card status */
-				status = brq.mrq.stop->resp[0];
-			printk(KERN_ERR "%s: error %d transferring data,"
-			       " sector %u, nr %u, card status %#x\n",
-			       req->rq_disk->disk_name, brq.data.error,
-			       (unsigned)req->sector,
-			       (unsigned)req->nr_sectors, status);
-		}
+/*
+ * Finishes a transfer started on mqrq: checks for errors, waits for the
+ * card to leave programming mode and completes what was transferred.
+ * Returns non-zero if part of mqrq->req is still left to transfer.
+ */
+static int mmc_blk_rw_complete(struct mmc_blk_data *md,
+			       struct mmc_queue_req *mqrq,
+			       struct mmc_card *card, int *disable_multi)
+{
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
+	u32 status = 0;
+	int ret = 1;
+
+	mmc_queue_bounce_post(&md->queue, mqrq);
 
-		if (brq.stop.error) {
-			printk(KERN_ERR "%s: error %d sending stop command, "
-			       "response %#x, card status %#x\n",
-			       req->rq_disk->disk_name, brq.stop.error,
-			       brq.stop.resp[0], status);
+	/*
+	 * Check for errors here, but don't jump to cmd_err
+	 * until later as we need to wait for the card to leave
+	 * programming mode even when things go wrong.
+	 */
+	if (brq->cmd.error || brq->data.error || brq->stop.error) {
+		if (brq->data.blocks > 1 && rq_data_dir(req) == READ) {
+			/* Redo read one sector at a time */
+			printk(KERN_WARNING "%s: retrying using single "
+			       "block read\n", req->rq_disk->disk_name);
+			*disable_multi = 1;
+			return 1;
+		}
+		if (mqrq->packed_nr > 1) {
+			/*
+			 * Written data may be partly on the card; redo the
+			 * requests one at a time and let the normal error
+			 * handling sort out which of them fail.
+			 */
+			printk(KERN_WARNING "%s: coalesced write of %u "
+			       "requests failed, retrying them one by one\n",
+			       req->rq_disk->disk_name, mqrq->packed_nr);
+			if (!mmc_host_is_spi(card->host))
+				mmc_blk_wait_for_ready(card, req);
+			md->packed_fallbacks++;
+			mqrq->packed_nr = 1;
+			return 1;
 		}
+		status = get_card_status(card, req);
+	} else if (*disable_multi == 1) {
+		*disable_multi = 0;
+	}
+
+	if (brq->cmd.error) {
+		printk(KERN_ERR "%s: error %d sending read/write "
+		       "command, response %#x, card status %#x\n",
+		       req->rq_disk->disk_name, brq->cmd.error,
+		       brq->cmd.resp[0], status);
+	}
 
-		if (!mmc_host_is_spi(card->host) && rq_data_dir(req) != READ) {
-			do {
-				int err;
-
-				cmd.opcode = MMC_SEND_STATUS;
-				cmd.arg = card->rca << 16;
-				cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
-				err = mmc_wait_for_cmd(card->host, &cmd, 5);
-				if (err) {
-					printk(KERN_ERR "%s: error %d requesting status\n",
-					       req->rq_disk->disk_name, err);
-					goto cmd_err;
-				}
-				/*
-				 * Some cards mishandle the status bits,
-				 * so make sure to check both the busy
-				 * indication and the card state.
-				 */
-			} while (!(cmd.resp[0] & R1_READY_FOR_DATA) ||
-				(R1_CURRENT_STATE(cmd.resp[0]) == 7));
+	if (brq->data.error) {
+		if (brq->data.error == -ETIMEDOUT && brq->mrq.stop)
+			/* 'Stop' response contains card status */
+			status = brq->mrq.stop->resp[0];
+		printk(KERN_ERR "%s: error %d transferring data,"
+		       " sector %u, nr %u, card status %#x\n",
+		       req->rq_disk->disk_name, brq->data.error,
+		       (unsigned)req->sector,
+		       (unsigned)req->nr_sectors, status);
+	}
 
-#if 0
-			if (cmd.resp[0] & ~0x00000900)
-				printk(KERN_ERR "%s: status = %08x\n",
-				       req->rq_disk->disk_name, cmd.resp[0]);
-			if (mmc_decode_status(cmd.resp))
-				goto cmd_err;
-#endif
-		}
+	if (brq->stop.error) {
+		printk(KERN_ERR "%s: error %d sending stop command, "
+		       "response %#x, card status %#x\n",
+		       req->rq_disk->disk_name, brq->stop.error,
+		       brq->stop.resp[0], status);
+	}
 
-		if (brq.cmd.error || brq.stop.error || brq.data.error) {
-			if (rq_data_dir(req) == READ) {
-				/*
-				 * After an error, we redo I/O one sector at a
-				 * time, so we only reach here after trying to
-				 * read a single sector.
-				 */
-				spin_lock_irq(&md->lock);
-				ret = __blk_end_request(req, -EIO, brq.data.blksz);
-				spin_unlock_irq(&md->lock);
-				continue;
-			}
+	if (!mmc_host_is_spi(card->host) && rq_data_dir(req) != READ) {
+		if (mmc_blk_wait_for_ready(card, req))
 			goto cmd_err;
-		}
+	}
 
-		/*
-		 * A block was successfully transferred.
-		 */
-		spin_lock_irq(&md->lock);
-		ret = __blk_end_request(req, 0, brq.data.bytes_xfered);
-		spin_unlock_irq(&md->lock);
-	} while (ret);
+	if (brq->cmd.error || brq->stop.error || brq->data.error) {
+		if (rq_data_dir(req) == READ) {
+			/*
+			 * After an error, we redo I/O one sector at a
+			 * time, so we only reach here after trying to
+			 * read a single sector.
+			 */
+			spin_lock_irq(&md->lock);
+			ret = __blk_end_request(req, -EIO, brq->data.blksz);
+			spin_unlock_irq(&md->lock);
+			return ret;
+		}
+		goto cmd_err;
+	}
 
-	mmc_release_host(card->host);
+	if (mqrq->packed_nr > 1)
+		return mmc_blk_packed_end(md, mqrq);
 
-	return 1;
+	/*
+	 * A block was successfully transferred.
+	 */
+	spin_lock_irq(&md->lock);
+	ret = __blk_end_request(req, 0, brq->data.bytes_xfered);
+	spin_unlock_irq(&md->lock);
+	return ret;
 
  cmd_err:
  	/*
@@ -491,12 +631,10 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 		}
 	} else {
 		spin_lock_irq(&md->lock);
-		ret = __blk_end_request(req, 0, brq.data.bytes_xfered);
+		ret = __blk_end_request(req, 0, brq->data.bytes_xfered);
 		spin_unlock_irq(&md->lock);
 	}
 
-	mmc_release_host(card->host);
-
 	spin_lock_irq(&md->lock);
 	while (ret)
 		ret = __blk_end_request(req, -EIO, blk_rq_cur_bytes(req));
@@ -505,6 +643,68 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 	return 0;
 }
 
+/*
+ * Issues req, which the queue thread put in mq->mqrq_cur, as a two stage
+ * pipeline: while a transfer is on the bus, the next request is taken off
+ * the queue and prepared, and it is started as soon as the current one is
+ * complete. Returns when the queue has nothing more to hand over.
+ */
+static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = md->queue.card;
+	struct mmc_queue_req *mqrq = mq->mqrq_cur;
+	int disable_multi = 0, prepared = 0;
+
+#ifdef CONFIG_MMC_BLOCK_DEFERRED_RESUME
+	if (mmc_bus_needs_resume(card->host)) {
+		mmc_resume_bus(card->host);
+		mmc_blk_set_blksize(md, card);
+	}
+#endif
+
+	mmc_claim_host(card->host);
+
+	while (mqrq->req) {
+		if (!prepared)
+			mmc_blk_rw_rq_prep(mq, mqrq, card, disable_multi);
+		prepared = 0;
+
+		mmc_start_req_nowait(card->host, &mqrq->brq.mrq, &mqrq->done);
+
+		/* While that is on the bus, get the next request ready. */
+		if (!mq->mqrq_next->req && mmc_queue_fetch_next(mq))
+			mmc_blk_rw_rq_prep(mq, mq->mqrq_next, card, 0);
+
+		wait_for_completion(&mqrq->done);
+
+		if (mmc_blk_rw_complete(md, mqrq, card, &disable_multi))
+			continue;
+
+		/* What is left of a failed coalesced write goes on its own. */
+		if (!list_empty(&mqrq->packed_list)) {
+			mqrq->req = list_entry(mqrq->packed_list.next,
+					       struct request, queuelist);
+			list_del_init(&mqrq->req->queuelist);
+			disable_multi = 0;
+			continue;
+		}
+
+		/* Done with this one; go straight on to the prepared one. */
+		mqrq->req = NULL;
+		mq->mqrq_cur = mq->mqrq_next;
+		mq->mqrq_next = mqrq;
+		mqrq = mq->mqrq_cur;
+		mq->req = mqrq->req;
+		prepared = mqrq->req != NULL;
+		disable_multi = 0;
+	}
+
+	mmc_release_host(card->host);
+
+	return 1;
+}
+
 
 static inline int mmc_blk_readonly(struct mmc_card *card)
 {
@@ -534,6 +734,7 @@ static struct mmc_blk_data *mmc_blk_alloc(struct mmc_card *card)
 	 * and the write protect switch.
 	 */
 	md->read_only = mmc_blk_readonly(card);
+	md->packed_max = MMC_BLK_PACKED_MAX;
 
 	md->disk = alloc_disk(1 << MMC_SHIFT);
 	if (md->disk == NULL) {
@@ -598,6 +799,92 @@ static struct mmc_blk_data *mmc_blk_alloc(struct mmc_card *card)
 	return ERR_PTR(ret);
 }
 
+#ifdef CONFIG_DEBUG_FS
+static int mmc_blk_packed_show(struct seq_file *m, void *unused)
+{
+	struct mmc_blk_data *md = m->private;
+
+	seq_printf(m, "write_transfers\t%lu\n", md->write_transfers);
+	seq_printf(m, "packed_transfers\t%lu\n", md->packed_transfers);
+	seq_printf(m, "packed_requests\t%lu\n", md->packed_reqs);
+	seq_printf(m, "packed_most\t%u\n", md->packed_most);
+	seq_printf(m, "fallbacks\t%lu\n", md->packed_fallbacks);
+	return 0;
+}
+
+static int mmc_blk_packed_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc_blk_packed_show, inode->i_private);
+}
+
+static int mmc_blk_bounce_show(struct seq_file *m, void *unused)
+{
+	struct mmc_queue *mq = &((struct mmc_blk_data *)m->private)->queue;
+
+	seq_printf(m, "bounce_size\t%u\n", mq->bounce_size);
+	seq_printf(m, "bounced_bytes\t%llu\n",
+		   (unsigned long long)mq->bounced_bytes);
+	seq_printf(m, "bounced_requests\t%lu\n", mq->bounced_reqs);
+	seq_printf(m, "direct_requests\t%lu\n", mq->direct_reqs);
+	return 0;
+}
+
+static int mmc_blk_bounce_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc_blk_bounce_show, inode->i_private);
+}
+
+static const struct file_operations mmc_blk_packed_fops = {
+	.open		= mmc_blk_packed_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations mmc_blk_bounce_fops = {
+	.open		= mmc_blk_bounce_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * The card's own directory only appears once probing is done, so the
+ * disk gets one of its own under the host's.
+ */
+static void mmc_blk_add_debugfs(struct mmc_blk_data *md,
+				struct mmc_card *card)
+{
+	struct dentry *root;
+
+	if (!card->host->debugfs_root)
+		return;
+
+	root = debugfs_create_dir(md->disk->disk_name,
+				  card->host->debugfs_root);
+	if (IS_ERR_OR_NULL(root))
+		return;
+	md->debugfs_root = root;
+
+	debugfs_create_u32("packed_max", S_IRUSR | S_IWUSR, root,
+			   &md->packed_max);
+	debugfs_create_file("packed_stats", S_IRUSR, root, md,
+			    &mmc_blk_packed_fops);
+	debugfs_create_file("bounce_stats", S_IRUSR, root, md,
+			    &mmc_blk_bounce_fops);
+}
+
+static void mmc_blk_remove_debugfs(struct mmc_blk_data *md)
+{
+	debugfs_remove_recursive(md->debugfs_root);
+	md->debugfs_root = NULL;
+}
+#else
+static inline void mmc_blk_add_debugfs(struct mmc_blk_data *md,
+				       struct mmc_card *card) {}
+static inline void mmc_blk_remove_debugfs(struct mmc_blk_data *md) {}
+#endif
+
 static int mmc_blk_probe(struct mmc_card *card)
 {
 	struct mmc_blk_data *md;
@@ -630,6 +917,7 @@ static int mmc_blk_probe(struct mmc_card *card)
 	mmc_set_bus_resume_policy(card->host, 1);
 #endif
 	add_disk(md->disk);
+	mmc_blk_add_debugfs(md, card);
 	return 0;
 
  out:
@@ -644,6 +932,8 @@ static void mmc_blk_remove(struct mmc_card *card)
 	struct mmc_blk_data *md = mmc_get_drvdata(card);
 
 	if (md) {
+		mmc_blk_remove_debugfs(md);
+
 		/* Stop new requests from getting into the queue */
 		del_gendisk(md->disk);
 
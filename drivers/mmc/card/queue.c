@@ -21,7 +21,7 @@
 #include <linux/mmc/host.h>
 #include "queue.h"
 
-#define MMC_QUEUE_BOUNCESZ	65536
+#define MMC_QUEUE_BOUNCESZ_MAX	262144
 
 #define MMC_QUEUE_SUSPENDED	(1 << 0)
 
@@ -59,7 +59,10 @@ static int mmc_queue_thread(void *d)
 		set_current_state(TASK_INTERRUPTIBLE);
 		if (!blk_queue_plugged(q))
 			req = elv_next_request(q);
+		if (req)
+			blkdev_dequeue_request(req);
 		mq->req = req;
+		mq->mqrq_cur->req = req;
 		spin_unlock_irq(q->queue_lock);
 
 		if (!req) {
@@ -140,6 +143,78 @@ static void mmc_request(struct request_queue *q)
 		wake_up_process(mq->thread);
 }
 
+static void mmc_queue_free_bufs(struct mmc_queue *mq)
+{
+	struct mmc_queue_req *mqrq;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+		mqrq = &mq->mqrq[i];
+
+		kfree(mqrq->bounce_sg);
+		mqrq->bounce_sg = NULL;
+
+		kfree(mqrq->sg);
+		mqrq->sg = NULL;
+
+		if (mqrq->bounce_buf)
+			free_pages((unsigned long)mqrq->bounce_buf,
+				   mq->bounce_order);
+		mqrq->bounce_buf = NULL;
+	}
+}
+
+#ifdef CONFIG_MMC_BLOCK_BOUNCE
+/*
+ * Bounce buffers are as large as the host takes in one segment, up to
+ * MMC_QUEUE_BOUNCESZ_MAX, and are whole pages from a zone the host can
+ * reach. When memory is short, smaller ones are tried, down to a page.
+ * Returns the size each stage of the pipeline got, or 0 for none.
+ */
+static unsigned int mmc_queue_alloc_bounce_bufs(struct mmc_queue *mq,
+						u64 limit)
+{
+	struct mmc_host *host = mq->card->host;
+	unsigned int bouncesz = MMC_QUEUE_BOUNCESZ_MAX;
+	gfp_t gfp = GFP_KERNEL | __GFP_NOWARN;
+	int order, i;
+
+	if (bouncesz > host->max_req_size)
+		bouncesz = host->max_req_size;
+	if (bouncesz > host->max_seg_size)
+		bouncesz = host->max_seg_size;
+	if (bouncesz > (host->max_blk_count * 512))
+		bouncesz = host->max_blk_count * 512;
+	if (bouncesz <= 512)
+		return 0;
+
+	if (limit < BLK_BOUNCE_HIGH)
+		gfp |= GFP_DMA;
+
+	for (order = get_order(bouncesz); order >= 0; order--) {
+		mq->bounce_order = order;
+		for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+			mq->mqrq[i].bounce_buf =
+				(char *)__get_free_pages(gfp, order);
+			if (!mq->mqrq[i].bounce_buf)
+				break;
+		}
+		if (i == ARRAY_SIZE(mq->mqrq))
+			break;
+		mmc_queue_free_bufs(mq);
+	}
+	if (order < 0)
+		return 0;
+
+	if ((PAGE_SIZE << order) < bouncesz) {
+		bouncesz = PAGE_SIZE << order;
+		printk(KERN_INFO "%s: bounce buffer limited to %u bytes\n",
+		       mmc_card_name(mq->card), bouncesz);
+	}
+	return bouncesz;
+}
+#endif
+
 /**
  * mmc_init_queue - initialise a queue structure.
  * @mq: mmc queue
@@ -151,8 +226,9 @@ static void mmc_request(struct request_queue *q)
 int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock)
 {
 	struct mmc_host *host = card->host;
+	struct mmc_queue_req *mqrq;
 	u64 limit = BLK_BOUNCE_HIGH;
-	int ret;
+	int i, ret;
 
 	if (mmc_dev(host)->dma_mask && *mmc_dev(host)->dma_mask)
 		limit = *mmc_dev(host)->dma_mask;
@@ -169,55 +245,55 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 	blk_queue_ordered(mq->queue, QUEUE_ORDERED_DRAIN, NULL);
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, mq->queue);
 
+	mq->mqrq_cur = &mq->mqrq[0];
+	mq->mqrq_next = &mq->mqrq[1];
+	for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++)
+		INIT_LIST_HEAD(&mq->mqrq[i].packed_list);
+
 #ifdef CONFIG_MMC_BLOCK_BOUNCE
 	if (host->max_hw_segs == 1) {
 		unsigned int bouncesz;
 
-		bouncesz = MMC_QUEUE_BOUNCESZ;
-
-		if (bouncesz > host->max_req_size)
-			bouncesz = host->max_req_size;
-		if (bouncesz > host->max_seg_size)
-			bouncesz = host->max_seg_size;
-		if (bouncesz > (host->max_blk_count * 512))
-			bouncesz = host->max_blk_count * 512;
-
-		if (bouncesz > 512) {
-			mq->bounce_buf = kmalloc(bouncesz, GFP_KERNEL);
-			if (!mq->bounce_buf) {
-				printk(KERN_WARNING "%s: unable to "
-					"allocate bounce buffer\n",
-					mmc_card_name(card));
-			}
-		}
+		/* Each stage of the pipeline bounces through its own buffer */
+		bouncesz = mmc_queue_alloc_bounce_bufs(mq, limit);
+		if (!bouncesz)
+			printk(KERN_WARNING "%s: unable to "
+				"allocate bounce buffer\n",
+				mmc_card_name(card));
+		mq->bounce_size = bouncesz;
 
-		if (mq->bounce_buf) {
+		if (mq->mqrq[0].bounce_buf) {
 			blk_queue_bounce_limit(mq->queue, BLK_BOUNCE_ANY);
 			blk_queue_max_sectors(mq->queue, bouncesz / 512);
 			blk_queue_max_phys_segments(mq->queue, bouncesz / 512);
 			blk_queue_max_hw_segments(mq->queue, bouncesz / 512);
 			blk_queue_max_segment_size(mq->queue, bouncesz);
 
-			mq->sg = kmalloc(sizeof(struct scatterlist),
-				GFP_KERNEL);
-			if (!mq->sg) {
-				ret = -ENOMEM;
-				goto cleanup_queue;
-			}
-			sg_init_table(mq->sg, 1);
+			for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+				mqrq = &mq->mqrq[i];
 
-			mq->bounce_sg = kmalloc(sizeof(struct scatterlist) *
-				bouncesz / 512, GFP_KERNEL);
-			if (!mq->bounce_sg) {
-				ret = -ENOMEM;
-				goto cleanup_queue;
+				mqrq->sg = kmalloc(sizeof(struct scatterlist),
+					GFP_KERNEL);
+				if (!mqrq->sg) {
+					ret = -ENOMEM;
+					goto cleanup_queue;
+				}
+				sg_init_table(mqrq->sg, 1);
+
+				mqrq->bounce_sg = kmalloc(
+					sizeof(struct scatterlist) *
+					bouncesz / 512, GFP_KERNEL);
+				if (!mqrq->bounce_sg) {
+					ret = -ENOMEM;
+					goto cleanup_queue;
+				}
+				sg_init_table(mqrq->bounce_sg, bouncesz / 512);
 			}
-			sg_init_table(mq->bounce_sg, bouncesz / 512);
 		}
 	}
 #endif
 
-	if (!mq->bounce_buf) {
+	if (!mq->mqrq[0].bounce_buf) {
 		blk_queue_bounce_limit(mq->queue, limit);
 		blk_queue_max_sectors(mq->queue,
 			min(host->max_blk_count, host->max_req_size / 512));
@@ -225,13 +301,17 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 		blk_queue_max_hw_segments(mq->queue, host->max_hw_segs);
 		blk_queue_max_segment_size(mq->queue, host->max_seg_size);
 
-		mq->sg = kmalloc(sizeof(struct scatterlist) *
-			host->max_phys_segs, GFP_KERNEL);
-		if (!mq->sg) {
-			ret = -ENOMEM;
-			goto cleanup_queue;
+		for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+			mqrq = &mq->mqrq[i];
+
+			mqrq->sg = kmalloc(sizeof(struct scatterlist) *
+				host->max_phys_segs, GFP_KERNEL);
+			if (!mqrq->sg) {
+				ret = -ENOMEM;
+				goto cleanup_queue;
+			}
+			sg_init_table(mqrq->sg, host->max_phys_segs);
 		}
-		sg_init_table(mq->sg, host->max_phys_segs);
 	}
 
 	init_MUTEX(&mq->thread_sem);
@@ -239,21 +319,12 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 	mq->thread = kthread_run(mmc_queue_thread, mq, "mmcqd");
 	if (IS_ERR(mq->thread)) {
 		ret = PTR_ERR(mq->thread);
-		goto free_bounce_sg;
+		goto cleanup_queue;
 	}
 
 	return 0;
- free_bounce_sg:
- 	if (mq->bounce_sg)
- 		kfree(mq->bounce_sg);
- 	mq->bounce_sg = NULL;
  cleanup_queue:
- 	if (mq->sg)
-		kfree(mq->sg);
-	mq->sg = NULL;
-	if (mq->bounce_buf)
-		kfree(mq->bounce_buf);
-	mq->bounce_buf = NULL;
+	mmc_queue_free_bufs(mq);
 	blk_cleanup_queue(mq->queue);
 	return ret;
 }
@@ -275,16 +346,7 @@ void mmc_cleanup_queue(struct mmc_queue *mq)
 	blk_start_queue(q);
 	spin_unlock_irqrestore(q->queue_lock, flags);
 
- 	if (mq->bounce_sg)
- 		kfree(mq->bounce_sg);
- 	mq->bounce_sg = NULL;
-
-	kfree(mq->sg);
-	mq->sg = NULL;
-
-	if (mq->bounce_buf)
-		kfree(mq->bounce_buf);
-	mq->bounce_buf = NULL;
+	mmc_queue_free_bufs(mq);
 
 	mq->card = NULL;
 }
@@ -334,30 +396,125 @@ void mmc_queue_resume(struct mmc_queue *mq)
 	}
 }
 
+/**
+ * mmc_queue_fetch_next - take the request after the current one
+ * @mq: MMC queue
+ *
+ * Dequeues the next request, if there is one, into mq->mqrq_next, so the
+ * caller can prepare it while the current request is on the bus.
+ */
+struct request *mmc_queue_fetch_next(struct mmc_queue *mq)
+{
+	struct request_queue *q = mq->queue;
+	struct request *req = NULL;
+
+	spin_lock_irq(q->queue_lock);
+	if (!blk_queue_plugged(q))
+		req = elv_next_request(q);
+	if (req)
+		blkdev_dequeue_request(req);
+	mq->mqrq_next->req = req;
+	spin_unlock_irq(q->queue_lock);
+
+	return req;
+}
+
+/**
+ * mmc_queue_fetch_adjacent - take the next request if it continues a write
+ * @mq: MMC queue
+ * @prev: last request of the write being built up
+ * @max_sectors: sectors the transfer still has room for
+ * @max_segs: scatterlist entries the transfer still has room for
+ *
+ * Dequeues the next request only if it is a write that starts right where
+ * @prev ends and fits in what is left of the transfer.
+ */
+struct request *mmc_queue_fetch_adjacent(struct mmc_queue *mq,
+					 struct request *prev,
+					 unsigned int max_sectors,
+					 unsigned int max_segs)
+{
+	struct request_queue *q = mq->queue;
+	struct request *req = NULL;
+
+	spin_lock_irq(q->queue_lock);
+	if (!blk_queue_plugged(q))
+		req = elv_next_request(q);
+	if (req && (rq_data_dir(req) != WRITE || blk_barrier_rq(req) ||
+		    req->sector != prev->sector + prev->nr_sectors ||
+		    req->nr_sectors > max_sectors ||
+		    req->nr_phys_segments > max_segs))
+		req = NULL;
+	if (req)
+		blkdev_dequeue_request(req);
+	spin_unlock_irq(q->queue_lock);
+
+	return req;
+}
+
+/*
+ * A request that maps to a single segment the host can reach needs no
+ * bounce buffer; it is handed over as it is.
+ */
+static int mmc_queue_sg_direct(struct mmc_queue *mq, struct scatterlist *sg)
+{
+	struct device *dev = mmc_dev(mq->card->host);
+	u64 limit = BLK_BOUNCE_HIGH;
+
+	if (PageHighMem(sg_page(sg)))
+		return 0;
+	if (dev->dma_mask && *dev->dma_mask)
+		limit = *dev->dma_mask;
+
+	return sg_phys(sg) + sg->length - 1 <= limit;
+}
+
 /*
  * Prepare the sg list(s) to be handed of to the host driver
  */
-unsigned int mmc_queue_map_sg(struct mmc_queue *mq)
+unsigned int mmc_queue_map_sg(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
 {
+	struct request *req;
 	unsigned int sg_len;
 	size_t buflen;
 	struct scatterlist *sg;
 	int i;
 
-	if (!mq->bounce_buf)
-		return blk_rq_map_sg(mq->queue, mq->req, mq->sg);
+	if (!mqrq->bounce_buf) {
+		sg_len = blk_rq_map_sg(mq->queue, mqrq->req, mqrq->sg);
+		if (mqrq->packed_nr < 2)
+			return sg_len;
+
+		/* Coalesced writes follow on in the same list. */
+		list_for_each_entry(req, &mqrq->packed_list, queuelist) {
+			/* blk_rq_map_sg() marked the end of the last one */
+			sg_unmark_end(&mqrq->sg[sg_len - 1]);
+			sg_len += blk_rq_map_sg(mq->queue, req,
+						&mqrq->sg[sg_len]);
+		}
+		return sg_len;
+	}
+
+	BUG_ON(!mqrq->bounce_sg);
 
-	BUG_ON(!mq->bounce_sg);
+	sg_len = blk_rq_map_sg(mq->queue, mqrq->req, mqrq->bounce_sg);
 
-	sg_len = blk_rq_map_sg(mq->queue, mq->req, mq->bounce_sg);
+	if (sg_len == 1 && mmc_queue_sg_direct(mq, mqrq->bounce_sg)) {
+		sg_set_page(mqrq->sg, sg_page(mqrq->bounce_sg),
+			    mqrq->bounce_sg->length, mqrq->bounce_sg->offset);
+		mqrq->bounce_sg_len = 0;
+		mq->direct_reqs++;
+		return 1;
+	}
 
-	mq->bounce_sg_len = sg_len;
+	mqrq->bounce_sg_len = sg_len;
+	mq->bounced_reqs++;
 
 	buflen = 0;
-	for_each_sg(mq->bounce_sg, sg, sg_len, i)
+	for_each_sg(mqrq->bounce_sg, sg, sg_len, i)
 		buflen += sg->length;
 
-	sg_init_one(mq->sg, mq->bounce_buf, buflen);
+	sg_init_one(mqrq->sg, mqrq->bounce_buf, buflen);
 
 	return 1;
 }
@@ -366,39 +523,40 @@ unsigned int mmc_queue_map_sg(struct mmc_queue *mq)
  * If writing, bounce the data to the buffer before the request
  * is sent to the host driver
  */
-void mmc_queue_bounce_pre(struct mmc_queue *mq)
+void mmc_queue_bounce_pre(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
 {
 	unsigned long flags;
 
-	if (!mq->bounce_buf)
+	if (!mqrq->bounce_buf || !mqrq->bounce_sg_len)
 		return;
 
-	if (rq_data_dir(mq->req) != WRITE)
+	if (rq_data_dir(mqrq->req) != WRITE)
 		return;
 
 	local_irq_save(flags);
-	sg_copy_to_buffer(mq->bounce_sg, mq->bounce_sg_len,
-		mq->bounce_buf, mq->sg[0].length);
+	sg_copy_to_buffer(mqrq->bounce_sg, mqrq->bounce_sg_len,
+		mqrq->bounce_buf, mqrq->sg[0].length);
 	local_irq_restore(flags);
+	mq->bounced_bytes += mqrq->sg[0].length;
 }
 
 /*
  * If reading, bounce the data from the buffer after the request
  * has been handled by the host driver
  */
-void mmc_queue_bounce_post(struct mmc_queue *mq)
+void mmc_queue_bounce_post(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
 {
 	unsigned long flags;
 
-	if (!mq->bounce_buf)
+	if (!mqrq->bounce_buf || !mqrq->bounce_sg_len)
 		return;
 
-	if (rq_data_dir(mq->req) != READ)
+	if (rq_data_dir(mqrq->req) != READ)
 		return;
 
 	local_irq_save(flags);
-	sg_copy_from_buffer(mq->bounce_sg, mq->bounce_sg_len,
-		mq->bounce_buf, mq->sg[0].length);
+	sg_copy_from_buffer(mqrq->bounce_sg, mqrq->bounce_sg_len,
+		mqrq->bounce_buf, mqrq->sg[0].length);
 	local_irq_restore(flags);
+	mq->bounced_bytes += mqrq->sg[0].length;
 }
-
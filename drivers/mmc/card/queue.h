@@ -1,9 +1,35 @@
 #ifndef MMC_QUEUE_H
 #define MMC_QUEUE_H
 
+#include <linux/completion.h>
+#include <linux/mmc/core.h>
+
 struct request;
 struct task_struct;
 
+struct mmc_blk_request {
+	struct mmc_request	mrq;
+	struct mmc_command	cmd;
+	struct mmc_command	stop;
+	struct mmc_data		data;
+};
+
+/*
+ * One stage of the request pipeline: while one mmc_queue_req is on the
+ * bus, the other is being prepared.
+ */
+struct mmc_queue_req {
+	struct request		*req;
+	struct mmc_blk_request	brq;
+	struct completion	done;
+	struct scatterlist	*sg;
+	char			*bounce_buf;
+	struct scatterlist	*bounce_sg;
+	unsigned int		bounce_sg_len;	/* 0 if sent unbounced */
+	struct list_head	packed_list;	/* writes coalesced after req */
+	unsigned int		packed_nr;	/* requests in this transfer */
+};
+
 struct mmc_queue {
 	struct mmc_card		*card;
 	struct task_struct	*thread;
@@ -13,10 +39,14 @@ struct mmc_queue {
 	int			(*issue_fn)(struct mmc_queue *, struct request *);
 	void			*data;
 	struct request_queue	*queue;
-	struct scatterlist	*sg;
-	char			*bounce_buf;
-	struct scatterlist	*bounce_sg;
-	unsigned int		bounce_sg_len;
+	struct mmc_queue_req	mqrq[2];
+	struct mmc_queue_req	*mqrq_cur;
+	struct mmc_queue_req	*mqrq_next;
+	unsigned int		bounce_order;	/* of each bounce_buf */
+	unsigned int		bounce_size;
+	u64			bounced_bytes;
+	unsigned long		bounced_reqs;
+	unsigned long		direct_reqs;	/* went around the bounce */
 #ifdef CONFIG_MMC_BLOCK_PARANOID_RESUME
 	int			check_status;
 #endif
@@ -27,8 +57,13 @@ extern void mmc_cleanup_queue(struct mmc_queue *);
 extern void mmc_queue_suspend(struct mmc_queue *);
 extern void mmc_queue_resume(struct mmc_queue *);
 
-extern unsigned int mmc_queue_map_sg(struct mmc_queue *);
-extern void mmc_queue_bounce_pre(struct mmc_queue *);
-extern void mmc_queue_bounce_post(struct mmc_queue *);
+extern struct request *mmc_queue_fetch_next(struct mmc_queue *);
+extern struct request *mmc_queue_fetch_adjacent(struct mmc_queue *,
+						struct request *,
+						unsigned int, unsigned int);
+extern unsigned int mmc_queue_map_sg(struct mmc_queue *,
+				     struct mmc_queue_req *);
+extern void mmc_queue_bounce_pre(struct mmc_queue *, struct mmc_queue_req *);
+extern void mmc_queue_bounce_post(struct mmc_queue *, struct mmc_queue_req *);
 
 #endif
@@ -182,6 +182,29 @@ static void mmc_wait_done(struct mmc_request *mrq)
 	complete(mrq->done_data);
 }
 
+/**
+ *	mmc_start_req_nowait - start a request without waiting for it
+ *	@host: MMC host to start the request
+ *	@mrq: MMC request to start
+ *	@done: completed when the host has finished @mrq
+ *
+ *	Start a new MMC request and return at once, so the caller can do
+ *	other work while it is on the bus. Wait for it with
+ *	wait_for_completion(@done) before looking at the results.
+ */
+void mmc_start_req_nowait(struct mmc_host *host, struct mmc_request *mrq,
+			  struct completion *done)
+{
+	init_completion(done);
+
+	mrq->done_data = done;
+	mrq->done = mmc_wait_done;
+
+	mmc_start_request(host, mrq);
+}
+
+EXPORT_SYMBOL(mmc_start_req_nowait);
+
 /**
  *	mmc_wait_for_req - start a request and wait for completion
  *	@host: MMC host to start command
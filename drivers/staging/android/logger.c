@@ -2,28 +2,50 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/io.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/time.h>
 #include "logger.h"
 #include <asm/ioctls.h>
 
+/*
+ * Positions in the log are free-running byte sequence numbers, the offset
+ * of a position in the ring is logger_offset(pos).
+ *
+ * Writers reserve space for an entry under log->lock, copy the payload in
+ * without holding any lock, and then commit it. Entries between w_pos and
+ * resv_pos are still being written and are marked by a non-zero __pad in
+ * their header; w_pos only moves past an entry once it and every entry
+ * before it are committed, so readers never see a partial entry.
+ *
+ * A writer only moves head past the entries it overwrites. Readers are
+ * not touched: one that fell behind head was lapped, and moves up to
+ * head at its next read.
+ */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
+	struct logger_mmap_header *meta; /* page mapped in front of it */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	wait_queue_head_t	commit_wq; /* writers waiting for room */
+	struct mutex		mutex;	/* serializes readers */
+	spinlock_t		lock;	/* protects the positions */
+	size_t			w_pos;	/* committed write head */
+	size_t			resv_pos; /* reserved write head */
+	size_t			head;	/* oldest entry, new readers start here */
 	size_t			size;	/* size of the log */
 };
 
+#define LOGGER_ENTRY_PENDING	0xffff	/* __pad of an uncommitted entry */
+
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	size_t			r_pos;	/* current read head */
+	int			batch;	/* read() returns all entries that fit */
 };
 
 #define logger_offset(n)	((n) & (log->size - 1))
@@ -37,6 +59,20 @@ static inline struct logger_log *file_get_log(struct file *file)
 		return file->private_data;
 }
 
+/* Whether the entry at pos has not been overwritten */
+static inline int log_pos_valid(struct logger_log *log, size_t pos)
+{
+	return log->w_pos - pos <= log->w_pos - log->head;
+}
+
+/* Moves a lapped reader up to the oldest entry */
+static inline void reader_catch_up(struct logger_log *log,
+				   struct logger_reader *reader)
+{
+	if (unlikely(!log_pos_valid(log, reader->r_pos)))
+		reader->r_pos = log->head;
+}
+
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
 	__u16 val;
@@ -53,29 +89,68 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 	return sizeof(struct logger_entry) + val;
 }
 
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static int entry_is_pending(struct logger_log *log, size_t off)
+{
+	size_t pad = logger_offset(off + offsetof(struct logger_entry, __pad));
+	__u16 val;
+
+	switch (log->size - pad) {
+	case 1:
+		memcpy(&val, log->buffer + pad, 1);
+		memcpy(((char *) &val) + 1, log->buffer, 1);
+		break;
+	default:
+		memcpy(&val, log->buffer + pad, 2);
+	}
+
+	return val != 0;
+}
+
+/*
+ * The entry at off is read without log->lock held, the caller checks
+ * afterwards that no writer reclaimed it in the meantime.
+ */
+static ssize_t do_read_log_to_user(struct logger_log *log, size_t off,
+				   char __user *buf, size_t count)
 {
 	size_t len;
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 	if (count != len)
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
+/*
+ * Length of the whole entries from r_pos up to w_pos that fit in count.
+ * Called without log->lock, the caller checks afterwards that they were
+ * not overwritten.
+ */
+static size_t get_batch_len(struct logger_log *log, size_t r_pos,
+			    size_t w_pos, size_t count)
+{
+	size_t len = 0;
+	size_t nr;
+
+	while (len < w_pos - r_pos) {
+		nr = get_entry_len(log, logger_offset(r_pos + len));
+		if (len + nr > count)
+			break;
+		len += nr;
+	}
+
+	return len;
+}
+
 static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	size_t r_pos, w_pos;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -83,9 +158,9 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		ret = (log->w_pos == reader->r_pos);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -107,19 +182,39 @@ start:
 		return ret;
 
 	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
-	if (unlikely(log->w_off == reader->r_off)) {
+	reader_catch_up(log, reader);
+	if (unlikely(log->w_pos == reader->r_pos)) {
+		spin_unlock(&log->lock);
 		mutex_unlock(&log->mutex);
 		goto start;
 	}
 
-	ret = get_entry_len(log, reader->r_off);
+	r_pos = reader->r_pos;
+	w_pos = log->w_pos;
+	ret = get_entry_len(log, logger_offset(r_pos));
+	spin_unlock(&log->lock);
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
+	if (reader->batch)
+		ret = get_batch_len(log, r_pos, w_pos, count);
 
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(log, logger_offset(r_pos), buf, ret);
+	if (ret < 0)
+		goto out;
+
+	spin_lock(&log->lock);
+	if (unlikely(!log_pos_valid(log, r_pos))) {
+		/* a writer reclaimed the entry while we copied it */
+		spin_unlock(&log->lock);
+		mutex_unlock(&log->mutex);
+		goto start;
+	}
+	reader->r_pos = r_pos + ret;
+	spin_unlock(&log->lock);
 
 out:
 	mutex_unlock(&log->mutex);
@@ -127,85 +222,152 @@ out:
 	return ret;
 }
 
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+/* Moves head past the entries that a reservation of len overwrites */
+static void fix_up_head(struct logger_log *log, size_t len)
 {
-	size_t count = 0;
+	size_t new = log->resv_pos + len;
 
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
+	while (new - log->head > log->size)
+		log->head += get_entry_len(log, logger_offset(log->head));
 
-	return off;
+	/* mmap readers must see head move before the data is overwritten */
+	log->meta->head = log->head;
+	smp_wmb();
 }
 
-static inline int clock_interval(size_t a, size_t b, size_t c)
+static void do_write_log(struct logger_log *log, size_t off,
+			 const void *buf, size_t count)
 {
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
+	size_t len;
 
-	return 0;
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
+
+	if (count != len)
+		memcpy(log->buffer, buf + len, count - len);
 }
 
-static void fix_up_readers(struct logger_log *log, size_t len)
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
+				      const void __user *buf, size_t count)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	size_t len;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
+		return -EFAULT;
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	if (count != len)
+		if (copy_from_user(log->buffer, buf + len, count - len))
+			return -EFAULT;
+
+	return count;
 }
 
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_clear_log(struct logger_log *log, size_t off, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memset(log->buffer + off, 0, len);
 
 	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
+		memset(log->buffer, 0, count - len);
+}
+
+/*
+ * Uncommitted entries plus a new one must leave room for the longest
+ * entry, so that fix_up_head() never walks head past w_pos.
+ */
+static inline int log_has_room(struct logger_log *log, size_t len)
+{
+	return log->resv_pos - log->w_pos + len +
+		LOGGER_ENTRY_MAX_LEN <= log->size;
+}
+
+/*
+ * Claims len bytes at the reserved write head for the entry described by
+ * header and writes the header there, marked pending. Returns the
+ * position of the entry.
+ */
+static size_t reserve_log(struct logger_log *log,
+			  struct logger_entry *header, size_t len)
+{
+	size_t pos;
 
-	log->w_off = logger_offset(log->w_off + count);
+	spin_lock(&log->lock);
+	while (unlikely(!log_has_room(log, len))) {
+		spin_unlock(&log->lock);
+		wait_event(log->commit_wq, log_has_room(log, len));
+		spin_lock(&log->lock);
+	}
 
+	fix_up_head(log, len);
+	pos = log->resv_pos;
+	header->__pad = LOGGER_ENTRY_PENDING;
+	do_write_log(log, logger_offset(pos), header,
+		     sizeof(struct logger_entry));
+	log->resv_pos = pos + len;
+	spin_unlock(&log->lock);
+
+	return pos;
 }
 
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+/*
+ * Marks the entry at pos committed and moves w_pos past every committed
+ * entry that follows it. Returns whether readers have new entries.
+ */
+static int commit_log(struct logger_log *log, size_t pos)
 {
-	size_t len;
+	static const __u16 zero;
+	size_t old;
+	int ret;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	spin_lock(&log->lock);
+	do_write_log(log, logger_offset(pos +
+		     offsetof(struct logger_entry, __pad)), &zero, 2);
+	old = log->w_pos;
+	while (log->w_pos != log->resv_pos &&
+	       !entry_is_pending(log, logger_offset(log->w_pos)))
+		log->w_pos += get_entry_len(log, logger_offset(log->w_pos));
+	ret = log->w_pos != old;
+	if (ret) {
+		smp_wmb();
+		log->meta->w_pos = log->w_pos;
+	}
+	spin_unlock(&log->lock);
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+	return ret;
+}
 
-	log->w_off = logger_offset(log->w_off + count);
+/*
+ * Gives up the entry at pos after a failed copy. The last reservation is
+ * simply dropped, an entry that others were reserved after is committed
+ * with the rest of its payload cleared.
+ */
+static int cancel_log(struct logger_log *log, size_t pos, size_t len,
+		      size_t copied)
+{
+	spin_lock(&log->lock);
+	if (pos + len == log->resv_pos) {
+		log->resv_pos = pos;
+		spin_unlock(&log->lock);
+		return 0;
+	}
+	spin_unlock(&log->lock);
 
-	return count;
+	do_clear_log(log, logger_offset(pos + sizeof(struct logger_entry) +
+					copied),
+		     len - sizeof(struct logger_entry) - copied);
+	return commit_log(log, pos);
 }
 
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	size_t entry, len, off;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -219,27 +381,31 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	len = sizeof(struct logger_entry) + header.len;
+	entry = reserve_log(log, &header, len);
+	off = logger_offset(entry + sizeof(struct logger_entry));
 
 	while (nr_segs-- > 0) {
-		size_t len;
+		size_t seg;
 		ssize_t nr;
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		seg = min_t(size_t, iov->iov_len, header.len - ret);
+		nr = do_write_log_from_user(log, off, iov->iov_base, seg);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
+			if (cancel_log(log, entry, len, ret))
+				wake_up_interruptible(&log->wq);
+			wake_up(&log->commit_wq);
 			return nr;
 		}
 
 		iov++;
+		off = logger_offset(off + nr);
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-	wake_up_interruptible(&log->wq);
+	if (commit_log(log, entry)) {
+		wake_up_interruptible(&log->wq);
+		wake_up(&log->commit_wq);
+	}
 	return ret;
 }
 
@@ -266,12 +432,11 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
-		INIT_LIST_HEAD(&reader->list);
+		reader->batch = 0;
 
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		reader->r_pos = log->head;
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -284,7 +449,6 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		list_del(&reader->list);
 		kfree(reader);
 	}
 
@@ -305,10 +469,11 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	reader_catch_up(log, reader);
+	if (log->w_pos != reader->r_pos)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -319,7 +484,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -331,10 +496,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		reader_catch_up(log, reader);
+		ret = log->w_pos - reader->r_pos;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -342,8 +505,9 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
+		reader_catch_up(log, reader);
+		if (log->w_pos != reader->r_pos)
+			ret = get_entry_len(log, logger_offset(reader->r_pos));
 		else
 			ret = 0;
 		break;
@@ -352,23 +516,67 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		/* readers catch up to the new head lazily */
+		log->head = log->w_pos;
+		log->meta->head = log->head;
+		ret = 0;
+		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * Maps the header page and then the ring, read-only. Both are static and
+ * page aligned, so this is a plain remap of kernel memory.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	if (vma->vm_pgoff || size > PAGE_SIZE + log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(log->meta) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+	if (ret || size == PAGE_SIZE)
+		return ret;
+
+	return remap_pfn_range(vma, vma->vm_start + PAGE_SIZE,
+			       virt_to_phys(log->buffer) >> PAGE_SHIFT,
+			       size - PAGE_SIZE, vma->vm_page_prot);
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -376,9 +584,11 @@ static const struct file_operations logger_fops = {
 };
 
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
+static unsigned char _meta_ ## VAR[PAGE_SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
+	.meta = (struct logger_mmap_header *)_meta_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -386,9 +596,11 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
+	.commit_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .commit_wq), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
+	.w_pos = 0, \
+	.resv_pos = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -415,6 +627,8 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->meta->size = log->size;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
@@ -14,6 +14,19 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * A log device opened for reading can be mapped read-only: the first page
+ * holds this header and the ring follows it. head and w_pos are byte
+ * positions modulo 2^32, the ring offset of a position is pos & (size - 1).
+ * The entries in [head, w_pos) are complete. After copying some out,
+ * re-read head: whatever lies before it was overwritten in the meantime.
+ */
+struct logger_mmap_header {
+	__u32		size;	/* size of the ring */
+	__u32		head;	/* position of the oldest entry */
+	__u32		w_pos;	/* position after the newest entry */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -29,6 +42,7 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 5) /* read all that fit */
 
 #endif /* _LINUX_LOGGER_H */
 
@@ -8,6 +8,14 @@
 #include <linux/sched.h>
 #include <linux/notifier.h>
 #include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/mem_notify.h>
+#include <trace/lowmemorykiller.h>
 
 static uint32_t lowmem_debug_level = 1;
 static int lowmem_adj[6] = {
@@ -27,6 +35,38 @@ static int lowmem_minfree_size = 4;
 
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
+static ktime_t lowmem_deathpending_start;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_deathpending_wait);
+
+static bool lowmem_proactive;
+static int lowmem_pressure;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+static struct task_struct *lowmem_task;
+
+DEFINE_TRACE(lowmem_decision);
+
+/*
+ * Processes indexed by oomkilladj, one list per value, kept up to date
+ * from fork, oom_adj writes and exit. Victim selection then only looks
+ * at the processes in the highest non-empty bucket at or above the adj
+ * threshold instead of walking every process.
+ */
+#define LOWMEM_NR_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+static struct list_head lowmem_buckets[LOWMEM_NR_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_index_lock);
+
+static struct lowmem_stats {
+	unsigned long kills;
+	unsigned long kills_pressure;	/* by the proactive thread */
+	unsigned long selects;		/* victim searches */
+	unsigned long scanned;		/* processes looked at */
+	u64 select_ns;
+	u64 select_ns_max;
+	unsigned long kills_done;	/* victims seen exiting */
+	u64 kill_ns;			/* SIGKILL to mm released */
+	u64 kill_ns_max;
+	unsigned long kill_timeouts;	/* victims that outlived timeout */
+} lowmem_stats;
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -41,34 +81,152 @@ static struct notifier_block task_nb = {
 	.notifier_call	= task_notify_func,
 };
 
+static struct list_head *lowmem_bucket(int oom_adj)
+{
+	if (oom_adj < OOM_DISABLE)
+		oom_adj = OOM_DISABLE;
+	else if (oom_adj > OOM_ADJUST_MAX)
+		oom_adj = OOM_ADJUST_MAX;
+	return &lowmem_buckets[oom_adj - OOM_DISABLE];
+}
+
+/* Called with lowmem_index_lock held */
+static void lowmem_index_update(struct task_struct *p)
+{
+	list_move_tail(&p->lowmem_node, lowmem_bucket(p->oomkilladj));
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
 
-	if (task == lowmem_deathpending)
+	if (task == lowmem_deathpending) {
 		lowmem_deathpending = NULL;
+		wake_up(&lowmem_deathpending_wait);
+	}
 
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+/* Called with lowmem_index_lock held */
+static void lowmem_kill_done(void)
+{
+	u64 delta;
+
+	delta = ktime_to_ns(ktime_sub(ktime_get(), lowmem_deathpending_start));
+	lowmem_stats.kills_done++;
+	lowmem_stats.kill_ns += delta;
+	if (delta > lowmem_stats.kill_ns_max)
+		lowmem_stats.kill_ns_max = delta;
+}
+
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val,
+		    void *data)
+{
+	struct task_struct *task = data;
+
+	spin_lock(&lowmem_index_lock);
+	if (val == OOM_ADJ_EXIT) {
+		list_del_init(&task->lowmem_node);
+		if (task == lowmem_deathpending)
+			lowmem_kill_done();
+	} else if (val == OOM_ADJ_EXEC) {
+		/* The process lives on under its new leader */
+		list_del_init(&task->lowmem_node);
+		lowmem_index_update(task->group_leader);
+		if (task == lowmem_deathpending)
+			lowmem_deathpending = task->group_leader;
+	} else if (!(task->group_leader->flags & PF_EXITING)) {
+		/* Only the oomkilladj of the thread group leader counts */
+		lowmem_index_update(task->group_leader);
+	}
+	spin_unlock(&lowmem_index_lock);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
+/*
+ * Find the largest process in the highest non-empty bucket at or
+ * above min_adj. Returns it with a reference held.
+ */
+static struct task_struct *lowmem_select(int min_adj, int *oom_adj,
+					 int *size)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
-	int rem = 0;
-	int tasksize;
-	int i;
-	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
-	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free = global_page_state(NR_FREE_PAGES);
-	int other_file = global_page_state(NR_FILE_PAGES);
+	int tasksize;
+	int adj;
+	ktime_t start = ktime_get();
+	u64 delta;
 
-	if (lowmem_deathpending &&
-	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+	spin_lock(&lowmem_index_lock);
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj && !selected; adj--) {
+		list_for_each_entry(p, lowmem_bucket(adj), lowmem_node) {
+			lowmem_stats.scanned++;
+			task_lock(p);
+			if (!p->mm) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(p->mm);
+			task_unlock(p);
+			if (tasksize <= 0 || tasksize <= selected_tasksize)
+				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			*oom_adj = adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "to kill\n", p->pid, p->comm, adj,
+				     tasksize);
+		}
+	}
+	if (selected) {
+		get_task_struct(selected);
+		*size = selected_tasksize;
+	}
+	delta = ktime_to_ns(ktime_sub(ktime_get(), start));
+	lowmem_stats.selects++;
+	lowmem_stats.select_ns += delta;
+	if (delta > lowmem_stats.select_ns_max)
+		lowmem_stats.select_ns_max = delta;
+	spin_unlock(&lowmem_index_lock);
+
+	return selected;
+}
+
+/*
+ * Returns 1 while the last victim is still exiting. Gives up on it
+ * after a timeout.
+ */
+static int lowmem_death_pending(void)
+{
+	if (!lowmem_deathpending)
 		return 0;
+	if (time_before_eq(jiffies, lowmem_deathpending_timeout))
+		return 1;
+
+	/* Victim is stuck, stop waiting for it */
+	spin_lock(&lowmem_index_lock);
+	if (lowmem_deathpending) {
+		lowmem_deathpending = NULL;
+		lowmem_stats.kill_timeouts++;
+	}
+	spin_unlock(&lowmem_index_lock);
+	return 0;
+}
+
+/* Lowest oomkilladj that may be killed at this much free memory */
+static int lowmem_min_adj(int other_free, int other_file)
+{
+	int i;
+	int array_size = ARRAY_SIZE(lowmem_adj);
 
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
@@ -76,11 +234,71 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 		array_size = lowmem_minfree_size;
 	for (i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i] &&
-				other_file < lowmem_minfree[i]) {
-			min_adj = lowmem_adj[i];
-			break;
-		}
+				other_file < lowmem_minfree[i])
+			return lowmem_adj[i];
+	}
+	return OOM_ADJUST_MAX + 1;
+}
+
+/*
+ * Kill the largest process at or above min_adj. Returns its size in
+ * pages, 0 if nothing was killed.
+ */
+static int lowmem_kill(enum lowmem_source source, int min_adj,
+		       int other_free, int other_file)
+{
+	struct task_struct *selected;
+	int selected_tasksize = 0;
+	int selected_oom_adj = 0;
+
+	selected = lowmem_select(min_adj, &selected_oom_adj,
+				 &selected_tasksize);
+	trace_lowmem_decision(source, other_free, other_file, min_adj,
+			      selected, selected_oom_adj, selected_tasksize);
+	if (!selected)
+		return 0;
+
+	if (fatal_signal_pending(selected)) {
+		pr_warning("process %d is suffering a slow death\n",
+			   selected->pid);
+		put_task_struct(selected);
+		return 0;
+	}
+
+	spin_lock(&lowmem_index_lock);
+	if (lowmem_deathpending) {
+		/* The shrinker and the pressure thread raced */
+		spin_unlock(&lowmem_index_lock);
+		put_task_struct(selected);
+		return 0;
 	}
+	lowmem_deathpending = selected;
+	lowmem_deathpending_timeout = jiffies + HZ;
+	lowmem_deathpending_start = ktime_get();
+	lowmem_stats.kills++;
+	if (source == LOWMEM_PRESSURE)
+		lowmem_stats.kills_pressure++;
+	spin_unlock(&lowmem_index_lock);
+
+	lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+		     selected->pid, selected->comm,
+		     selected_oom_adj, selected_tasksize);
+	send_sig(SIGKILL, selected, 0);
+	put_task_struct(selected);
+	return selected_tasksize;
+}
+
+static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	int rem = 0;
+	int min_adj;
+	int other_free = global_page_state(NR_FREE_PAGES);
+	int other_file = global_page_state(NR_FILE_PAGES);
+
+	if (lowmem_death_pending())
+		return 0;
+
+	min_adj = lowmem_min_adj(other_free, other_file);
 	if (nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
 			     nr_to_scan, gfp_mask, other_free, other_file,
@@ -94,58 +312,62 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
-	rcu_read_lock();
-	for_each_process(p) {
-		int oom_adj;
+	rem -= lowmem_kill(LOWMEM_SHRINKER, min_adj, other_free, other_file);
+	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
+		     nr_to_scan, gfp_mask, rem);
+	return rem;
+}
 
-		task_lock(p);
-		if (!p->mm) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = p->oomkilladj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+/*
+ * Proactive mode: a thread woken by mem_notify pressure events kills
+ * with the same minfree/adj tables before reclaim has to stall
+ * allocations. The shrinker stays registered as the last resort.
+ */
+static int
+mem_notify_func(struct notifier_block *self, unsigned long val, void *data)
+{
+	if (val && lowmem_proactive) {
+		lowmem_pressure = 1;
+		wake_up(&lowmem_pressure_wait);
+	}
+	return NOTIFY_OK;
+}
+
+static struct notifier_block mem_notify_nb = {
+	.notifier_call	= mem_notify_func,
+};
+
+static int lowmem_thread(void *unused)
+{
+	int min_adj;
+	int other_free, other_file;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(lowmem_pressure_wait,
+			lowmem_pressure || kthread_should_stop());
+		lowmem_pressure = 0;
+
+		while (lowmem_proactive && !kthread_should_stop()) {
+			/* Let the last victim free its memory first */
+			wait_event_timeout(lowmem_deathpending_wait,
+					   !lowmem_death_pending(), HZ);
+			if (lowmem_death_pending())
 				continue;
+
+			other_free = global_page_state(NR_FREE_PAGES);
+			other_file = global_page_state(NR_FILE_PAGES);
+			min_adj = lowmem_min_adj(other_free, other_file);
+			if (min_adj == OOM_ADJUST_MAX + 1)
+				break;
+			lowmem_print(3, "lowmem_thread ofree %d %d, ma %d\n",
+				     other_free, other_file, min_adj);
+			if (!lowmem_kill(LOWMEM_PRESSURE, min_adj,
+					 other_free, other_file))
+				break;
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
 	}
-	if (selected) {
-		if (fatal_signal_pending(selected)) {
-		      pr_warning("process %d is suffering a slow death\n",
-		           selected->pid);
-		      read_unlock(&tasklist_lock);
-		      return rem;  
-     		  	}
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		send_sig(SIGKILL, selected, 0);
-		rem -= selected_tasksize;
-	}
-	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
-		     nr_to_scan, gfp_mask, rem);
-	rcu_read_unlock();
-	return rem;
+	return 0;
 }
 
 static struct shrinker lowmem_shrinker = {
@@ -153,16 +375,106 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static int lowmem_stats_show(struct seq_file *m, void *unused)
+{
+	struct lowmem_stats st;
+	int adj, n;
+	struct task_struct *p;
+
+	spin_lock(&lowmem_index_lock);
+	st = lowmem_stats;
+	spin_unlock(&lowmem_index_lock);
+
+	seq_printf(m, "kills: %lu\n", st.kills);
+	seq_printf(m, "kills_pressure: %lu\n", st.kills_pressure);
+	seq_printf(m, "kill_timeouts: %lu\n", st.kill_timeouts);
+	seq_printf(m, "selects: %lu\n", st.selects);
+	seq_printf(m, "scanned: %lu\n", st.scanned);
+	seq_printf(m, "select_ns_avg: %llu\n", st.selects ?
+		   div64_u64(st.select_ns, st.selects) : 0);
+	seq_printf(m, "select_ns_max: %llu\n", st.select_ns_max);
+	seq_printf(m, "kill_latency_ns_avg: %llu\n", st.kills_done ?
+		   div64_u64(st.kill_ns, st.kills_done) : 0);
+	seq_printf(m, "kill_latency_ns_max: %llu\n", st.kill_ns_max);
+
+	seq_printf(m, "buckets:\n");
+	for (adj = OOM_DISABLE; adj <= OOM_ADJUST_MAX; adj++) {
+		n = 0;
+		spin_lock(&lowmem_index_lock);
+		list_for_each_entry(p, lowmem_bucket(adj), lowmem_node)
+			n++;
+		spin_unlock(&lowmem_index_lock);
+		if (n)
+			seq_printf(m, "  adj %d: %d\n", adj, n);
+	}
+	return 0;
+}
+
+static int lowmem_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lowmem_stats_show, inode->i_private);
+}
+
+static const struct file_operations lowmem_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct dentry *lowmem_debugfs_dir;
+
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_NR_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+
 	task_free_register(&task_nb);
+	register_oom_adj_notifier(&oom_adj_nb);
+
+	/*
+	 * Index processes that were forked before the notifier was set.
+	 * Exiting ones may have missed their OOM_ADJ_EXIT already.
+	 */
+	read_lock(&tasklist_lock);
+	spin_lock(&lowmem_index_lock);
+	for_each_process(p) {
+		if (!(p->flags & PF_EXITING))
+			lowmem_index_update(p);
+	}
+	spin_unlock(&lowmem_index_lock);
+	read_unlock(&tasklist_lock);
+
 	register_shrinker(&lowmem_shrinker);
+
+	lowmem_task = kthread_run(lowmem_thread, NULL, "lowmemorykiller");
+	if (IS_ERR(lowmem_task)) {
+		pr_err("lowmemorykiller: failed to start thread\n");
+		lowmem_task = NULL;
+	} else {
+		register_mem_notify_notifier(&mem_notify_nb);
+	}
+
+	lowmem_debugfs_dir = debugfs_create_dir("lowmemorykiller", NULL);
+	if (lowmem_debugfs_dir)
+		debugfs_create_file("stats", S_IRUGO, lowmem_debugfs_dir,
+				    NULL, &lowmem_stats_fops);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	debugfs_remove_recursive(lowmem_debugfs_dir);
+	if (lowmem_task) {
+		unregister_mem_notify_notifier(&mem_notify_nb);
+		kthread_stop(lowmem_task);
+	}
 	unregister_shrinker(&lowmem_shrinker);
+	unregister_oom_adj_notifier(&oom_adj_nb);
 	task_free_unregister(&task_nb);
 }
 
@@ -172,6 +484,7 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(proactive, lowmem_proactive, bool, S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
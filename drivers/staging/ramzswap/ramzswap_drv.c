@@ -16,20 +16,23 @@
 #include <linux/vmalloc.h>
 #include <linux/version.h>
 #include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/kthread.h>
 #include "compat.h"
 #include "ramzswap_drv.h"
 
 #if defined(CONFIG_ZRAM_LZO)
 #include <linux/lzo.h>
-#define WMSIZE		LZO1X_MEM_COMPRESS
-#define COMPRESS(s, sl, d, dl, wm)	\
-	lzo1x_1_compress(s, sl, d, dl, wm)
-#define DECOMPRESS(s, sl, d, dl)	\
-	lzo1x_decompress_safe(s, sl, d, dl)
-#elif defined(CONFIG_ZRAM_SNAPPY)
+#endif
+
+#if defined(CONFIG_ZRAM_SNAPPY)
 #include "../snappy/csnappy.h" /* if built in drivers/staging */
-#define WMSIZE_ORDER	((PAGE_SHIFT > 14) ? (15) : (PAGE_SHIFT+1))
-#define WMSIZE		(1 << WMSIZE_ORDER)
+#define SNAPPY_WMSIZE_ORDER	((PAGE_SHIFT > 14) ? (15) : (PAGE_SHIFT+1))
+#define SNAPPY_WMSIZE		(1 << SNAPPY_WMSIZE_ORDER)
 static int
 snappy_compress_(
 	const unsigned char *src,
@@ -39,7 +42,7 @@ snappy_compress_(
 	void *workmem)
 {
 	const unsigned char *end = csnappy_compress_fragment(
-		src, (uint32_t)src_len, dst, workmem, WMSIZE_ORDER);
+		src, (uint32_t)src_len, dst, workmem, SNAPPY_WMSIZE_ORDER);
 	*dst_len = end - dst;
 	return 0;
 }
@@ -55,19 +58,52 @@ snappy_decompress_(
 	*dst_len = (size_t)dst_len_;
 	return ret;
 }
-#define COMPRESS(s, sl, d, dl, wm)	\
-	snappy_compress_(s, sl, d, dl, wm)
-#define DECOMPRESS(s, sl, d, dl)	\
-	snappy_decompress_(s, sl, d, dl)
-#else
+#endif
+
+#if !defined(CONFIG_ZRAM_LZO) && !defined(CONFIG_ZRAM_SNAPPY)
 #error either CONFIG_ZRAM_LZO or CONFIG_ZRAM_SNAPPY must be defined
 #endif
 
+/*
+ * Compressor backends, indexed by enum rzs_compressor. Entries
+ * without a name are not built into this kernel. The "none"
+ * backend has no callbacks: its pages are stored uncompressed.
+ */
+static const struct ramzswap_compressor compressors[RZS_NR_COMPRESSORS] = {
+#if defined(CONFIG_ZRAM_LZO)
+	[RZS_COMPRESSOR_LZO] = {
+		.name = "lzo",
+		.workmem_size = LZO1X_MEM_COMPRESS,
+		.compress = lzo1x_1_compress,
+		.decompress = lzo1x_decompress_safe,
+	},
+#endif
+#if defined(CONFIG_ZRAM_SNAPPY)
+	[RZS_COMPRESSOR_SNAPPY] = {
+		.name = "snappy",
+		.workmem_size = SNAPPY_WMSIZE,
+		.compress = snappy_compress_,
+		.decompress = snappy_decompress_,
+	},
+#endif
+	[RZS_COMPRESSOR_NONE] = {
+		.name = "none",
+	},
+};
+
+#if defined(CONFIG_ZRAM_LZO)
+static const unsigned default_compressor = RZS_COMPRESSOR_LZO;
+#else
+static const unsigned default_compressor = RZS_COMPRESSOR_SNAPPY;
+#endif
+
 /* Module params (documentation at end) */
 static unsigned int num_devices;
 static unsigned long disksize_kb;
 static unsigned long memlimit_kb;
 static char backing_swap[MAX_SWAP_NAME_LEN];
+static char compressor[RZS_COMPRESSOR_NAME_LEN];
+static char allocator[RZS_COMPRESSOR_NAME_LEN];
 
 /* Globals */
 static int ramzswap_major;
@@ -86,18 +122,265 @@ static int rzs_test_flag(struct ramzswap *rzs, u32 index,
 	return rzs->table[index].flags & BIT(flag);
 }
 
-static void rzs_set_flag(struct ramzswap *rzs, u32 index,
+/* Callers of the __ variants hold rzs->table_lock */
+static void __rzs_set_flag(struct ramzswap *rzs, u32 index,
 			enum rzs_pageflags flag)
 {
 	rzs->table[index].flags |= BIT(flag);
 }
 
-static void rzs_clear_flag(struct ramzswap *rzs, u32 index,
+static void __rzs_clear_flag(struct ramzswap *rzs, u32 index,
 			enum rzs_pageflags flag)
 {
 	rzs->table[index].flags &= ~BIT(flag);
 }
 
+static void rzs_set_flag(struct ramzswap *rzs, u32 index,
+			enum rzs_pageflags flag)
+{
+	spin_lock(&rzs->table_lock);
+	__rzs_set_flag(rzs, index, flag);
+	spin_unlock(&rzs->table_lock);
+}
+
+/*
+ * Take a mutex, accounting the time spent waiting for it when
+ * it is contended. The counters are only named, not evaluated,
+ * when stats are disabled.
+ */
+#if defined(CONFIG_RAMZSWAP_STATS)
+static void __rzs_mutex_lock(struct ramzswap *rzs, struct mutex *lock,
+			u64 *contended, u64 *wait_ns)
+{
+	ktime_t start;
+
+	if (mutex_trylock(lock))
+		return;
+
+	start = ktime_get();
+	mutex_lock(lock);
+	stat64_inc(rzs, contended);
+	stat64_add(rzs, wait_ns, ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
+#define rzs_mutex_lock(rzs, lock, contended, wait_ns) \
+	__rzs_mutex_lock(rzs, lock, contended, wait_ns)
+#else
+#define rzs_mutex_lock(rzs, lock, contended, wait_ns) mutex_lock(lock)
+#endif
+
+static unsigned rzs_get_compressor(struct ramzswap *rzs, u32 index)
+{
+	return (rzs->table[index].flags & RZS_COMPRESSOR_MASK)
+			>> RZS_COMPRESSOR_SHIFT;
+}
+
+static void rzs_set_compressor(struct ramzswap *rzs, u32 index, unsigned id)
+{
+	spin_lock(&rzs->table_lock);
+	rzs->table[index].flags &= ~RZS_COMPRESSOR_MASK;
+	rzs->table[index].flags |= id << RZS_COMPRESSOR_SHIFT;
+	spin_unlock(&rzs->table_lock);
+}
+
+static int ramzswap_compressor_valid(unsigned id)
+{
+	return id < RZS_NR_COMPRESSORS && compressors[id].name;
+}
+
+static int ramzswap_compressor_by_name(const char *name)
+{
+	unsigned id;
+
+	for (id = 0; id < RZS_NR_COMPRESSORS; id++) {
+		if (ramzswap_compressor_valid(id) &&
+				!strcmp(compressors[id].name, name))
+			return id;
+	}
+
+	return -EINVAL;
+}
+
+static int rzs_compress(struct ramzswap *rzs, unsigned id,
+			struct ramzswap_percpu *pcpu,
+			const unsigned char *src, unsigned char *dst,
+			size_t *clen)
+{
+	int ret;
+#if defined(CONFIG_RAMZSWAP_STATS)
+	ktime_t start = ktime_get();
+#endif
+
+	ret = compressors[id].compress(src, PAGE_SIZE, dst, clen,
+					pcpu->compress_workmem);
+
+#if defined(CONFIG_RAMZSWAP_STATS)
+	stat64_inc(rzs, &rzs->stats.compress_pages[id]);
+	stat64_add(rzs, &rzs->stats.compress_ns[id],
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+#endif
+	return ret;
+}
+
+static int rzs_decompress(struct ramzswap *rzs, unsigned id,
+			const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dlen)
+{
+	int ret;
+#if defined(CONFIG_RAMZSWAP_STATS)
+	ktime_t start = ktime_get();
+#endif
+
+	ret = compressors[id].decompress(src, src_len, dst, dlen);
+
+#if defined(CONFIG_RAMZSWAP_STATS)
+	stat64_inc(rzs, &rzs->stats.decompress_pages[id]);
+	stat64_add(rzs, &rzs->stats.decompress_ns[id],
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+#endif
+	return ret;
+}
+
+/*
+ * Compressed objects live in the pool of the allocator chosen for
+ * the device. Objects are always accessed through these helpers:
+ * zspool objects may span two pages.
+ */
+static const char *allocator_names[RZS_NR_ALLOCATORS] = {
+	[RZS_ALLOCATOR_XVMALLOC] = "xvmalloc",
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+	[RZS_ALLOCATOR_ZSPOOL] = "zspool",
+#endif
+};
+
+static int ramzswap_allocator_valid(unsigned id)
+{
+	return id < RZS_NR_ALLOCATORS && allocator_names[id];
+}
+
+static int ramzswap_allocator_by_name(const char *name)
+{
+	unsigned id;
+
+	for (id = 0; id < RZS_NR_ALLOCATORS; id++) {
+		if (ramzswap_allocator_valid(id) &&
+				!strcmp(allocator_names[id], name))
+			return id;
+	}
+
+	return -EINVAL;
+}
+
+static int rzs_create_pool(struct ramzswap *rzs)
+{
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+	if (rzs->allocator == RZS_ALLOCATOR_ZSPOOL) {
+		rzs->zs_pool = zs_create_pool();
+		return rzs->zs_pool ? 0 : -ENOMEM;
+	}
+#endif
+	rzs->mem_pool = xv_create_pool();
+	return rzs->mem_pool ? 0 : -ENOMEM;
+}
+
+static void rzs_destroy_pool(struct ramzswap *rzs)
+{
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+	if (rzs->zs_pool) {
+		zs_destroy_pool(rzs->zs_pool);
+		rzs->zs_pool = NULL;
+	}
+#endif
+	if (rzs->mem_pool) {
+		xv_destroy_pool(rzs->mem_pool);
+		rzs->mem_pool = NULL;
+	}
+}
+
+static int rzs_malloc(struct ramzswap *rzs, u32 size, struct page **page,
+			u32 *offset, gfp_t flags)
+{
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+	if (rzs->allocator == RZS_ALLOCATOR_ZSPOOL)
+		return zs_malloc(rzs->zs_pool, size, page, offset, flags);
+#endif
+	return xv_malloc(rzs->mem_pool, size, page, offset, flags);
+}
+
+static void rzs_free(struct ramzswap *rzs, struct page *page, u32 offset)
+{
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+	if (rzs->allocator == RZS_ALLOCATOR_ZSPOOL) {
+		zs_free(rzs->zs_pool, page, offset);
+		return;
+	}
+#endif
+	xv_free(rzs->mem_pool, page, offset);
+}
+
+static void *rzs_map_object(struct ramzswap *rzs, struct page *page,
+			u32 offset, enum km_type type)
+{
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+	if (rzs->allocator == RZS_ALLOCATOR_ZSPOOL)
+		return zs_map_object(rzs->zs_pool, page, offset, type);
+#endif
+	return kmap_atomic(page, type) + offset;
+}
+
+static void rzs_unmap_object(struct ramzswap *rzs, struct page *page,
+			u32 offset, void *obj, enum km_type type, int dirty)
+{
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+	if (rzs->allocator == RZS_ALLOCATOR_ZSPOOL) {
+		zs_unmap_object(rzs->zs_pool, page, offset, obj, type, dirty);
+		return;
+	}
+#endif
+	kunmap_atomic(obj, type);
+}
+
+static u32 rzs_get_object_size(struct ramzswap *rzs, void *obj)
+{
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+	if (rzs->allocator == RZS_ALLOCATOR_ZSPOOL)
+		return zs_get_object_size(obj);
+#endif
+	return xv_get_object_size(obj);
+}
+
+#if defined(CONFIG_RAMZSWAP_STATS)
+static u64 rzs_get_total_size_bytes(struct ramzswap *rzs)
+{
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+	if (rzs->allocator == RZS_ALLOCATOR_ZSPOOL)
+		return zs_get_total_size_bytes(rzs->zs_pool);
+#endif
+	return xv_get_total_size_bytes(rzs->mem_pool);
+}
+#endif
+
+/*
+ * Compaction moves objects around, so anyone looking up an object
+ * through the table and then accessing it holds this for read.
+ * Only zspool pools are ever compacted.
+ */
+static void rzs_compact_read_lock(struct ramzswap *rzs)
+{
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+	if (rzs->allocator == RZS_ALLOCATOR_ZSPOOL)
+		read_lock(&rzs->compact_lock);
+#endif
+}
+
+static void rzs_compact_read_unlock(struct ramzswap *rzs)
+{
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+	if (rzs->allocator == RZS_ALLOCATOR_ZSPOOL)
+		read_unlock(&rzs->compact_lock);
+#endif
+}
+
 static int page_zero_filled(void *ptr)
 {
 	unsigned int pos;
@@ -113,6 +396,14 @@ static int page_zero_filled(void *ptr)
 	return 1;
 }
 
+/*
+ * Is compressed data above 'perc' percent of memlimit?
+ */
+static int ramzswap_wb_above(struct ramzswap *rzs, unsigned perc)
+{
+	return rzs->stats.compr_size > rzs->memlimit / 100 * perc;
+}
+
 /*
  * memlimit cannot be greater than backing disk size.
  */
@@ -278,23 +569,25 @@ static void ramzswap_flush_dcache_page(struct page *page)
 }
 
 static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
-			struct ramzswap_ioctl_stats *s)
+			struct ramzswap_ioctl_stats_ext *s)
 {
-	strncpy(s->backing_swap_name, rzs->backing_swap_name,
+	strncpy(s->base.backing_swap_name, rzs->backing_swap_name,
 		MAX_SWAP_NAME_LEN - 1);
-	s->backing_swap_name[MAX_SWAP_NAME_LEN - 1] = '\0';
+	s->base.backing_swap_name[MAX_SWAP_NAME_LEN - 1] = '\0';
 
-	s->disksize = rzs->disksize;
-	s->memlimit = rzs->memlimit;
+	s->base.disksize = rzs->disksize;
+	s->base.memlimit = rzs->memlimit;
+	s->compressor = rzs->compressor;
 
 #if defined(CONFIG_RAMZSWAP_STATS)
 	{
+	int i;
 	struct ramzswap_stats *rs = &rzs->stats;
-	size_t succ_writes, mem_used;
+	size_t succ_writes, mem_used, pool_size, pool_data;
 	unsigned int good_compress_perc = 0, no_compress_perc = 0;
 
-	mem_used = xv_get_total_size_bytes(rzs->mem_pool)
-			+ (rs->pages_expand << PAGE_SHIFT);
+	pool_size = rzs_get_total_size_bytes(rzs);
+	mem_used = pool_size + (rs->pages_expand << PAGE_SHIFT);
 	succ_writes = stat64_read(rzs, &rs->num_writes) -
 			stat64_read(rzs, &rs->failed_writes);
 
@@ -305,25 +598,59 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 					/ rs->pages_stored;
 	}
 
-	s->num_reads = stat64_read(rzs, &rs->num_reads);
-	s->num_writes = stat64_read(rzs, &rs->num_writes);
-	s->failed_reads = stat64_read(rzs, &rs->failed_reads);
-	s->failed_writes = stat64_read(rzs, &rs->failed_writes);
-	s->invalid_io = stat64_read(rzs, &rs->invalid_io);
-	s->notify_free = stat64_read(rzs, &rs->notify_free);
-	s->pages_zero = rs->pages_zero;
+	s->base.num_reads = stat64_read(rzs, &rs->num_reads);
+	s->base.num_writes = stat64_read(rzs, &rs->num_writes);
+	s->base.failed_reads = stat64_read(rzs, &rs->failed_reads);
+	s->base.failed_writes = stat64_read(rzs, &rs->failed_writes);
+	s->base.invalid_io = stat64_read(rzs, &rs->invalid_io);
+	s->base.notify_free = stat64_read(rzs, &rs->notify_free);
+	s->base.pages_zero = rs->pages_zero;
+
+	s->base.good_compress_pct = good_compress_perc;
+	s->base.pages_expand_pct = no_compress_perc;
+
+	s->base.pages_stored = rs->pages_stored;
+	s->base.pages_used = mem_used >> PAGE_SHIFT;
+	s->base.orig_data_size = rs->pages_stored << PAGE_SHIFT;
+	s->base.compr_data_size = rs->compr_size;
+	s->base.mem_used_total = mem_used;
+
+	/* Share of pool memory not holding compressed data */
+	pool_data = rs->compr_size - (rs->pages_expand << PAGE_SHIFT);
+	s->allocator = rzs->allocator;
+	s->pool_frag_pct = pool_size && pool_data < pool_size ?
+			100 - div64_u64((u64)pool_data * 100, pool_size) : 0;
+	s->compact_pages_freed = stat64_read(rzs, &rs->compact_pages_freed);
 
-	s->good_compress_pct = good_compress_perc;
-	s->pages_expand_pct = no_compress_perc;
+	s->base.bdev_num_reads = stat64_read(rzs, &rs->bdev_num_reads);
+	s->base.bdev_num_writes = stat64_read(rzs, &rs->bdev_num_writes);
 
-	s->pages_stored = rs->pages_stored;
-	s->pages_used = mem_used >> PAGE_SHIFT;
-	s->orig_data_size = rs->pages_stored << PAGE_SHIFT;
-	s->compr_data_size = rs->compr_size;
-	s->mem_used_total = mem_used;
+	s->lock_contended = stat64_read(rzs, &rs->lock_contended);
+	s->lock_wait_ns = stat64_read(rzs, &rs->lock_wait_ns);
+	s->cpu_contended = stat64_read(rzs, &rs->cpu_contended);
+	s->cpu_wait_ns = stat64_read(rzs, &rs->cpu_wait_ns);
 
-	s->bdev_num_reads = stat64_read(rzs, &rs->bdev_num_reads);
-	s->bdev_num_writes = stat64_read(rzs, &rs->bdev_num_writes);
+	s->wb_pages = stat64_read(rzs, &rs->wb_pages);
+	s->wb_failed = stat64_read(rzs, &rs->wb_failed);
+
+	s->dedup_hits = stat64_read(rzs, &rs->dedup_hits);
+	s->pages_dedup = rs->pages_dedup;
+	s->dedup_bytes_saved = rs->dedup_saved;
+
+	for (i = 0; i < RZS_NR_COMPRESSORS; i++) {
+		u64 pages, ns;
+
+		pages = stat64_read(rzs, &rs->compress_pages[i]);
+		ns = stat64_read(rzs, &rs->compress_ns[i]);
+		s->compress_pages[i] = pages;
+		s->compress_ns_per_page[i] = pages ? div64_u64(ns, pages) : 0;
+
+		pages = stat64_read(rzs, &rs->decompress_pages[i]);
+		ns = stat64_read(rzs, &rs->decompress_ns[i]);
+		s->decompress_pages[i] = pages;
+		s->decompress_ns_per_page[i] = pages ?
+					div64_u64(ns, pages) : 0;
+	}
 	}
 #endif /* CONFIG_RAMZSWAP_STATS */
 }
@@ -645,10 +972,188 @@ static u32 map_backing_swap_page(struct ramzswap *rzs, u32 pagenum)
 	return se->phy_pagenum + se_offset;
 }
 
-static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+#if defined(CONFIG_RAMZSWAP_DEDUP)
+static struct hlist_head *dedup_bucket(struct ramzswap *rzs, u32 hash)
+{
+	return &rzs->dedup_table[hash & (rzs->dedup_buckets - 1)];
+}
+
+/*
+ * Look for a stored object with the same compressed content. On
+ * a hit, take a reference on it and point the table entry at it.
+ */
+static int ramzswap_dedup_get(struct ramzswap *rzs, u32 index,
+			unsigned comp, u32 hash,
+			const unsigned char *src, size_t clen)
+{
+	int found = 0;
+	unsigned char *cmem;
+	struct page *page = NULL;
+	u32 offset = 0;
+	struct rzs_dedup_entry *e;
+	struct hlist_node *pos;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_for_each_entry(e, pos, dedup_bucket(rzs, hash), node) {
+		if (e->hash != hash || e->len != clen ||
+				e->compressor != comp)
+			continue;
+
+		/* Objects are not moved while their entry is looked at */
+		cmem = rzs_map_object(rzs, e->page, e->offset, KM_USER1);
+		found = !memcmp(cmem + sizeof(struct zobj_header), src, clen);
+		rzs_unmap_object(rzs, e->page, e->offset, cmem, KM_USER1, 0);
+
+		if (found) {
+			page = e->page;
+			offset = e->offset;
+			e->refcount++;
+			stat_inc(&rzs->stats.pages_dedup);
+#if defined(CONFIG_RAMZSWAP_STATS)
+			rzs->stats.dedup_saved += clen;
+#endif
+			break;
+		}
+	}
+	spin_unlock(&rzs->dedup_lock);
+
+	if (!found)
+		return 0;
+
+	/*
+	 * Our reference keeps the object alive, and compaction
+	 * does not move shared objects.
+	 */
+	rzs_mutex_lock(rzs, &rzs->lock, &rzs->stats.lock_contended,
+			&rzs->stats.lock_wait_ns);
+	rzs->table[index].page = page;
+	rzs->table[index].offset = offset;
+	rzs_set_compressor(rzs, index, comp);
+	rzs_set_flag(rzs, index, RZS_REFERENCED);
+	stat_inc(&rzs->stats.pages_stored);
+	if (clen <= PAGE_SIZE / 2)
+		stat_inc(&rzs->stats.good_compress);
+	mutex_unlock(&rzs->lock);
+
+	stat64_inc(rzs, &rzs->stats.dedup_hits);
+	return 1;
+}
+
+/*
+ * Index a newly stored object so that later writes of the same
+ * content can share it. Failure to index is harmless: the object
+ * is then simply never shared.
+ */
+static void ramzswap_dedup_add(struct ramzswap *rzs, struct page *page,
+			u32 offset, unsigned comp, u32 hash, size_t clen)
+{
+	struct rzs_dedup_entry *e;
+
+	e = kmalloc(sizeof(*e), GFP_NOIO);
+	if (unlikely(!e))
+		return;
+
+	e->page = page;
+	e->offset = offset;
+	e->hash = hash;
+	e->len = clen;
+	e->compressor = comp;
+	e->refcount = 1;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_add_head(&e->node, dedup_bucket(rzs, hash));
+	spin_unlock(&rzs->dedup_lock);
+}
+
+/*
+ * Drop a reference on a stored object. Returns 1 if the object
+ * is still used by other slots and so must not be freed. Called
+ * from swap slot free notify, so this must not sleep.
+ */
+static int ramzswap_dedup_put(struct ramzswap *rzs, struct page *page,
+			u32 offset)
+{
+	u32 hash;
+	void *obj;
+	struct rzs_dedup_entry *e;
+	struct hlist_node *pos;
+
+	obj = rzs_map_object(rzs, page, offset, KM_USER0);
+	hash = ((struct zobj_header *)obj)->hash;
+	rzs_unmap_object(rzs, page, offset, obj, KM_USER0, 0);
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_for_each_entry(e, pos, dedup_bucket(rzs, hash), node) {
+		if (e->page != page || e->offset != offset)
+			continue;
+
+		if (--e->refcount) {
+			stat_dec(&rzs->stats.pages_dedup);
+#if defined(CONFIG_RAMZSWAP_STATS)
+			rzs->stats.dedup_saved -= e->len;
+#endif
+			spin_unlock(&rzs->dedup_lock);
+			return 1;
+		}
+
+		hlist_del(&e->node);
+		spin_unlock(&rzs->dedup_lock);
+		kfree(e);
+		return 0;
+	}
+	spin_unlock(&rzs->dedup_lock);
+
+	/* Object was never indexed */
+	return 0;
+}
+
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+/*
+ * Compaction moved an object: update its index entry. Objects
+ * shared by several slots cannot be moved since only one of the
+ * referencing table entries is known.
+ */
+static int ramzswap_dedup_move(struct ramzswap *rzs, u32 hash,
+			struct page *old_page, u32 old_offset,
+			struct page *new_page, u32 new_offset)
+{
+	int ret = 0;
+	struct rzs_dedup_entry *e;
+	struct hlist_node *pos;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_for_each_entry(e, pos, dedup_bucket(rzs, hash), node) {
+		if (e->page != old_page || e->offset != old_offset)
+			continue;
+
+		if (e->refcount > 1) {
+			ret = -EBUSY;
+			break;
+		}
+
+		e->page = new_page;
+		e->offset = new_offset;
+		break;
+	}
+	spin_unlock(&rzs->dedup_lock);
+
+	return ret;
+}
+#endif
+#else
+static int ramzswap_dedup_put(struct ramzswap *rzs, struct page *page,
+			u32 offset)
+{
+	return 0;
+}
+#endif /* CONFIG_RAMZSWAP_DEDUP */
+
+/* Called with rzs->table_lock held */
+static void __ramzswap_free_page(struct ramzswap *rzs, size_t index)
 {
 	u32 clen;
 	void *obj;
+	int shared = 0;
 
 	struct page *page = rzs->table[index].page;
 	u32 offset = rzs->table[index].offset;
@@ -659,7 +1164,7 @@ static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 		 * Simply clear zero page flag.
 		 */
 		if (rzs_test_flag(rzs, index, RZS_ZERO)) {
-			rzs_clear_flag(rzs, index, RZS_ZERO);
+			__rzs_clear_flag(rzs, index, RZS_ZERO);
 			stat_dec(&rzs->stats.pages_zero);
 		}
 		return;
@@ -668,27 +1173,131 @@ static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
 		__free_page(page);
-		rzs_clear_flag(rzs, index, RZS_UNCOMPRESSED);
+		__rzs_clear_flag(rzs, index, RZS_UNCOMPRESSED);
 		stat_dec(&rzs->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	rzs_compact_read_lock(rzs);
+	page = rzs->table[index].page;
+	offset = rzs->table[index].offset;
+
+	obj = rzs_map_object(rzs, page, offset, KM_USER0);
+	clen = rzs_get_object_size(rzs, obj) - sizeof(struct zobj_header);
+	rzs_unmap_object(rzs, page, offset, obj, KM_USER0, 0);
+
+	/* Other slots with the same content may still use this object */
+	shared = ramzswap_dedup_put(rzs, page, offset);
+	if (!shared)
+		rzs_free(rzs, page, offset);
+	rzs_compact_read_unlock(rzs);
 
-	xv_free(rzs->mem_pool, page, offset);
 	if (clen <= PAGE_SIZE / 2)
 		stat_dec(&rzs->stats.good_compress);
 
 out:
-	rzs->stats.compr_size -= clen;
+	if (!shared)
+		rzs->stats.compr_size -= clen;
 	stat_dec(&rzs->stats.pages_stored);
 
 	rzs->table[index].page = NULL;
 	rzs->table[index].offset = 0;
 }
 
+/*
+ * Returns nonzero if the slot is under writeback, in which case the
+ * writeback thread frees it once the I/O is done.
+ */
+static int ramzswap_free_page(struct ramzswap *rzs, size_t index)
+{
+	int busy;
+
+	spin_lock(&rzs->table_lock);
+	busy = rzs_test_flag(rzs, index, RZS_WRITEBACK);
+	if (unlikely(busy))
+		__rzs_set_flag(rzs, index, RZS_DISCARD);
+	else
+		__ramzswap_free_page(rzs, index);
+	spin_unlock(&rzs->table_lock);
+
+	return busy;
+}
+
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+/*
+ * Point the table entry of an object to its new location. Called by
+ * zspool with the class lock held, and compaction holds rzs->lock and
+ * compact_lock for write, so no one else looks at the table entry.
+ */
+static int ramzswap_migrate_object(void *priv, struct page *old_page,
+			u32 old_offset, struct page *new_page, u32 new_offset)
+{
+	u32 index;
+	struct zobj_header *zheader;
+	struct ramzswap *rzs = priv;
+#if defined(CONFIG_RAMZSWAP_DEDUP)
+	u32 hash;
+#endif
+
+	zheader = zs_map_object(rzs->zs_pool, new_page, new_offset, KM_USER0);
+	index = zheader->table_idx;
+#if defined(CONFIG_RAMZSWAP_DEDUP)
+	hash = zheader->hash;
+#endif
+	zs_unmap_object(rzs->zs_pool, new_page, new_offset, zheader,
+			KM_USER0, 0);
+
+	/*
+	 * The back-reference is that of the first writer. Leave the
+	 * object alone if that slot no longer owns it.
+	 */
+	if (unlikely(index >= rzs->disksize >> PAGE_SHIFT))
+		return -EINVAL;
+	if (rzs->table[index].page != old_page ||
+			rzs->table[index].offset != old_offset ||
+			rzs_test_flag(rzs, index, RZS_WRITEBACK))
+		return -EBUSY;
+
+#if defined(CONFIG_RAMZSWAP_DEDUP)
+	/* Shared objects have more than one table entry to fix up */
+	if (ramzswap_dedup_move(rzs, hash, old_page, old_offset,
+				new_page, new_offset))
+		return -EBUSY;
+#endif
+
+	rzs->table[index].page = new_page;
+	rzs->table[index].offset = new_offset;
+	return 0;
+}
+
+/*
+ * Move objects out of sparsely used zspages so that their pages can
+ * be given back. One size class at a time, to keep lock hold times
+ * short. Returns the number of pages freed.
+ */
+static unsigned long ramzswap_compact(struct ramzswap *rzs)
+{
+	int i;
+	unsigned long freed = 0;
+
+	if (rzs->allocator != RZS_ALLOCATOR_ZSPOOL)
+		return 0;
+
+	for (i = 0; i < zs_get_nr_classes(); i++) {
+		mutex_lock(&rzs->lock);
+		write_lock(&rzs->compact_lock);
+		freed += zs_compact_class(rzs->zs_pool, i,
+				ramzswap_migrate_object, rzs);
+		write_unlock(&rzs->compact_lock);
+		mutex_unlock(&rzs->lock);
+		cond_resched();
+	}
+
+	stat64_add(rzs, &rzs->stats.compact_pages_freed, freed);
+	return freed;
+}
+#endif
+
 static int handle_zero_page(struct bio *bio)
 {
 	void *user_mem;
@@ -773,17 +1382,15 @@ static int handle_ramzswap_fault(struct ramzswap *rzs, struct bio *bio)
 	return 0;
 }
 
-static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
+static int __ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
-	u32 index;
+	u32 index, offset;
 	size_t clen;
-	struct page *page;
+	struct page *page, *obj_page;
 	struct zobj_header *zheader;
 	unsigned char *user_mem, *cmem;
 
-	stat64_inc(rzs, &rzs->stats.num_reads);
-
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
@@ -801,14 +1408,18 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 	user_mem = kmap_atomic(page, KM_USER0);
 	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	rzs_compact_read_lock(rzs);
+	obj_page = rzs->table[index].page;
+	offset = rzs->table[index].offset;
+	cmem = rzs_map_object(rzs, obj_page, offset, KM_USER1);
 
-	ret = DECOMPRESS(cmem + sizeof(*zheader),
-		xv_get_object_size(cmem) - sizeof(*zheader),
+	ret = rzs_decompress(rzs, rzs_get_compressor(rzs, index),
+		cmem + sizeof(*zheader),
+		rzs_get_object_size(rzs, cmem) - sizeof(*zheader),
 		user_mem, &clen);
 
-	kunmap_atomic(cmem, KM_USER1);
+	rzs_unmap_object(rzs, obj_page, offset, cmem, KM_USER1, 0);
+	rzs_compact_read_unlock(rzs);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	/* should NEVER happen */
@@ -830,13 +1441,50 @@ out:
 	return 0;
 }
 
+/*
+ * The writeback thread frees a slot once its copy is on backing swap.
+ * Wait for that, then hold a reference on the slot while it is read so
+ * that it is not claimed again: the page found in the table stays valid
+ * until the read is done.
+ */
+static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
+{
+	int ret;
+	u32 index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+
+	stat64_inc(rzs, &rzs->stats.num_reads);
+
+	spin_lock(&rzs->table_lock);
+	while (unlikely(rzs_test_flag(rzs, index, RZS_WRITEBACK))) {
+		spin_unlock(&rzs->table_lock);
+		wait_event(rzs->wb_done_wait,
+			!rzs_test_flag(rzs, index, RZS_WRITEBACK));
+		spin_lock(&rzs->table_lock);
+	}
+	rzs->table[index].count++;
+	spin_unlock(&rzs->table_lock);
+
+	ret = __ramzswap_read(rzs, bio);
+
+	spin_lock(&rzs->table_lock);
+	rzs->table[index].count--;
+	spin_unlock(&rzs->table_lock);
+
+	return ret;
+}
+
 static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret, fwd_write_request = 0;
 	u32 offset, index;
+	unsigned comp;
+#if defined(CONFIG_RAMZSWAP_DEDUP)
+	u32 hash;
+#endif
 	size_t clen;
 	struct zobj_header *zheader;
 	struct page *page, *page_store;
+	struct ramzswap_percpu *pcpu = NULL;
 	unsigned char *user_mem, *cmem, *src;
 
 	stat64_inc(rzs, &rzs->stats.num_writes);
@@ -844,7 +1492,13 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	src = rzs->compress_buffer;
+	/*
+	 * Old content of this slot is still being written back. Do
+	 * not let it land on backing swap after the new content.
+	 */
+	if (unlikely(rzs_test_flag(rzs, index, RZS_WRITEBACK)))
+		wait_event(rzs->wb_done_wait,
+			!rzs_test_flag(rzs, index, RZS_WRITEBACK));
 
 #ifndef CONFIG_SWAP_FREE_NOTIFY
 	/*
@@ -852,46 +1506,73 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 	 * is no longer referenced by any process. So, its now safe
 	 * to free the memory that was allocated for this page.
 	 */
-	if (rzs->table[index].page || rzs_test_flag(rzs, index, RZS_ZERO))
-		ramzswap_free_page(rzs, index);
+	if (rzs->table[index].page || rzs_test_flag(rzs, index, RZS_ZERO)) {
+		/*
+		 * The writeback thread may have claimed the slot since:
+		 * then it frees the old content, wait for that.
+		 */
+		while (ramzswap_free_page(rzs, index))
+			wait_event(rzs->wb_done_wait,
+				!rzs_test_flag(rzs, index, RZS_WRITEBACK));
+	}
 #endif
 
-	mutex_lock(&rzs->lock);
-
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (page_zero_filled(user_mem)) {
 		kunmap_atomic(user_mem, KM_USER0);
+		rzs_mutex_lock(rzs, &rzs->lock, &rzs->stats.lock_contended,
+				&rzs->stats.lock_wait_ns);
 		rzs_set_flag(rzs, index, RZS_ZERO);
-		mutex_unlock(&rzs->lock);
 		stat_inc(&rzs->stats.pages_zero);
+		mutex_unlock(&rzs->lock);
 
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
 		bio_endio(bio, 0);
 		return 0;
 	}
+	kunmap_atomic(user_mem, KM_USER0);
 
 	if (rzs->backing_swap &&
 		(rzs->stats.compr_size > rzs->memlimit - PAGE_SIZE)) {
-		kunmap_atomic(user_mem, KM_USER0);
-		mutex_unlock(&rzs->lock);
 		fwd_write_request = 1;
 		goto out;
 	}
 
-	ret = COMPRESS(user_mem, PAGE_SIZE, src, &clen,
-				rzs->compress_workmem);
+	/*
+	 * The backend is sampled once: it may be switched while
+	 * we write, and the slot must record the one actually used.
+	 */
+	comp = ACCESS_ONCE(rzs->compressor);
+	clen = PAGE_SIZE;
+
+	if (likely(compressors[comp].compress)) {
+		/*
+		 * Compress into the buffer of the current cpu. We may get
+		 * migrated afterwards but the buffer stays ours until its
+		 * mutex is released, so no other writer can clobber it.
+		 */
+		pcpu = per_cpu_ptr(rzs->percpu, raw_smp_processor_id());
+		rzs_mutex_lock(rzs, &pcpu->lock, &rzs->stats.cpu_contended,
+				&rzs->stats.cpu_wait_ns);
+		src = pcpu->compress_buffer;
 
-	kunmap_atomic(user_mem, KM_USER0);
+		user_mem = kmap_atomic(page, KM_USER0);
+		ret = rzs_compress(rzs, comp, pcpu, user_mem, src, &clen);
+		kunmap_atomic(user_mem, KM_USER0);
+
+		if (unlikely(clen > max_zpage_size))
+			mutex_unlock(&pcpu->lock);
+	}
 
 	/*
-	 * Page is incompressible. Forward it to backing swap
-	 * if present. Otherwise, store it as-is (uncompressed)
-	 * since we do not want to return too many swap write
-	 * errors which has side effect of hanging the system.
+	 * Page is incompressible (or compression is disabled).
+	 * Forward it to backing swap if present. Otherwise, store
+	 * it as-is (uncompressed) since we do not want to return
+	 * too many swap write errors which has side effect of
+	 * hanging the system.
 	 */
 	if (unlikely(clen > max_zpage_size)) {
 		if (rzs->backing_swap) {
-			mutex_unlock(&rzs->lock);
 			fwd_write_request = 1;
 			goto out;
 		}
@@ -899,25 +1580,43 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		clen = PAGE_SIZE;
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
-			mutex_unlock(&rzs->lock);
 			pr_info("Error allocating memory for incompressible "
 				"page: %u\n", index);
 			stat64_inc(rzs, &rzs->stats.failed_writes);
 			goto out;
 		}
 
-		offset = 0;
+		user_mem = kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, user_mem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(user_mem, KM_USER0);
+
+		rzs_mutex_lock(rzs, &rzs->lock, &rzs->stats.lock_contended,
+				&rzs->stats.lock_wait_ns);
 		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
+		rzs_set_flag(rzs, index, RZS_REFERENCED);
 		stat_inc(&rzs->stats.pages_expand);
 		rzs->table[index].page = page_store;
-		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
+		rzs->table[index].offset = 0;
+		rzs->stats.compr_size += clen;
+		stat_inc(&rzs->stats.pages_stored);
+		mutex_unlock(&rzs->lock);
+		goto done;
 	}
 
-	if (xv_malloc(rzs->mem_pool, clen + sizeof(*zheader),
-			&rzs->table[index].page, &offset,
+#if defined(CONFIG_RAMZSWAP_DEDUP)
+	hash = jhash(src, clen, comp);
+	if (ramzswap_dedup_get(rzs, index, comp, hash, src, clen)) {
+		mutex_unlock(&pcpu->lock);
+		goto done;
+	}
+#endif
+
+	/* The pool does its own locking */
+	if (rzs_malloc(rzs, clen + sizeof(*zheader), &page_store, &offset,
 			GFP_NOIO | __GFP_HIGHMEM)) {
-		mutex_unlock(&rzs->lock);
+		mutex_unlock(&pcpu->lock);
 		pr_info("Error allocating memory for compressed "
 			"page: %u, size=%zu\n", index, clen);
 		stat64_inc(rzs, &rzs->stats.failed_writes);
@@ -926,26 +1625,31 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		goto out;
 	}
 
-memstore:
-	rzs->table[index].offset = offset;
-
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	/*
+	 * No one else knows about the object until it is in the table,
+	 * so fill it in before taking rzs->lock. Compaction does not
+	 * move objects that the table does not point to.
+	 */
+	cmem = rzs_map_object(rzs, page_store, offset, KM_USER1);
+	zheader = (struct zobj_header *)cmem;
 
-#if 0
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
 	/* Back-reference needed for memory defragmentation */
-	if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
+	zheader->table_idx = index;
+#endif
+#if defined(CONFIG_RAMZSWAP_DEDUP)
+	zheader->hash = hash;
 #endif
 
-	memcpy(cmem, src, clen);
+	memcpy(cmem + sizeof(*zheader), src, clen);
+	rzs_unmap_object(rzs, page_store, offset, cmem, KM_USER1, 1);
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+	rzs_mutex_lock(rzs, &rzs->lock, &rzs->stats.lock_contended,
+			&rzs->stats.lock_wait_ns);
+	rzs->table[index].page = page_store;
+	rzs->table[index].offset = offset;
+	rzs_set_compressor(rzs, index, comp);
+	rzs_set_flag(rzs, index, RZS_REFERENCED);
 
 	/* Update stats */
 	rzs->stats.compr_size += clen;
@@ -953,8 +1657,19 @@ memstore:
 	if (clen <= PAGE_SIZE / 2)
 		stat_inc(&rzs->stats.good_compress);
 
+#if defined(CONFIG_RAMZSWAP_DEDUP)
+	/* Index under rzs->lock so that compaction sees the entry */
+	ramzswap_dedup_add(rzs, page_store, offset, comp, hash, clen);
+#endif
+
 	mutex_unlock(&rzs->lock);
 
+	mutex_unlock(&pcpu->lock);
+
+done:
+	if (rzs->wb_thread && ramzswap_wb_above(rzs, wb_high_perc_memlimit))
+		wake_up(&rzs->wb_wait);
+
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
@@ -990,6 +1705,250 @@ out:
 }
 
 
+/*
+ * Background writeback: when compressed data approaches memlimit,
+ * a per-device thread moves the least recently stored pages to the
+ * backing swap device. Slots map linearly to backing swap pages, so
+ * once a page is written back its table entry is simply cleared and
+ * later reads are forwarded by handle_ramzswap_fault().
+ */
+/*
+ * Pick up to RZS_WB_BATCH victims using a clock over the table:
+ * slots stored since the hand last passed get a second chance.
+ * The hand moves in slot order, so victims tend to be adjacent
+ * on the backing device and their bios can be merged.
+ */
+static int ramzswap_wb_select(struct ramzswap *rzs, struct ramzswap_wb_batch *b)
+{
+	u32 index;
+	size_t scanned = 0, num_pages = rzs->disksize >> PAGE_SHIFT;
+
+	b->nr = 0;
+
+	mutex_lock(&rzs->lock);
+	while (b->nr < RZS_WB_BATCH && scanned++ < 2 * num_pages) {
+		/* Do not keep writers out for a whole table scan */
+		if (!(scanned % RZS_WB_SCAN_CHUNK)) {
+			mutex_unlock(&rzs->lock);
+			cond_resched();
+			mutex_lock(&rzs->lock);
+		}
+
+		index = rzs->wb_hand;
+		/* Slot 0 holds the swap header: never write it back */
+		if (++rzs->wb_hand >= num_pages)
+			rzs->wb_hand = 1;
+
+		if (!index)
+			continue;
+
+		/* Claim under table_lock so that the slot is not freed */
+		spin_lock(&rzs->table_lock);
+		if (!rzs->table[index].page || rzs->table[index].count ||
+				rzs_test_flag(rzs, index, RZS_WRITEBACK)) {
+			spin_unlock(&rzs->table_lock);
+			continue;
+		}
+
+		if (rzs_test_flag(rzs, index, RZS_REFERENCED)) {
+			__rzs_clear_flag(rzs, index, RZS_REFERENCED);
+			spin_unlock(&rzs->table_lock);
+			continue;
+		}
+
+		__rzs_set_flag(rzs, index, RZS_WRITEBACK);
+		spin_unlock(&rzs->table_lock);
+		b->index[b->nr++] = index;
+	}
+	mutex_unlock(&rzs->lock);
+
+	return b->nr;
+}
+
+/*
+ * Get an uncompressed copy of the page stored in slot 'index'.
+ * Incompressible pages are written straight from the stored page.
+ */
+static struct page *ramzswap_wb_get_page(struct ramzswap *rzs, u32 index)
+{
+	int ret;
+	u32 offset;
+	size_t clen = PAGE_SIZE;
+	struct page *page, *obj_page;
+	unsigned char *user_mem, *cmem;
+
+	if (rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))
+		return rzs->table[index].page;
+
+	page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+	if (!page)
+		return NULL;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+
+	rzs_compact_read_lock(rzs);
+	obj_page = rzs->table[index].page;
+	offset = rzs->table[index].offset;
+	cmem = rzs_map_object(rzs, obj_page, offset, KM_USER1);
+
+	ret = rzs_decompress(rzs, rzs_get_compressor(rzs, index),
+		cmem + sizeof(struct zobj_header),
+		rzs_get_object_size(rzs, cmem) - sizeof(struct zobj_header),
+		user_mem, &clen);
+
+	rzs_unmap_object(rzs, obj_page, offset, cmem, KM_USER1, 0);
+	rzs_compact_read_unlock(rzs);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	if (unlikely(ret)) {
+		pr_err("Decompression failed during writeback! err=%d, "
+			"page=%u\n", ret, index);
+		__free_page(page);
+		return NULL;
+	}
+
+	return page;
+}
+
+static void ramzswap_wb_end_io(struct bio *bio, int err)
+{
+	int i;
+	struct bio_vec *bvec;
+	struct ramzswap_wb_batch *b = bio->bi_private;
+
+	if (unlikely(err)) {
+		bio_for_each_segment(bvec, bio, i)
+			SetPageError(bvec->bv_page);
+	}
+
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&b->pending))
+		complete(&b->done);
+}
+
+static void ramzswap_wb_submit(struct ramzswap_wb_batch *b, struct bio *bio)
+{
+	atomic_inc(&b->pending);
+	submit_bio(WRITE, bio);
+}
+
+/*
+ * Write the batch to backing swap, merging pages that are
+ * contiguous on the device into a single bio, and wait for it.
+ */
+static void ramzswap_wb_write(struct ramzswap *rzs, struct ramzswap_wb_batch *b)
+{
+	int i;
+	sector_t sector;
+	struct bio *bio = NULL;
+
+	atomic_set(&b->pending, 1);
+	init_completion(&b->done);
+
+	for (i = 0; i < b->nr; i++) {
+		b->page[i] = ramzswap_wb_get_page(rzs, b->index[i]);
+		if (!b->page[i])
+			continue;
+
+		sector = (sector_t)map_backing_swap_page(rzs, b->index[i])
+					<< SECTORS_PER_PAGE_SHIFT;
+
+		if (bio && bio->bi_sector + (bio->bi_size >> SECTOR_SHIFT)
+					== sector &&
+				bio_add_page(bio, b->page[i], PAGE_SIZE, 0)
+					== PAGE_SIZE)
+			continue;
+
+		if (bio)
+			ramzswap_wb_submit(b, bio);
+
+		bio = bio_alloc(GFP_NOIO, RZS_WB_BATCH);
+		bio->bi_bdev = rzs->backing_swap;
+		bio->bi_sector = sector;
+		bio->bi_end_io = ramzswap_wb_end_io;
+		bio->bi_private = b;
+		bio_add_page(bio, b->page[i], PAGE_SIZE, 0);
+	}
+
+	if (bio)
+		ramzswap_wb_submit(b, bio);
+
+	if (!atomic_dec_and_test(&b->pending))
+		wait_for_completion(&b->done);
+}
+
+/*
+ * Release pages whose writeback succeeded (or that were freed in
+ * the meantime) and wake up writers waiting on these slots.
+ */
+static int ramzswap_wb_finish(struct ramzswap *rzs, struct ramzswap_wb_batch *b)
+{
+	int i, failed = 0;
+
+	for (i = 0; i < b->nr; i++) {
+		u32 index = b->index[i];
+		struct page *page = b->page[i];
+		int ok = page && !PageError(page);
+
+		if (page)
+			ClearPageError(page);
+
+		if (ok)
+			stat64_inc(rzs, &rzs->stats.wb_pages);
+		else
+			failed++;
+
+		if (page && page != rzs->table[index].page)
+			__free_page(page);
+
+		spin_lock(&rzs->table_lock);
+		if (ok || rzs_test_flag(rzs, index, RZS_DISCARD))
+			__ramzswap_free_page(rzs, index);
+
+		__rzs_clear_flag(rzs, index, RZS_DISCARD);
+		__rzs_clear_flag(rzs, index, RZS_WRITEBACK);
+		spin_unlock(&rzs->table_lock);
+	}
+
+	wake_up_all(&rzs->wb_done_wait);
+
+	stat64_add(rzs, &rzs->stats.wb_failed, failed);
+	return failed;
+}
+
+static int ramzswap_wb_thread(void *data)
+{
+	struct ramzswap *rzs = data;
+	struct ramzswap_wb_batch *b;
+
+	b = kmalloc(sizeof(*b), GFP_KERNEL);
+	if (!b) {
+		pr_err("Error allocating writeback batch\n");
+		return -ENOMEM;
+	}
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(rzs->wb_wait,
+			kthread_should_stop() ||
+			ramzswap_wb_above(rzs, wb_high_perc_memlimit));
+
+		while (!kthread_should_stop() &&
+				ramzswap_wb_above(rzs, wb_low_perc_memlimit)) {
+			if (!ramzswap_wb_select(rzs, b))
+				break;
+			ramzswap_wb_write(rzs, b);
+			/* Backing device trouble: back off until kicked again */
+			if (ramzswap_wb_finish(rzs, b) == b->nr)
+				break;
+			cond_resched();
+		}
+	}
+
+	kfree(b);
+	return 0;
+}
+
 /*
  * Check if request is within bounds and page aligned.
  */
@@ -1041,6 +2000,67 @@ static int ramzswap_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
+static void ramzswap_free_percpu(struct ramzswap *rzs)
+{
+	int cpu;
+
+	if (!rzs->percpu)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct ramzswap_percpu *pcpu = per_cpu_ptr(rzs->percpu, cpu);
+
+		kfree(pcpu->compress_workmem);
+		free_pages((unsigned long)pcpu->compress_buffer, 1);
+	}
+
+	free_percpu(rzs->percpu);
+	rzs->percpu = NULL;
+}
+
+/*
+ * Allocate compressor working memory and buffer for every
+ * possible cpu so that writers on different cpus do not
+ * serialize on a single compression buffer.
+ */
+static int ramzswap_alloc_percpu(struct ramzswap *rzs)
+{
+	int cpu;
+	unsigned id;
+	size_t wmsize = 0;
+
+	/* The backend can be switched later, size for the largest one */
+	for (id = 0; id < RZS_NR_COMPRESSORS; id++)
+		wmsize = max(wmsize, compressors[id].workmem_size);
+
+	rzs->percpu = alloc_percpu(struct ramzswap_percpu);
+	if (!rzs->percpu) {
+		pr_err("Error allocating per-cpu compression state\n");
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct ramzswap_percpu *pcpu = per_cpu_ptr(rzs->percpu, cpu);
+
+		mutex_init(&pcpu->lock);
+
+		pcpu->compress_workmem = kzalloc(wmsize, GFP_KERNEL);
+		if (!pcpu->compress_workmem) {
+			pr_err("Error allocating compressor working memory!\n");
+			return -ENOMEM;
+		}
+
+		pcpu->compress_buffer = (void *)__get_free_pages(
+					GFP_KERNEL | __GFP_ZERO, 1);
+		if (!pcpu->compress_buffer) {
+			pr_err("Error allocating compressor buffer space\n");
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
 static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 {
 	int is_backing_blkdev = 0;
@@ -1053,17 +2073,18 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 
 	rzs->init_done = 0;
 
+	if (rzs->wb_thread) {
+		kthread_stop(rzs->wb_thread);
+		rzs->wb_thread = NULL;
+	}
+
 	if (rzs->backing_swap && !rzs->num_extents)
 		is_backing_blkdev = 1;
 
 	num_pages = rzs->disksize >> PAGE_SHIFT;
 
 	/* Free various per-device buffers */
-	kfree(rzs->compress_workmem);
-	free_pages((unsigned long)rzs->compress_buffer, 1);
-
-	rzs->compress_workmem = NULL;
-	rzs->compress_buffer = NULL;
+	ramzswap_free_percpu(rzs);
 
 	/* Free all pages that are still in this ramzswap device */
 	for (index = 0; index < num_pages; index++) {
@@ -1078,9 +2099,13 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 
 		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
 			__free_page(page);
-		else
-			xv_free(rzs->mem_pool, page, offset);
+		else if (!ramzswap_dedup_put(rzs, page, offset))
+			rzs_free(rzs, page, offset);
 	}
+#if defined(CONFIG_RAMZSWAP_DEDUP)
+	vfree(rzs->dedup_table);
+	rzs->dedup_table = NULL;
+#endif
 
 	entries_per_page = PAGE_SIZE / sizeof(*rzs->table);
 	num_table_pages = DIV_ROUND_UP(num_pages * sizeof(*rzs->table),
@@ -1098,8 +2123,7 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 	vfree(rzs->table);
 	rzs->table = NULL;
 
-	xv_destroy_pool(rzs->mem_pool);
-	rzs->mem_pool = NULL;
+	rzs_destroy_pool(rzs);
 
 	/* Free all swap extent pages */
 	while (!list_empty(&rzs->backing_swap_extent_list)) {
@@ -1127,12 +2151,14 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 
 	rzs->disksize = 0;
 	rzs->memlimit = 0;
+	rzs->compressor = default_compressor;
+	rzs->allocator = RZS_ALLOCATOR_XVMALLOC;
 }
 
 static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 {
 	int ret, dev_id;
-	size_t num_pages;
+	size_t num_pages, index;
 	struct page *page;
 	union swap_header *swap_header;
 
@@ -1152,19 +2178,9 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	else
 		ramzswap_set_disksize(rzs, totalram_pages << PAGE_SHIFT);
 
-	rzs->compress_workmem = kzalloc(WMSIZE, GFP_KERNEL);
-	if (!rzs->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	rzs->compress_buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!rzs->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = ramzswap_alloc_percpu(rzs);
+	if (ret)
 		goto fail;
-	}
 
 	num_pages = rzs->disksize >> PAGE_SHIFT;
 	rzs->table = vmalloc(num_pages * sizeof(*rzs->table));
@@ -1179,6 +2195,21 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 
 	map_backing_swap_extents(rzs);
 
+#if defined(CONFIG_RAMZSWAP_DEDUP)
+	/* About one bucket for every eight swap slots */
+	rzs->dedup_buckets = roundup_pow_of_two(max_t(size_t,
+						num_pages >> 3, 1));
+	rzs->dedup_table = vmalloc(rzs->dedup_buckets *
+					sizeof(*rzs->dedup_table));
+	if (!rzs->dedup_table) {
+		pr_err("Error allocating dedup hash table\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	for (index = 0; index < rzs->dedup_buckets; index++)
+		INIT_HLIST_HEAD(&rzs->dedup_table[index]);
+#endif
+
 	page = alloc_page(__GFP_ZERO);
 	if (!page) {
 		pr_err("Error allocating swap header page\n");
@@ -1207,8 +2238,7 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 			blk_queue_nonrot(rzs->backing_swap->bd_disk->queue))
 		queue_flag_set_unlocked(QUEUE_FLAG_NONROT, rzs->disk->queue);
 
-	rzs->mem_pool = xv_create_pool();
-	if (!rzs->mem_pool) {
+	if (rzs_create_pool(rzs)) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
 		goto fail;
@@ -1225,6 +2255,18 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 		max_zpage_size = max_zpage_size_nobdev;
 	pr_debug("Max compressed page size: %u bytes\n", max_zpage_size);
 
+	if (rzs->backing_swap) {
+		rzs->wb_hand = 1;
+		rzs->wb_thread = kthread_run(ramzswap_wb_thread, rzs,
+						"ramzswap%d_wb", dev_id);
+		if (IS_ERR(rzs->wb_thread)) {
+			pr_err("Error starting writeback thread\n");
+			ret = PTR_ERR(rzs->wb_thread);
+			rzs->wb_thread = NULL;
+			goto fail;
+		}
+	}
+
 	rzs->init_done = 1;
 
 	if (rzs->backing_swap) {
@@ -1257,6 +2299,7 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 			unsigned int cmd, unsigned long arg)
 {
 	int ret = 0;
+	u32 comp;
 	size_t disksize_kb, memlimit_kb;
 
 	struct ramzswap *rzs = bdev->bd_disk->private_data;
@@ -1306,9 +2349,60 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		pr_debug("Backing swap set to %s\n", rzs->backing_swap_name);
 		break;
 
+	case RZSIO_SET_COMPRESSOR:
+		/*
+		 * Allowed on an initialized device too: every slot
+		 * records the backend it was compressed with.
+		 */
+		if (copy_from_user(&comp, (void *)arg, _IOC_SIZE(cmd))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		if (!ramzswap_compressor_valid(comp)) {
+			ret = -EINVAL;
+			goto out;
+		}
+		rzs->compressor = comp;
+		pr_debug("Compressor set to %s\n", compressors[comp].name);
+		break;
+
+	case RZSIO_SET_ALLOCATOR:
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(&comp, (void *)arg, _IOC_SIZE(cmd))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		if (!ramzswap_allocator_valid(comp)) {
+			ret = -EINVAL;
+			goto out;
+		}
+		rzs->allocator = comp;
+		pr_debug("Allocator set to %s\n", allocator_names[comp]);
+		break;
+
+	case RZSIO_COMPACT:
+	{
+		unsigned long freed = 0;
+		if (!rzs->init_done) {
+			ret = -ENOTTY;
+			goto out;
+		}
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+		freed = ramzswap_compact(rzs);
+#endif
+		pr_debug("Compaction freed %lu pages\n", freed);
+		break;
+	}
+
 	case RZSIO_GET_STATS:
+	case RZSIO_GET_STATS_EXT:
 	{
-		struct ramzswap_ioctl_stats *stats;
+		struct ramzswap_ioctl_stats_ext *stats;
+		size_t len;
+
 		if (!rzs->init_done) {
 			ret = -ENOTTY;
 			goto out;
@@ -1319,7 +2413,9 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 			goto out;
 		}
 		ramzswap_ioctl_get_stats(rzs, stats);
-		if (copy_to_user((void *)arg, stats, sizeof(*stats))) {
+		len = cmd == RZSIO_GET_STATS ? sizeof(stats->base) :
+						sizeof(*stats);
+		if (copy_to_user((void *)arg, stats, len)) {
 			kfree(stats);
 			ret = -EFAULT;
 			goto out;
@@ -1369,7 +2465,18 @@ static int create_device(struct ramzswap *rzs, int device_id)
 	int ret = 0;
 
 	mutex_init(&rzs->lock);
+	spin_lock_init(&rzs->table_lock);
 	spin_lock_init(&rzs->stat64_lock);
+	init_waitqueue_head(&rzs->wb_wait);
+	init_waitqueue_head(&rzs->wb_done_wait);
+#if defined(CONFIG_RAMZSWAP_DEDUP)
+	spin_lock_init(&rzs->dedup_lock);
+#endif
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+	rwlock_init(&rzs->compact_lock);
+#endif
+	rzs->compressor = default_compressor;
+	rzs->allocator = RZS_ALLOCATOR_XVMALLOC;
 	INIT_LIST_HEAD(&rzs->backing_swap_extent_list);
 
 	rzs->queue = blk_alloc_queue(GFP_KERNEL);
@@ -1472,6 +2579,24 @@ static int __init ramzswap_init(void)
 	 */
 	rzs = &devices[0];
 
+	if (compressor[0]) {
+		ret = ramzswap_compressor_by_name(compressor);
+		if (ret < 0) {
+			pr_info("Invalid compressor: %s\n", compressor);
+			goto free_devices;
+		}
+		rzs->compressor = ret;
+	}
+
+	if (allocator[0]) {
+		ret = ramzswap_allocator_by_name(allocator);
+		if (ret < 0) {
+			pr_info("Invalid allocator: %s\n", allocator);
+			goto free_devices;
+		}
+		rzs->allocator = ret;
+	}
+
 	/*
 	 * User specifies either <disksize_kb> or <backing_swap, memlimit_kb>
 	 */
@@ -1566,6 +2691,14 @@ MODULE_PARM_DESC(memlimit_kb, "Memlimit in KB");
 module_param_string(backing_swap, backing_swap, sizeof(backing_swap), 0);
 MODULE_PARM_DESC(backing_swap, "Backing swap name");
 
+/* Optional: default = lzo if built in, else snappy */
+module_param_string(compressor, compressor, sizeof(compressor), 0);
+MODULE_PARM_DESC(compressor, "Compressor for first device: lzo, snappy, none");
+
+/* Optional: default = xvmalloc */
+module_param_string(allocator, allocator, sizeof(allocator), 0);
+MODULE_PARM_DESC(allocator, "Allocator for first device: xvmalloc, zspool");
+
 module_init(ramzswap_init);
 module_exit(ramzswap_exit);
 
@@ -3,9 +3,14 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
 
 #include "ramzswap_ioctl.h"
 #include "xvmalloc.h"
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+#include "zspool.h"
+#endif
 
 /*
  * Some arbitrary value. This is just to catch
@@ -21,9 +26,12 @@ static const unsigned max_num_devices = 32;
  * migrating compressed pages to backing swap disk.
  */
 struct zobj_header {
-#if 0
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
 	u32 table_idx;
 #endif
+#if defined(CONFIG_RAMZSWAP_DEDUP)
+	u32 hash;	/* content hash, to find dedup entry on free */
+#endif
 };
 
 /*-- Configurable parameters */
@@ -52,7 +60,20 @@ static const size_t max_zpage_size_nobdev = PAGE_SIZE / 4 * 3;
  * less than or equal to:
  *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
  * since otherwise xv_malloc would always return failure.
+ * The zspool allocator accepts anything up to PAGE_SIZE - 4.
+ */
+
+/*
+ * Background writeback to backing swap starts when compressed data
+ * exceeds wb_high_perc_memlimit of memlimit and evicts least recently
+ * stored pages until it drops below wb_low_perc_memlimit. Pages are
+ * written in batches of up to RZS_WB_BATCH. Victim selection lets
+ * writers at the table every RZS_WB_SCAN_CHUNK slots.
  */
+static const unsigned wb_high_perc_memlimit = 90;
+static const unsigned wb_low_perc_memlimit = 80;
+#define RZS_WB_BATCH		32
+#define RZS_WB_SCAN_CHUNK	256
 
 /*-- End of configurable params */
 
@@ -69,11 +90,36 @@ enum rzs_pageflags {
 	/* Page consists entirely of zeros */
 	RZS_ZERO,
 
+	/* Page was stored since the writeback clock hand last passed */
+	RZS_REFERENCED,
+
+	/* Page is being written back to backing swap */
+	RZS_WRITEBACK,
+
+	/* Page was freed while under writeback */
+	RZS_DISCARD,
+
 	__NR_RZS_PAGEFLAGS,
 };
 
+/*
+ * Compressor used for a page (enum rzs_compressor) is kept in
+ * the table flags, above the page flags.
+ */
+#define RZS_COMPRESSOR_SHIFT	__NR_RZS_PAGEFLAGS
+#define RZS_COMPRESSOR_MASK	(0x3 << RZS_COMPRESSOR_SHIFT)
+
 /*-- Data structures */
 
+struct ramzswap_compressor {
+	const char *name;
+	size_t workmem_size;
+	int (*compress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *workmem);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len);
+};
+
 /*
  * Allocated for each swap slot, indexed by page no.
  * These table entries must fit exactly in a page.
@@ -81,10 +127,25 @@ enum rzs_pageflags {
 struct table {
 	struct page *page;
 	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	u8 count;	/* readers of the slot, under table_lock */
 	u8 flags;
 } __attribute__((aligned(4)));
 
+/*
+ * Dedup index entry, one for each stored compressed object.
+ * Hashed on the compressed content; slots storing the same
+ * content share the object and hold a reference on it.
+ */
+struct rzs_dedup_entry {
+	struct hlist_node node;
+	struct page *page;
+	u32 hash;
+	u16 offset;
+	u16 len;	/* compressed length */
+	u8 compressor;
+	u32 refcount;
+};
+
 /*
  * Swap extent information in case backing swap is a regular
  * file. These extent entries must fit exactly in a page.
@@ -94,6 +155,15 @@ struct ramzswap_backing_extent {
 	pgoff_t num_pages;
 } __attribute__((aligned(4)));
 
+/* One round of writeback I/O */
+struct ramzswap_wb_batch {
+	atomic_t pending;	/* bios in flight, plus one */
+	struct completion done;
+	int nr;
+	u32 index[RZS_WB_BATCH];
+	struct page *page[RZS_WB_BATCH];	/* page under I/O */
+};
+
 struct ramzswap_stats {
 	/* basic stats */
 	size_t compr_size;	/* compressed size of pages stored -
@@ -112,19 +182,70 @@ struct ramzswap_stats {
 	u32 pages_expand;	/* % of incompressible pages */
 	u64 bdev_num_reads;	/* no. of reads on backing dev */
 	u64 bdev_num_writes;	/* no. of writes on backing dev */
+	u64 lock_contended;	/* no. of times rzs->lock was contended */
+	u64 lock_wait_ns;	/* time spent waiting for rzs->lock */
+	u64 cpu_contended;	/* no. of times a per-cpu buffer was busy */
+	u64 cpu_wait_ns;	/* time spent waiting for per-cpu buffers */
+	/* per compressor backend */
+	u64 compress_pages[RZS_NR_COMPRESSORS];
+	u64 compress_ns[RZS_NR_COMPRESSORS];
+	u64 decompress_pages[RZS_NR_COMPRESSORS];
+	u64 decompress_ns[RZS_NR_COMPRESSORS];
+	u64 wb_pages;		/* no. of pages written back */
+	u64 wb_failed;		/* no. of failed writeback attempts */
+	u64 dedup_hits;		/* no. of writes that shared an object */
+	u32 pages_dedup;	/* no. of slots sharing another's object */
+	size_t dedup_saved;	/* compressed bytes not stored due to dedup */
+	u64 compact_pages_freed; /* pool pages released by compaction */
 #endif
 };
 
-struct ramzswap {
-	struct xv_pool *mem_pool;
+/*
+ * Per-cpu compression state. Writers pick the buffer of the cpu
+ * they are running on, so compression proceeds in parallel on
+ * different cpus. The mutex is needed since the writer may sleep
+ * (and migrate) while it still owns the compressed data.
+ */
+struct ramzswap_percpu {
+	struct mutex lock;
 	void *compress_workmem;
 	void *compress_buffer;
+};
+
+struct ramzswap {
+	struct xv_pool *mem_pool;
+#if defined(CONFIG_RAMZSWAP_ZSPOOL)
+	struct zs_pool *zs_pool;
+	/*
+	 * Held for write while compaction moves objects, for read by
+	 * anyone accessing an object found through the table.
+	 */
+	rwlock_t compact_lock;
+#endif
+	struct ramzswap_percpu *percpu;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;
+	struct mutex lock;	/* protects mem_pool and table updates */
+	/*
+	 * Protects table flags. Spinlock since slots are also freed
+	 * from swap slot free notify; held across the free so that
+	 * the writeback thread cannot claim a slot being freed.
+	 */
+	spinlock_t table_lock;
+#if defined(CONFIG_RAMZSWAP_DEDUP)
+	/*
+	 * Index of stored objects by content. Spinlock since it is
+	 * also updated from swap slot free notify.
+	 */
+	spinlock_t dedup_lock;
+	struct hlist_head *dedup_table;
+	size_t dedup_buckets;
+#endif
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
+	unsigned compressor;	/* enum rzs_compressor used for writes */
+	unsigned allocator;	/* enum rzs_allocator, fixed once init */
 	/*
 	 * This is limit on compressed data size (stats.compr_size)
 	 * Its applicable only when backing swap device is present.
@@ -146,6 +267,12 @@ struct ramzswap {
 	char backing_swap_name[MAX_SWAP_NAME_LEN];
 	struct block_device *backing_swap;
 	struct file *swap_file;
+
+	/* background writeback to backing swap */
+	struct task_struct *wb_thread;
+	wait_queue_head_t wb_wait;	/* writeback thread sleeps here */
+	wait_queue_head_t wb_done_wait;	/* writers wait for writeback */
+	u32 wb_hand;			/* clock hand: next slot to scan */
 };
 
 /*-- */
@@ -176,6 +303,13 @@ static void stat64_dec(struct ramzswap *rzs, u64 *v)
 	spin_unlock(&rzs->stat64_lock);
 }
 
+static void stat64_add(struct ramzswap *rzs, u64 *v, u64 delta)
+{
+	spin_lock(&rzs->stat64_lock);
+	*v = *v + delta;
+	spin_unlock(&rzs->stat64_lock);
+}
+
 static u64 stat64_read(struct ramzswap *rzs, u64 *v)
 {
 	u64 val;
@@ -191,6 +325,7 @@ static u64 stat64_read(struct ramzswap *rzs, u64 *v)
 #define stat_dec(v)
 #define stat64_inc(r, v)
 #define stat64_dec(r, v)
+#define stat64_add(r, v, d)
 #define stat64_read(r, v)
 #endif /* CONFIG_RAMZSWAP_STATS */
 
@@ -16,6 +16,22 @@
 #define _RAMZSWAP_IOCTL_H_
 
 #define MAX_SWAP_NAME_LEN 128
+#define RZS_COMPRESSOR_NAME_LEN 16
+
+/* Compressor backends (RZSIO_SET_COMPRESSOR) */
+enum rzs_compressor {
+	RZS_COMPRESSOR_LZO,
+	RZS_COMPRESSOR_SNAPPY,
+	RZS_COMPRESSOR_NONE,	/* store pages uncompressed */
+	RZS_NR_COMPRESSORS,
+};
+
+/* Memory allocators (RZSIO_SET_ALLOCATOR) */
+enum rzs_allocator {
+	RZS_ALLOCATOR_XVMALLOC,
+	RZS_ALLOCATOR_ZSPOOL,	/* size-class slabs, can be compacted */
+	RZS_NR_ALLOCATORS,
+};
 
 struct ramzswap_ioctl_stats {
 	char backing_swap_name[MAX_SWAP_NAME_LEN];
@@ -40,11 +56,42 @@ struct ramzswap_ioctl_stats {
 	u64 bdev_num_writes;	/* no. of writes on backing dev */
 } __attribute__ ((packed, aligned(4)));
 
+/*
+ * RZSIO_GET_STATS_EXT: the RZSIO_GET_STATS fields, followed by
+ * counters added since. RZSIO_GET_STATS is kept as it was for
+ * existing binaries; new fields only ever go at the end of this.
+ */
+struct ramzswap_ioctl_stats_ext {
+	struct ramzswap_ioctl_stats base;
+	u64 lock_contended;	/* no. of contended table/pool lock takes */
+	u64 lock_wait_ns;	/* total time spent waiting for it */
+	u64 cpu_contended;	/* no. of contended per-cpu buffer takes */
+	u64 cpu_wait_ns;	/* total time spent waiting for them */
+	u32 compressor;		/* backend used for new writes */
+	/* per backend, indexed by enum rzs_compressor */
+	u64 compress_pages[RZS_NR_COMPRESSORS];
+	u64 compress_ns_per_page[RZS_NR_COMPRESSORS];
+	u64 decompress_pages[RZS_NR_COMPRESSORS];
+	u64 decompress_ns_per_page[RZS_NR_COMPRESSORS];
+	u64 wb_pages;		/* no. of pages written back in background */
+	u64 wb_failed;		/* no. of failed background writebacks */
+	u64 dedup_hits;		/* no. of writes that shared a stored page */
+	u64 dedup_bytes_saved;	/* compressed bytes currently shared */
+	u32 pages_dedup;	/* no. of slots sharing another's page */
+	u32 allocator;		/* enum rzs_allocator */
+	u32 pool_frag_pct;	/* % of pool memory not holding data */
+	u64 compact_pages_freed; /* pool pages released by compaction */
+} __attribute__ ((packed, aligned(4)));
+
 #define RZSIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
 #define RZSIO_SET_MEMLIMIT_KB	_IOW('z', 1, size_t)
 #define RZSIO_SET_BACKING_SWAP	_IOW('z', 2, unsigned char[MAX_SWAP_NAME_LEN])
 #define RZSIO_GET_STATS		_IOR('z', 3, struct ramzswap_ioctl_stats)
 #define RZSIO_INIT		_IO('z', 4)
 #define RZSIO_RESET		_IO('z', 5)
+#define RZSIO_SET_COMPRESSOR	_IOW('z', 6, u32)
+#define RZSIO_SET_ALLOCATOR	_IOW('z', 7, u32)
+#define RZSIO_COMPACT		_IO('z', 8)
+#define RZSIO_GET_STATS_EXT	_IOR('z', 9, struct ramzswap_ioctl_stats_ext)
 
 #endif
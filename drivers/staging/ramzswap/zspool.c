@@ -0,0 +1,531 @@
+/*
+ * zspool memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Size-class allocator for compressed pages. Each class hands out
+ * objects of one size from zspages: groups of a few pages over which
+ * objects are packed back to back, so that sizes which do not divide
+ * PAGE_SIZE waste little space. Every class has its own lock, and
+ * sparsely used zspages can be emptied by zs_compact_class().
+ */
+
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+
+#include "zspool.h"
+#include "zspool_int.h"
+
+static int get_class_index(u32 size)
+{
+	return DIV_ROUND_UP(size, ZS_SIZE_DELTA) - 1;
+}
+
+/*
+ * Pick the number of pages per zspage that wastes the least
+ * space for objects of the given size.
+ */
+static int get_pages_per_zspage(u32 size)
+{
+	int i, best = 1;
+	u32 usedpc, best_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		u32 zspage_size = i * PAGE_SIZE;
+
+		usedpc = (zspage_size / size) * size * 100 / zspage_size;
+		if (usedpc > best_usedpc) {
+			best_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static int get_page_index(struct zs_zspage *zspage, struct page *page)
+{
+	int i;
+
+	for (i = 0; i < ZS_MAX_PAGES_PER_ZSPAGE; i++)
+		if (zspage->pages[i] == page)
+			return i;
+
+	BUG();
+	return 0;
+}
+
+/* Linear position of the object referred to by <page, offset> */
+static u32 get_obj_pos(struct zs_zspage *zspage, struct page *page,
+			u32 offset)
+{
+	return get_page_index(zspage, page) * PAGE_SIZE + offset - ZS_HDR_SIZE;
+}
+
+static void get_obj_location(struct zs_zspage *zspage, u32 pos,
+			struct page **page, u32 *offset)
+{
+	*page = zspage->pages[pos >> PAGE_SHIFT];
+	*offset = (pos & ~PAGE_MASK) + ZS_HDR_SIZE;
+}
+
+static struct zs_zspage *alloc_zspage(struct zs_size_class *class,
+			int class_idx, gfp_t flags)
+{
+	int i;
+	struct zs_zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage), flags & ~__GFP_HIGHMEM);
+	if (unlikely(!zspage))
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		struct page *page = alloc_page(flags);
+
+		if (unlikely(!page))
+			goto fail;
+
+		set_page_private(page, (unsigned long)zspage);
+		zspage->pages[i] = page;
+	}
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class_idx = class_idx;
+	return zspage;
+
+fail:
+	while (i--) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kfree(zspage);
+	return NULL;
+}
+
+static void free_zspage(struct zs_pool *pool, struct zs_size_class *class,
+			struct zs_zspage *zspage)
+{
+	int i;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kfree(zspage);
+
+	atomic_long_sub(class->pages_per_zspage, &pool->total_pages);
+}
+
+/*
+ * Take a free object from a zspage. Class lock must be held.
+ * Returns linear position of the object within the zspage.
+ */
+static u32 obj_alloc(struct zs_size_class *class, struct zs_zspage *zspage)
+{
+	u32 obj;
+
+	obj = find_first_zero_bit(zspage->used, class->objs_per_zspage);
+	__set_bit(obj, zspage->used);
+
+	if (++zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->full);
+
+	return obj * class->size;
+}
+
+/*
+ * Return object at 'pos' to its zspage. Class lock must be held.
+ * Returns 1 if the zspage is now empty (and off the class lists).
+ */
+static int obj_free(struct zs_size_class *class, struct zs_zspage *zspage,
+			u32 pos)
+{
+	u32 obj = pos / class->size;
+
+	/* Catch double free bugs */
+	BUG_ON(!test_bit(obj, zspage->used));
+	__clear_bit(obj, zspage->used);
+
+	if (zspage->inuse-- == class->objs_per_zspage)
+		list_move(&zspage->list, &class->partial);
+
+	if (!zspage->inuse) {
+		list_del(&zspage->list);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Copy 'len' bytes between linear positions of two zspages */
+static void copy_obj(struct zs_zspage *dst, u32 dpos,
+			struct zs_zspage *src, u32 spos, u32 len)
+{
+	while (len) {
+		u32 soff = spos & ~PAGE_MASK, doff = dpos & ~PAGE_MASK;
+		u32 chunk = min(len, (u32)min(PAGE_SIZE - soff,
+						PAGE_SIZE - doff));
+		unsigned char *s, *d;
+
+		s = kmap_atomic(src->pages[spos >> PAGE_SHIFT], KM_USER0);
+		d = kmap_atomic(dst->pages[dpos >> PAGE_SHIFT], KM_USER1);
+		memcpy(d + doff, s + soff, chunk);
+		kunmap_atomic(d, KM_USER1);
+		kunmap_atomic(s, KM_USER0);
+
+		spos += chunk;
+		dpos += chunk;
+		len -= chunk;
+	}
+}
+
+static u32 get_obj_len(struct zs_zspage *zspage, u32 pos)
+{
+	u32 size;
+	struct zs_obj_header *hdr;
+
+	hdr = kmap_atomic(zspage->pages[pos >> PAGE_SHIFT], KM_USER0) +
+			(pos & ~PAGE_MASK);
+	size = hdr->size;
+	kunmap_atomic(hdr, KM_USER0);
+
+	return ZS_HDR_SIZE + size;
+}
+
+/*
+ * Create a memory pool. Sets up size classes and the
+ * per-cpu bounce buffers.
+ */
+struct zs_pool *zs_create_pool(void)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct zs_size_class *class = &pool->classes[i];
+
+		spin_lock_init(&class->lock);
+		class->size = (i + 1) * ZS_SIZE_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE
+						/ class->size;
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+	}
+
+	pool->bounce = alloc_percpu(struct zs_bounce);
+	if (!pool->bounce)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_bounce *b = per_cpu_ptr(pool->bounce, cpu);
+
+		b->buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!b->buf)
+			goto fail;
+	}
+
+	atomic_long_set(&pool->total_pages, 0);
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
+
+/*
+ * Pool must be empty: all objects are freed by the user first.
+ */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int cpu;
+
+	if (pool->bounce) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(pool->bounce, cpu)->buf);
+		free_percpu(pool->bounce);
+	}
+
+	kfree(pool);
+}
+
+/**
+ * zs_malloc - Allocate object of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ * @page: page that holds (the start of) the object
+ * @offset: location of object within page
+ *
+ * On success, <page, offset> identifies the object and 0 is
+ * returned. The object may continue into the next page of its
+ * zspage, so it must only be accessed through zs_map_object().
+ * On failure, <page, offset> is set to 0 and -ENOMEM is returned.
+ *
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ */
+int zs_malloc(struct zs_pool *pool, u32 size, struct page **page,
+		u32 *offset, gfp_t flags)
+{
+	u32 pos;
+	int class_idx;
+	struct zs_size_class *class;
+	struct zs_zspage *zspage;
+	struct zs_obj_header *hdr;
+
+	*page = NULL;
+	*offset = 0;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return -ENOMEM;
+
+	class_idx = get_class_index(size + ZS_HDR_SIZE);
+	class = &pool->classes[class_idx];
+
+	spin_lock(&class->lock);
+
+	if (list_empty(&class->partial)) {
+		spin_unlock(&class->lock);
+
+		zspage = alloc_zspage(class, class_idx, flags);
+		if (unlikely(!zspage))
+			return -ENOMEM;
+		atomic_long_add(class->pages_per_zspage, &pool->total_pages);
+
+		spin_lock(&class->lock);
+		list_add(&zspage->list, &class->partial);
+	}
+
+	zspage = list_first_entry(&class->partial, struct zs_zspage, list);
+	pos = obj_alloc(class, zspage);
+	get_obj_location(zspage, pos, page, offset);
+
+	hdr = kmap_atomic(*page, KM_USER0) + *offset - ZS_HDR_SIZE;
+	hdr->size = size;
+	kunmap_atomic(hdr, KM_USER0);
+
+	spin_unlock(&class->lock);
+
+	return 0;
+}
+
+/*
+ * Free object identified with <page, offset>
+ */
+void zs_free(struct zs_pool *pool, struct page *page, u32 offset)
+{
+	struct zs_zspage *zspage = (struct zs_zspage *)page_private(page);
+	struct zs_size_class *class = &pool->classes[zspage->class_idx];
+	int empty;
+
+	spin_lock(&class->lock);
+	empty = obj_free(class, zspage, get_obj_pos(zspage, page, offset));
+	spin_unlock(&class->lock);
+
+	if (empty)
+		free_zspage(pool, class, zspage);
+}
+
+/*
+ * Get a dereferencable pointer to the object. Objects spanning
+ * two pages are copied to a per-cpu bounce buffer; preemption
+ * stays disabled until zs_unmap_object() in both cases.
+ */
+void *zs_map_object(struct zs_pool *pool, struct page *page, u32 offset,
+			enum km_type type)
+{
+	u32 start, len, first;
+	unsigned char *base, *buf;
+	struct zs_zspage *zspage;
+	struct zs_obj_header *hdr;
+
+	start = offset - ZS_HDR_SIZE;
+	base = kmap_atomic(page, type);
+	hdr = (struct zs_obj_header *)(base + start);
+	len = ZS_HDR_SIZE + hdr->size;
+
+	if (likely(start + len <= PAGE_SIZE))
+		return base + offset;
+
+	zspage = (struct zs_zspage *)page_private(page);
+	buf = per_cpu_ptr(pool->bounce, get_cpu())->buf;
+
+	first = PAGE_SIZE - start;
+	memcpy(buf, base + start, first);
+	kunmap_atomic(base, type);
+
+	page = zspage->pages[get_page_index(zspage, page) + 1];
+	base = kmap_atomic(page, type);
+	memcpy(buf + first, base, len - first);
+	kunmap_atomic(base, type);
+
+	return buf + ZS_HDR_SIZE;
+}
+
+/*
+ * Release pointer returned by zs_map_object(). If the object was
+ * bounced and 'dirty' is set, it is copied back to its pages.
+ */
+void zs_unmap_object(struct zs_pool *pool, struct page *page, u32 offset,
+			void *obj, enum km_type type, int dirty)
+{
+	u32 start, len, first;
+	unsigned char *base, *buf;
+	struct zs_zspage *zspage;
+
+	buf = per_cpu_ptr(pool->bounce, smp_processor_id())->buf;
+	if (likely(obj != buf + ZS_HDR_SIZE)) {
+		kunmap_atomic(obj, type);
+		return;
+	}
+
+	if (dirty) {
+		zspage = (struct zs_zspage *)page_private(page);
+		start = offset - ZS_HDR_SIZE;
+		len = ZS_HDR_SIZE + ((struct zs_obj_header *)buf)->size;
+		first = PAGE_SIZE - start;
+
+		base = kmap_atomic(page, type);
+		memcpy(base + start, buf, first);
+		kunmap_atomic(base, type);
+
+		page = zspage->pages[get_page_index(zspage, page) + 1];
+		base = kmap_atomic(page, type);
+		memcpy(base, buf + first, len - first);
+		kunmap_atomic(base, type);
+	}
+
+	put_cpu();
+}
+
+u32 zs_get_object_size(void *obj)
+{
+	return ((struct zs_obj_header *)obj - 1)->size;
+}
+
+/*
+ * Returns total memory used by allocator (userdata + metadata)
+ */
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->total_pages) << PAGE_SHIFT;
+}
+
+int zs_get_nr_classes(void)
+{
+	return ZS_NR_CLASSES;
+}
+
+/*
+ * Find the least used partial zspage, if the other partial
+ * zspages have room for all of its objects.
+ */
+static struct zs_zspage *find_compact_source(struct zs_size_class *class)
+{
+	u32 nr_free = 0;
+	struct zs_zspage *zspage, *src = NULL;
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		nr_free += class->objs_per_zspage - zspage->inuse;
+		if (!src || zspage->inuse < src->inuse)
+			src = zspage;
+	}
+
+	if (!src || nr_free - (class->objs_per_zspage - src->inuse)
+						< src->inuse)
+		return NULL;
+
+	return src;
+}
+
+/*
+ * Move the objects of 'src' to other partial zspages of the class.
+ * Returns the number of objects 'migrate' refused to move, which
+ * stay where they are. Class lock must be held.
+ */
+static u32 evacuate_zspage(struct zs_size_class *class,
+			struct zs_zspage *src, zs_migrate_fn migrate,
+			void *priv)
+{
+	u32 refused = 0;
+	u32 obj, spos, dpos;
+	u32 old_offset, new_offset;
+	struct page *old_page, *new_page;
+	struct zs_zspage *dst;
+
+	for_each_bit(obj, src->used, class->objs_per_zspage) {
+		list_for_each_entry(dst, &class->partial, list)
+			if (dst != src)
+				break;
+		BUG_ON(&dst->list == &class->partial);
+
+		spos = obj * class->size;
+		dpos = obj_alloc(class, dst);
+		copy_obj(dst, dpos, src, spos, get_obj_len(src, spos));
+
+		get_obj_location(src, spos, &old_page, &old_offset);
+		get_obj_location(dst, dpos, &new_page, &new_offset);
+
+		if (migrate(priv, old_page, old_offset, new_page, new_offset)) {
+			obj_free(class, dst, dpos);
+			refused++;
+			continue;
+		}
+
+		obj_free(class, src, spos);
+	}
+
+	return refused;
+}
+
+/**
+ * zs_compact_class - Empty sparsely used zspages of a size class.
+ * @pool: pool to compact
+ * @class_idx: size class to compact, 0 .. zs_get_nr_classes() - 1
+ * @migrate: called for every object moved, to update references
+ * @priv: passed to @migrate
+ *
+ * Objects are moved out of the least used zspage while the other
+ * zspages of the class can hold them. Runs under the class lock,
+ * so @migrate must not sleep. A zspage holding objects @migrate
+ * refuses to move is kept, and compaction goes on with the next
+ * one. Returns number of pages freed.
+ */
+unsigned long zs_compact_class(struct zs_pool *pool, int class_idx,
+			zs_migrate_fn migrate, void *priv)
+{
+	unsigned long freed = 0;
+	struct zs_zspage *src;
+	struct zs_size_class *class = &pool->classes[class_idx];
+	LIST_HEAD(kept);
+
+	spin_lock(&class->lock);
+	while ((src = find_compact_source(class))) {
+		if (evacuate_zspage(class, src, migrate, priv)) {
+			/* Not picked again, nor used as a destination */
+			list_move(&src->list, &kept);
+			continue;
+		}
+
+		/* The last obj_free() took src off the partial list */
+		free_zspage(pool, class, src);
+		freed += class->pages_per_zspage;
+	}
+	list_splice(&kept, &class->partial);
+	spin_unlock(&class->lock);
+
+	return freed;
+}
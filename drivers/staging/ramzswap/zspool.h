@@ -0,0 +1,45 @@
+/*
+ * zspool memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_POOL_H_
+#define _ZS_POOL_H_
+
+#include <linux/types.h>
+#include <linux/highmem.h>
+
+struct zs_pool;
+
+/*
+ * Called by zs_compact_class() after an object was copied to its
+ * new location. Return non-zero to keep the object where it was.
+ */
+typedef int (*zs_migrate_fn)(void *priv, struct page *old_page,
+			u32 old_offset, struct page *new_page, u32 new_offset);
+
+struct zs_pool *zs_create_pool(void);
+void zs_destroy_pool(struct zs_pool *pool);
+
+int zs_malloc(struct zs_pool *pool, u32 size, struct page **page,
+			u32 *offset, gfp_t flags);
+void zs_free(struct zs_pool *pool, struct page *page, u32 offset);
+
+void *zs_map_object(struct zs_pool *pool, struct page *page, u32 offset,
+			enum km_type type);
+void zs_unmap_object(struct zs_pool *pool, struct page *page, u32 offset,
+			void *obj, enum km_type type, int dirty);
+
+u32 zs_get_object_size(void *obj);
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+
+int zs_get_nr_classes(void);
+unsigned long zs_compact_class(struct zs_pool *pool, int class_idx,
+			zs_migrate_fn migrate, void *priv);
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * zspool memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_POOL_INT_H_
+#define _ZS_POOL_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+
+/* User configurable params */
+
+/*
+ * Size classes are separated by ZS_SIZE_DELTA bytes. Must be a power
+ * of two and a multiple of ZS_HDR_SIZE, so that an object header
+ * never straddles a page boundary.
+ */
+#define ZS_SIZE_DELTA_SHIFT	5
+#define ZS_SIZE_DELTA		(1 << ZS_SIZE_DELTA_SHIFT)
+
+#define ZS_MIN_ALLOC_SIZE	ZS_SIZE_DELTA
+#define ZS_MAX_ALLOC_SIZE	(PAGE_SIZE - ZS_HDR_SIZE)
+
+#define ZS_NR_CLASSES		(PAGE_SIZE / ZS_SIZE_DELTA)
+
+/* A zspage is a group of up to this many (non-contiguous) pages */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+#define ZS_MAX_OBJS_PER_ZSPAGE	\
+	(ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / ZS_MIN_ALLOC_SIZE)
+
+/* End of user params */
+
+/* Stored at the start of each object, holds the requested size */
+struct zs_obj_header {
+	u32 size;
+};
+
+#define ZS_HDR_SIZE		sizeof(struct zs_obj_header)
+
+/*
+ * Objects of one size class are packed back to back over all pages
+ * of a zspage and may span a page boundary. Each page of a zspage
+ * points back to it through page->private.
+ */
+struct zs_zspage {
+	struct list_head list;		/* in class partial or full list */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	u16 inuse;			/* no. of allocated objects */
+	u16 class_idx;
+	ulong used[BITS_TO_LONGS(ZS_MAX_OBJS_PER_ZSPAGE)];
+};
+
+struct zs_size_class {
+	spinlock_t lock;
+	u32 size;			/* object size, header included */
+	u16 pages_per_zspage;
+	u16 objs_per_zspage;
+
+	struct list_head partial;	/* zspages with free objects */
+	struct list_head full;
+};
+
+/* Bounce buffer to access objects that span two pages */
+struct zs_bounce {
+	char *buf;
+};
+
+struct zs_pool {
+	struct zs_size_class classes[ZS_NR_CLASSES];
+	struct zs_bounce *bounce;	/* per-cpu */
+
+	/* stats */
+	atomic_long_t total_pages;
+};
+
+#endif
@@ -1061,6 +1061,7 @@ static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 		return -EACCES;
 	}
 	task->oomkilladj = oom_adjust;
+	oom_adj_notify(task, OOM_ADJ_WRITE);
 	put_task_struct(task);
 	if (end - buffer == 0)
 		return -EIO;
@@ -29,7 +29,9 @@
 #include <linux/fs.h>
 #include <linux/vfs.h>
 #include <linux/slab.h>
-#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
 #include <linux/string.h>
 #include <linux/buffer_head.h>
 #include <linux/zlib.h>
@@ -71,6 +73,49 @@ static struct buffer_head *get_block_length(struct super_block *sb,
 }
 
 
+/*
+ * Where a block read by squashfs_read_data() goes: a list of kmalloced
+ * PAGE_CACHE_SIZE buffers, or page cache pages.  Page cache pages are only
+ * mapped while they are being written.  A NULL page (one not wanted, or
+ * not to be had) is written to the stream's scratch page and dropped.
+ */
+struct squashfs_output {
+	void		**buffer;
+	struct page	**page;
+	int		pages;
+	int		next;
+	void		*mapped;
+	void		*scratch;
+};
+
+
+static void squashfs_output_unmap(struct squashfs_output *out)
+{
+	if (out->mapped) {
+		kunmap_atomic(out->mapped, KM_USER0);
+		out->mapped = NULL;
+	}
+}
+
+
+static void *squashfs_output_next(struct squashfs_output *out)
+{
+	struct page *page;
+
+	squashfs_output_unmap(out);
+	if (out->next == out->pages)
+		return NULL;
+	if (out->buffer)
+		return out->buffer[out->next++];
+
+	page = out->page[out->next++];
+	if (page == NULL)
+		return out->scratch;
+	out->mapped = kmap_atomic(page, KM_USER0);
+	return out->mapped;
+}
+
+
 /*
  * Read and decompress a metadata block or datablock.  Length is non-zero
  * if a datablock is being read (the size is stored elsewhere in the
@@ -78,15 +123,20 @@ static struct buffer_head *get_block_length(struct super_block *sb,
  * the metadata block.  A bit in the length field indicates if the block
  * is stored uncompressed in the filesystem (usually because compression
  * generated a larger block - this does occasionally happen with zlib).
+ *
+ * The whole block is read in before the CPU's stream is taken, as the
+ * stream is used with preemption disabled.
  */
-int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
-			int length, u64 *next_index, int srclength, int pages)
+static int squashfs_read_output(struct super_block *sb,
+			struct squashfs_output *out, u64 index, int length,
+			u64 *next_index, int srclength)
 {
 	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	struct squashfs_stream *stream;
 	struct buffer_head **bh;
 	int offset = index & ((1 << msblk->devblksize_log2) - 1);
 	u64 cur_index = index >> msblk->devblksize_log2;
-	int bytes, compressed, b = 0, k = 0, page = 0, avail;
+	int bytes, compressed, b = 0, k = 0, i, avail;
 
 
 	bh = kcalloc((msblk->block_size >> msblk->devblksize_log2) + 1,
@@ -152,26 +202,31 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 		ll_rw_block(READ, b - 1, bh + 1);
 	}
 
+	for (i = 0; i < b; i++) {
+		wait_on_buffer(bh[i]);
+		if (!buffer_uptodate(bh[i]))
+			goto block_release;
+	}
+
+	stream = per_cpu_ptr(msblk->stream, get_cpu());
+	out->scratch = stream->scratch;
+
 	if (compressed) {
+		z_stream *z = &stream->stream;
 		int zlib_err = 0, zlib_init = 0;
 
 		/*
 		 * Uncompress block.
 		 */
 
-		mutex_lock(&msblk->read_data_mutex);
-
-		msblk->stream.avail_out = 0;
-		msblk->stream.avail_in = 0;
+		z->avail_out = 0;
+		z->avail_in = 0;
 
 		bytes = length;
 		do {
-			if (msblk->stream.avail_in == 0 && k < b) {
+			if (z->avail_in == 0 && k < b) {
 				avail = min(bytes, msblk->devblksize - offset);
 				bytes -= avail;
-				wait_on_buffer(bh[k]);
-				if (!buffer_uptodate(bh[k]))
-					goto release_mutex;
 
 				if (avail == 0) {
 					offset = 0;
@@ -179,69 +234,68 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 					continue;
 				}
 
-				msblk->stream.next_in = bh[k]->b_data + offset;
-				msblk->stream.avail_in = avail;
+				z->next_in = bh[k]->b_data + offset;
+				z->avail_in = avail;
 				offset = 0;
 			}
 
-			if (msblk->stream.avail_out == 0 && page < pages) {
-				msblk->stream.next_out = buffer[page++];
-				msblk->stream.avail_out = PAGE_CACHE_SIZE;
+			if (z->avail_out == 0) {
+				z->next_out = squashfs_output_next(out);
+				if (z->next_out)
+					z->avail_out = PAGE_CACHE_SIZE;
 			}
 
 			if (!zlib_init) {
-				zlib_err = zlib_inflateInit(&msblk->stream);
+				zlib_err = zlib_inflateInit(z);
 				if (zlib_err != Z_OK) {
+					squashfs_output_unmap(out);
+					put_cpu();
 					ERROR("zlib_inflateInit returned"
 						" unexpected result 0x%x,"
 						" srclength %d\n", zlib_err,
 						srclength);
-					goto release_mutex;
+					goto block_release;
 				}
 				zlib_init = 1;
 			}
 
-			zlib_err = zlib_inflate(&msblk->stream, Z_SYNC_FLUSH);
+			zlib_err = zlib_inflate(z, Z_SYNC_FLUSH);
 
-			if (msblk->stream.avail_in == 0 && k < b)
+			if (z->avail_in == 0 && k < b)
 				put_bh(bh[k++]);
 		} while (zlib_err == Z_OK);
 
-		if (zlib_err != Z_STREAM_END) {
-			ERROR("zlib_inflate error, data probably corrupt\n");
-			goto release_mutex;
-		}
+		squashfs_output_unmap(out);
 
-		zlib_err = zlib_inflateEnd(&msblk->stream);
-		if (zlib_err != Z_OK) {
-			ERROR("zlib_inflate error, data probably corrupt\n");
-			goto release_mutex;
-		}
-		length = msblk->stream.total_out;
-		mutex_unlock(&msblk->read_data_mutex);
+		if (zlib_err != Z_STREAM_END)
+			goto release_stream;
+
+		zlib_err = zlib_inflateEnd(z);
+		if (zlib_err != Z_OK)
+			goto release_stream;
+		length = z->total_out;
 	} else {
 		/*
 		 * Block is uncompressed.
 		 */
-		int i, in, pg_offset = 0;
-
-		for (i = 0; i < b; i++) {
-			wait_on_buffer(bh[i]);
-			if (!buffer_uptodate(bh[i]))
-				goto block_release;
-		}
+		int in, pg_offset = PAGE_CACHE_SIZE;
+		void *pageaddr = NULL;
 
 		for (bytes = length; k < b; k++) {
 			in = min(bytes, msblk->devblksize - offset);
 			bytes -= in;
 			while (in) {
 				if (pg_offset == PAGE_CACHE_SIZE) {
-					page++;
+					pageaddr = squashfs_output_next(out);
+					if (pageaddr == NULL) {
+						put_cpu();
+						goto block_release;
+					}
 					pg_offset = 0;
 				}
 				avail = min_t(int, in, PAGE_CACHE_SIZE -
 						pg_offset);
-				memcpy(buffer[page] + pg_offset,
+				memcpy(pageaddr + pg_offset,
 						bh[k]->b_data + offset, avail);
 				in -= avail;
 				pg_offset += avail;
@@ -250,13 +304,16 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 			offset = 0;
 			put_bh(bh[k]);
 		}
+		squashfs_output_unmap(out);
 	}
 
+	put_cpu();
 	kfree(bh);
 	return length;
 
-release_mutex:
-	mutex_unlock(&msblk->read_data_mutex);
+release_stream:
+	put_cpu();
+	ERROR("zlib_inflate error, data probably corrupt\n");
 
 block_release:
 	for (; k < b; k++)
@@ -268,3 +325,83 @@ read_failure:
 	kfree(bh);
 	return -EIO;
 }
+
+
+int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
+			int length, u64 *next_index, int srclength, int pages)
+{
+	struct squashfs_output out = {
+		.buffer = buffer,
+		.pages = pages,
+	};
+
+	return squashfs_read_output(sb, &out, index, length, next_index,
+				srclength);
+}
+
+
+/*
+ * Read and decompress a datablock straight into the page cache pages it
+ * covers, rather than into a cache entry to be copied from.  Page may
+ * have NULL entries for pages that are not to be filled.
+ */
+int squashfs_read_data_pages(struct super_block *sb, struct page **page,
+			u64 index, int length, int srclength, int pages)
+{
+	struct squashfs_output out = {
+		.page = page,
+		.pages = pages,
+	};
+
+	return squashfs_read_output(sb, &out, index, length, NULL, srclength);
+}
+
+
+/*
+ * Each CPU decompresses with a zlib stream of its own, so that readers on
+ * different CPUs don't queue up behind each other for one inflater.
+ */
+int squashfs_alloc_streams(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream *stream;
+	int cpu;
+
+	msblk->stream = alloc_percpu(struct squashfs_stream);
+	if (msblk->stream == NULL)
+		goto failed;
+
+	for_each_possible_cpu(cpu) {
+		stream = per_cpu_ptr(msblk->stream, cpu);
+		stream->stream.workspace =
+			kmalloc(zlib_inflate_workspacesize(), GFP_KERNEL);
+		stream->scratch = kmalloc(PAGE_CACHE_SIZE, GFP_KERNEL);
+		if (stream->stream.workspace == NULL ||
+				stream->scratch == NULL)
+			goto failed;
+	}
+
+	return 0;
+
+failed:
+	ERROR("Failed to allocate zlib workspace\n");
+	squashfs_free_streams(msblk);
+	return -ENOMEM;
+}
+
+
+void squashfs_free_streams(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream *stream;
+	int cpu;
+
+	if (msblk->stream == NULL)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		stream = per_cpu_ptr(msblk->stream, cpu);
+		kfree(stream->stream.workspace);
+		kfree(stream->scratch);
+	}
+	free_percpu(msblk->stream);
+	msblk->stream = NULL;
+}
@@ -46,6 +46,7 @@
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/pagemap.h>
+#include <linux/highmem.h>
 #include <linux/mutex.h>
 #include <linux/zlib.h>
 
@@ -372,6 +373,68 @@ static int read_blocklist(struct inode *inode, int index, u64 *block)
 }
 
 
+/*
+ * Decompress datablock index of the file, at block on disk with compressed
+ * size bsize, straight into the page cache pages it covers.  Page has a
+ * slot for each page of the datablock; slots the caller hasn't filled with
+ * a locked page are filled here with any page cache page that can be had
+ * without waiting.  All the pages are unlocked and released when done,
+ * except target, which is left to the caller if the read fails.
+ */
+static int squashfs_readpage_block(struct inode *inode, int index, u64 block,
+		int bsize, struct page **page, struct page *target)
+{
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int pages = msblk->block_size >> PAGE_CACHE_SHIFT;
+	pgoff_t start_index = (pgoff_t) index <<
+					(msblk->block_log - PAGE_CACHE_SHIFT);
+	pgoff_t file_pages = (i_size_read(inode) + PAGE_CACHE_SIZE - 1) >>
+					PAGE_CACHE_SHIFT;
+	int i, res, avail;
+	void *pageaddr;
+
+	for (i = 0; i < pages && start_index + i < file_pages; i++) {
+		if (page[i])
+			continue;
+		page[i] = grab_cache_page_nowait(inode->i_mapping,
+					start_index + i);
+		if (page[i] && PageUptodate(page[i])) {
+			unlock_page(page[i]);
+			page_cache_release(page[i]);
+			page[i] = NULL;
+		}
+	}
+
+	res = squashfs_read_data_pages(inode->i_sb, page, block, bsize,
+					msblk->block_size, pages);
+
+	for (i = 0; i < pages; i++) {
+		if (page[i] == NULL)
+			continue;
+
+		if (res >= 0) {
+			avail = clamp_t(int, res - i * PAGE_CACHE_SIZE, 0,
+					PAGE_CACHE_SIZE);
+			if (avail < PAGE_CACHE_SIZE) {
+				pageaddr = kmap_atomic(page[i], KM_USER0);
+				memset(pageaddr + avail, 0,
+					PAGE_CACHE_SIZE - avail);
+				kunmap_atomic(pageaddr, KM_USER0);
+			}
+			flush_dcache_page(page[i]);
+			SetPageUptodate(page[i]);
+		} else if (page[i] == target)
+			continue;
+
+		unlock_page(page[i]);
+		if (page[i] != target)
+			page_cache_release(page[i]);
+	}
+
+	return res < 0 ? res : 0;
+}
+
+
 static int squashfs_readpage(struct file *file, struct page *page)
 {
 	struct inode *inode = page->mapping->host;
@@ -411,17 +474,24 @@ static int squashfs_readpage(struct file *file, struct page *page)
 			sparse = 1;
 		} else {
 			/*
-			 * Read and decompress datablock.
+			 * Read and decompress datablock, into this page and
+			 * as many of the others it covers as are free.
 			 */
-			buffer = squashfs_get_datablock(inode->i_sb,
-								block, bsize);
-			if (buffer->error) {
+			struct page **push = kcalloc(mask + 1, sizeof(*push),
+						GFP_KERNEL);
+
+			if (push == NULL)
+				goto error_out;
+			push[page->index - start_index] = page;
+			if (squashfs_readpage_block(inode, index, block, bsize,
+						push, page)) {
 				ERROR("Unable to read page, block %llx, size %x"
 					"\n", block, bsize);
-				squashfs_cache_put(buffer);
+				kfree(push);
 				goto error_out;
 			}
-			bytes = buffer->length;
+			kfree(push);
+			return 0;
 		}
 	} else {
 		/*
@@ -444,10 +514,10 @@ static int squashfs_readpage(struct file *file, struct page *page)
 	}
 
 	/*
-	 * Loop copying datablock into pages.  As the datablock likely covers
-	 * many PAGE_CACHE_SIZE pages (default block size is 128 KiB) explicitly
-	 * grab the pages from the page cache, except for the page that we've
-	 * been called to fill.
+	 * Loop copying fragment (or zeroing hole) into pages.  As the block
+	 * likely covers many PAGE_CACHE_SIZE pages (default block size is
+	 * 128 KiB) explicitly grab the pages from the page cache, except for
+	 * the page that we've been called to fill.
 	 */
 	for (i = start_index; i <= end_index && bytes > 0; i++,
 			bytes -= PAGE_CACHE_SIZE, offset += PAGE_CACHE_SIZE) {
@@ -497,6 +567,69 @@ out:
 }
 
 
+/*
+ * Readahead.  Pages are taken a datablock at a time: the ones readahead
+ * asked for go into the page cache first, and the datablock is then
+ * decompressed straight into them.  Fragments and holes, which are copied
+ * or zeroed anyway, go through squashfs_readpage().
+ */
+static int squashfs_readpages(struct file *file, struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+	int mask = (1 << shift) - 1;
+	int file_end = i_size_read(inode) >> msblk->block_log;
+	struct page **push, *page;
+	int index, bsize;
+	u64 block;
+
+	push = kcalloc(mask + 1, sizeof(*push), GFP_KERNEL);
+	if (push == NULL)
+		return -ENOMEM;
+
+	while (!list_empty(pages)) {
+		page = list_entry(pages->prev, struct page, lru);
+		index = page->index >> shift;
+
+		bsize = 0;
+		if (index < file_end || squashfs_i(inode)->fragment_block ==
+						SQUASHFS_INVALID_BLK)
+			bsize = read_blocklist(inode, index, &block);
+
+		if (bsize <= 0) {
+			list_del(&page->lru);
+			if (!add_to_page_cache_lru(page, mapping, page->index,
+						GFP_KERNEL))
+				squashfs_readpage(file, page);
+			page_cache_release(page);
+			continue;
+		}
+
+		memset(push, 0, (mask + 1) * sizeof(*push));
+		while (!list_empty(pages)) {
+			page = list_entry(pages->prev, struct page, lru);
+			if ((page->index >> shift) != index)
+				break;
+			list_del(&page->lru);
+			if (add_to_page_cache_lru(page, mapping, page->index,
+						GFP_KERNEL)) {
+				page_cache_release(page);
+				continue;
+			}
+			push[page->index & mask] = page;
+		}
+
+		squashfs_readpage_block(inode, index, block, bsize, push, NULL);
+	}
+
+	kfree(push);
+	return 0;
+}
+
+
 const struct address_space_operations squashfs_aops = {
-	.readpage = squashfs_readpage
+	.readpage = squashfs_readpage,
+	.readpages = squashfs_readpages
 };
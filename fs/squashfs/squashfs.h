@@ -35,6 +35,10 @@ static inline struct squashfs_inode_info *squashfs_i(struct inode *inode)
 /* block.c */
 extern int squashfs_read_data(struct super_block *, void **, u64, int, u64 *,
 				int, int);
+extern int squashfs_read_data_pages(struct super_block *, struct page **, u64,
+				int, int, int);
+extern int squashfs_alloc_streams(struct squashfs_sb_info *);
+extern void squashfs_free_streams(struct squashfs_sb_info *);
 
 /* cache.c */
 extern struct squashfs_cache *squashfs_cache_init(char *, int, int);
@@ -47,8 +51,6 @@ extern int squashfs_read_metadata(struct super_block *, void *, u64 *,
 				int *, int);
 extern struct squashfs_cache_entry *squashfs_get_fragment(struct super_block *,
 				u64, int);
-extern struct squashfs_cache_entry *squashfs_get_datablock(struct super_block *,
-				u64, int);
 extern int squashfs_read_table(struct super_block *, void *, u64, int);
 
 /* export.c */
@@ -22,6 +22,7 @@
 /* Return values from ASHMEM_PIN: Was the mapping purged while unpinned? */
 #define ASHMEM_NOT_PURGED	0
 #define ASHMEM_WAS_PURGED	1
+#define ASHMEM_WAS_RESTORED	2	/* purged, contents put back */
 
 /* Return values from ASHMEM_GET_PIN_STATUS: Is the mapping pinned? */
 #define ASHMEM_IS_UNPINNED	0
@@ -32,6 +33,16 @@ struct ashmem_pin {
 	__u32 len;	/* length forward from offset, in bytes, page-aligned */
 };
 
+/*
+ * Argument of ASHMEM_PIN_VEC and ASHMEM_UNPIN_VEC: 'nr' ranges, each laid out
+ * as for ASHMEM_PIN, applied as one operation on the area.
+ */
+struct ashmem_pin_vec {
+	__u32 nr;	/* number of entries at 'pins' */
+	__u32 __pad;
+	__u64 pins;	/* user address of struct ashmem_pin[nr] */
+};
+
 #define __ASHMEMIOC		0x77
 
 #define ASHMEM_SET_NAME		_IOW(__ASHMEMIOC, 1, char[ASHMEM_NAME_LEN])
@@ -47,6 +58,10 @@ struct ashmem_pin {
 #define ASHMEM_CACHE_FLUSH_RANGE	_IO(__ASHMEMIOC, 11)
 #define ASHMEM_CACHE_CLEAN_RANGE	_IO(__ASHMEMIOC, 12)
 #define ASHMEM_CACHE_INV_RANGE		_IO(__ASHMEMIOC, 13)
+#define ASHMEM_PIN_VEC		_IOW(__ASHMEMIOC, 14, struct ashmem_pin_vec)
+#define ASHMEM_UNPIN_VEC	_IOW(__ASHMEMIOC, 15, struct ashmem_pin_vec)
+#define ASHMEM_SET_RETAIN	_IOW(__ASHMEMIOC, 16, unsigned long)
+#define ASHMEM_GET_RETAIN	_IO(__ASHMEMIOC, 17)
 
 int get_ashmem_file(int fd, struct file **filp, struct file **vm_file,
 			unsigned long *len);
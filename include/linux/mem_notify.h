@@ -12,11 +12,20 @@
 
 #define MEM_NOTIFY_FREQ (HZ/5)
 
+struct notifier_block;
+
 extern atomic_long_t last_mem_notify;
 extern const struct file_operations mem_notify_fops;
 
 extern void __memory_pressure_notify(struct zone *zone, int pressure);
 
+/*
+ * In-kernel subscribers to pressure changes. Called with the zone as
+ * data and the new pressure as value, possibly in atomic context.
+ */
+extern int register_mem_notify_notifier(struct notifier_block *nb);
+extern int unregister_mem_notify_notifier(struct notifier_block *nb);
+
 static inline void memory_pressure_notify(struct zone *zone, int pressure)
 {
 	unsigned long target;
@@ -128,8 +128,11 @@ struct mmc_request {
 
 struct mmc_host;
 struct mmc_card;
+struct completion;
 
 extern void mmc_wait_for_req(struct mmc_host *, struct mmc_request *);
+extern void mmc_start_req_nowait(struct mmc_host *, struct mmc_request *,
+				 struct completion *);
 extern int mmc_wait_for_cmd(struct mmc_host *, struct mmc_command *, int);
 extern int mmc_wait_for_app_cmd(struct mmc_host *, struct mmc_card *,
 	struct mmc_command *, int);
@@ -13,6 +13,7 @@
 
 struct zonelist;
 struct notifier_block;
+struct task_struct;
 
 /*
  * Types of limitations to the nodes from which allocations may occur
@@ -30,6 +31,23 @@ extern void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask, int order);
 extern int register_oom_notifier(struct notifier_block *nb);
 extern int unregister_oom_notifier(struct notifier_block *nb);
 
+/*
+ * Events on the oom_adj notifier chain, with the task as data. Lets
+ * in-kernel killers keep an index of processes by oomkilladj instead
+ * of walking the task list. Callbacks must not sleep.
+ */
+enum oom_adj_event {
+	OOM_ADJ_FORK,		/* new process, inherited oomkilladj */
+	OOM_ADJ_WRITE,		/* oomkilladj set through /proc */
+	OOM_ADJ_EXIT,		/* last thread has released its mm, the
+				 * task is the process leader */
+	OOM_ADJ_EXEC,		/* old leader replaced by a thread in exec */
+};
+
+extern int register_oom_adj_notifier(struct notifier_block *nb);
+extern int unregister_oom_adj_notifier(struct notifier_block *nb);
+extern void oom_adj_notify(struct task_struct *p, enum oom_adj_event event);
+
 extern bool oom_killer_disabled;
 
 static inline void oom_killer_disable(void)
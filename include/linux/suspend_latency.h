@@ -0,0 +1,57 @@
+/* include/linux/suspend_latency.h
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef _LINUX_SUSPEND_LATENCY_H
+#define _LINUX_SUSPEND_LATENCY_H
+
+#include <linux/hrtimer.h>
+
+enum {
+	SUSPEND_LATENCY_EARLY_SUSPEND,	/* one early_suspend handler */
+	SUSPEND_LATENCY_LATE_RESUME,	/* one late_resume handler */
+	SUSPEND_LATENCY_DEV_SUSPEND,	/* suspend callbacks of one device */
+	SUSPEND_LATENCY_DEV_RESUME,	/* resume callbacks of one device */
+	SUSPEND_LATENCY_SUSPEND,	/* pm_suspend(), entry to return */
+	SUSPEND_LATENCY_ABORT,		/* suspend attempt held off by a lock */
+	SUSPEND_LATENCY_EVENT_COUNT
+};
+
+#ifdef CONFIG_SUSPEND_LATENCY
+
+/* suspend_latency_record logs one step that began at 'start' and is done
+ * now. It is named by 'fn', printed as a symbol, if that is not NULL and by
+ * 'name' otherwise. 'ret' is the step's result, if it has one.
+ */
+void suspend_latency_record(int event, const void *fn, const char *name,
+			    ktime_t start, int ret);
+
+/* suspend_latency_start returns the 'start' to pass to the record call */
+static inline ktime_t suspend_latency_start(void)
+{
+	return ktime_get();
+}
+
+#else
+
+static inline void suspend_latency_record(int event, const void *fn,
+					  const char *name, ktime_t start,
+					  int ret) {}
+
+static inline ktime_t suspend_latency_start(void)
+{
+	return ktime_set(0, 0);
+}
+
+#endif
+
+#endif
@@ -18,6 +18,7 @@
 
 #include <linux/list.h>
 #include <linux/ktime.h>
+#include <linux/timer.h>
 
 /* A wake_lock prevents the system from entering suspend or other low power
  * states when active. If the type is set to WAKE_LOCK_SUSPEND, the wake_lock
@@ -34,12 +35,13 @@ enum {
 
 struct wake_lock {
 #ifdef CONFIG_HAS_WAKELOCK
-	struct list_head    link;
+	struct hlist_node   link;
 	int                 flags;
 	const char         *name;
 	unsigned long       expires;
+	struct timer_list   timer;
 #ifdef CONFIG_WAKELOCK_STAT
-	struct {
+	struct wake_lock_stat {
 		int             count;
 		int             expire_count;
 		int             wakeup_count;
@@ -47,6 +49,7 @@ struct wake_lock {
 		ktime_t         prevent_suspend_time;
 		ktime_t         max_time;
 		ktime_t         last_time;
+		int             contended;
 	} stat;
 #endif
 #endif
@@ -0,0 +1,23 @@
+#ifndef _TRACE_LOWMEMORYKILLER_H
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+/* Who asked the lowmemorykiller for a victim */
+enum lowmem_source {
+	LOWMEM_SHRINKER,	/* reclaim, through the shrinker */
+	LOWMEM_PRESSURE,	/* mem_notify pressure, proactive thread */
+};
+
+/*
+ * Every victim search once free memory is below a minfree level.
+ * selected is NULL if nothing at or above min_adj could be killed.
+ */
+DECLARE_TRACE(lowmem_decision,
+	TPPROTO(int source, int other_free, int other_file, int min_adj,
+		struct task_struct *selected, int adj, int tasksize),
+		TPARGS(source, other_free, other_file, min_adj, selected, adj,
+		       tasksize));
+
+#endif
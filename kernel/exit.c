@@ -46,6 +46,7 @@
 #include <linux/blkdev.h>
 #include <linux/task_io_accounting_ops.h>
 #include <linux/tracehook.h>
+#include <linux/oom.h>
 #include <linux/init_task.h>
 #include <trace/sched.h>
 
@@ -1078,6 +1079,9 @@ NORET_TYPE void do_exit(long code)
 	taskstats_exit(tsk, group_dead);
 
 	exit_mm(tsk);
+	/* The leader may have exited before, its mm is still in use */
+	if (group_dead)
+		oom_adj_notify(tsk->group_leader, OOM_ADJ_EXIT);
 
 	if (group_dead)
 		acct_process();
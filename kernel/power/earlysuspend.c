@@ -17,6 +17,7 @@
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/rtc.h>
+#include <linux/suspend_latency.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #include <linux/workqueue.h>
@@ -94,8 +95,13 @@ static void early_suspend(struct work_struct *work)
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("early_suspend: call handlers\n");
 	list_for_each_entry(pos, &early_suspend_handlers, link) {
-		if (pos->suspend != NULL)
+		if (pos->suspend != NULL) {
+			ktime_t start = suspend_latency_start();
+
 			pos->suspend(pos);
+			suspend_latency_record(SUSPEND_LATENCY_EARLY_SUSPEND,
+					       pos->suspend, NULL, start, 0);
+		}
 	}
 	mutex_unlock(&early_suspend_lock);
 
@@ -131,9 +137,15 @@ static void late_resume(struct work_struct *work)
 	}
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: call handlers\n");
-	list_for_each_entry_reverse(pos, &early_suspend_handlers, link)
-		if (pos->resume != NULL)
+	list_for_each_entry_reverse(pos, &early_suspend_handlers, link) {
+		if (pos->resume != NULL) {
+			ktime_t start = suspend_latency_start();
+
 			pos->resume(pos);
+			suspend_latency_record(SUSPEND_LATENCY_LATE_RESUME,
+					       pos->resume, NULL, start, 0);
+		}
+	}
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: done\n");
 abort:
@@ -0,0 +1,190 @@
+/* kernel/power/suspend_latency.c
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/debugfs.h>
+#include <linux/log2.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/suspend_latency.h>
+
+#define SUSPEND_LATENCY_LOG_SIZE	256
+#define SUSPEND_LATENCY_NAME_LEN	32
+
+/* Histogram buckets are powers of two in ms: <1, <2, <4, ... >= 512 */
+#define SUSPEND_LATENCY_BUCKETS		11
+
+struct suspend_latency_entry {
+	ktime_t time;			/* when the step was done */
+	u32 duration_us;
+	s16 event;
+	s16 ret;
+	const void *fn;
+	char name[SUSPEND_LATENCY_NAME_LEN];
+};
+
+static const char *event_names[SUSPEND_LATENCY_EVENT_COUNT] = {
+	[SUSPEND_LATENCY_EARLY_SUSPEND] = "early_suspend",
+	[SUSPEND_LATENCY_LATE_RESUME] = "late_resume",
+	[SUSPEND_LATENCY_DEV_SUSPEND] = "dev_suspend",
+	[SUSPEND_LATENCY_DEV_RESUME] = "dev_resume",
+	[SUSPEND_LATENCY_SUSPEND] = "suspend",
+	[SUSPEND_LATENCY_ABORT] = "abort",
+};
+
+static DEFINE_SPINLOCK(log_lock);
+static struct suspend_latency_entry entries[SUSPEND_LATENCY_LOG_SIZE];
+static unsigned int log_head;		/* total entries ever recorded */
+static unsigned long histogram[SUSPEND_LATENCY_EVENT_COUNT]
+			      [SUSPEND_LATENCY_BUCKETS];
+static u32 max_us[SUSPEND_LATENCY_EVENT_COUNT];
+
+static struct dentry *debugfs_dir;
+
+void suspend_latency_record(int event, const void *fn, const char *name,
+			    ktime_t start, int ret)
+{
+	struct suspend_latency_entry *e;
+	unsigned long irqflags;
+	ktime_t now = ktime_get();
+	s64 us = ktime_to_us(ktime_sub(now, start));
+	int bucket;
+
+	if (us < 0)
+		us = 0;
+	if (us > UINT_MAX)
+		us = UINT_MAX;
+	bucket = us < USEC_PER_MSEC ? 0 : ilog2((u32)us / USEC_PER_MSEC) + 1;
+	if (bucket >= SUSPEND_LATENCY_BUCKETS)
+		bucket = SUSPEND_LATENCY_BUCKETS - 1;
+
+	spin_lock_irqsave(&log_lock, irqflags);
+	e = &entries[log_head++ % SUSPEND_LATENCY_LOG_SIZE];
+	e->time = now;
+	e->duration_us = us;
+	e->event = event;
+	e->ret = ret;
+	e->fn = fn;
+	if (name)
+		strlcpy(e->name, name, sizeof(e->name));
+	else
+		e->name[0] = '\0';
+	histogram[event][bucket]++;
+	if (us > max_us[event])
+		max_us[event] = us;
+	spin_unlock_irqrestore(&log_lock, irqflags);
+}
+EXPORT_SYMBOL(suspend_latency_record);
+
+static int suspend_latency_log_show(struct seq_file *m, void *unused)
+{
+	struct suspend_latency_entry *e;
+	unsigned int i, start;
+
+	/*
+	 * Copied out first, so that symbol lookups for the whole log do not
+	 * run with interrupts off.
+	 */
+	e = kmalloc(sizeof(entries), GFP_KERNEL);
+	if (!e)
+		return -ENOMEM;
+	spin_lock_irq(&log_lock);
+	memcpy(e, entries, sizeof(entries));
+	i = log_head;
+	spin_unlock_irq(&log_lock);
+
+	start = i > SUSPEND_LATENCY_LOG_SIZE ? i - SUSPEND_LATENCY_LOG_SIZE : 0;
+	seq_puts(m, "time\tevent\tname\tduration_us\tret\n");
+	for (; start < i; start++) {
+		struct suspend_latency_entry *entry =
+			&e[start % SUSPEND_LATENCY_LOG_SIZE];
+
+		seq_printf(m, "%lld\t%s\t", ktime_to_ns(entry->time),
+			   event_names[entry->event]);
+		if (entry->fn)
+			seq_printf(m, "%pF", entry->fn);
+		else
+			seq_puts(m, entry->name);
+		seq_printf(m, "\t%u\t%d\n", entry->duration_us, entry->ret);
+	}
+	kfree(e);
+	return 0;
+}
+
+static int suspend_latency_histogram_show(struct seq_file *m, void *unused)
+{
+	unsigned long counts[SUSPEND_LATENCY_BUCKETS];
+	u32 max;
+	int event, b;
+
+	seq_puts(m, "event\t<1ms");
+	for (b = 1; b < SUSPEND_LATENCY_BUCKETS - 1; b++)
+		seq_printf(m, "\t<%dms", 1 << b);
+	seq_printf(m, "\t>=%dms\tmax_us\n",
+		   1 << (SUSPEND_LATENCY_BUCKETS - 2));
+
+	for (event = 0; event < SUSPEND_LATENCY_EVENT_COUNT; event++) {
+		spin_lock_irq(&log_lock);
+		memcpy(counts, histogram[event], sizeof(counts));
+		max = max_us[event];
+		spin_unlock_irq(&log_lock);
+
+		seq_puts(m, event_names[event]);
+		for (b = 0; b < SUSPEND_LATENCY_BUCKETS; b++)
+			seq_printf(m, "\t%lu", counts[b]);
+		seq_printf(m, "\t%u\n", max);
+	}
+	return 0;
+}
+
+static int suspend_latency_log_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, suspend_latency_log_show, NULL);
+}
+
+static int suspend_latency_histogram_open(struct inode *inode,
+					  struct file *file)
+{
+	return single_open(file, suspend_latency_histogram_show, NULL);
+}
+
+static const struct file_operations suspend_latency_log_fops = {
+	.owner = THIS_MODULE,
+	.open = suspend_latency_log_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations suspend_latency_histogram_fops = {
+	.owner = THIS_MODULE,
+	.open = suspend_latency_histogram_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init suspend_latency_init(void)
+{
+	debugfs_dir = debugfs_create_dir("suspend_latency", NULL);
+	if (!debugfs_dir)
+		return -ENOMEM;
+	debugfs_create_file("log", S_IRUGO, debugfs_dir, NULL,
+			    &suspend_latency_log_fops);
+	debugfs_create_file("histogram", S_IRUGO, debugfs_dir, NULL,
+			    &suspend_latency_histogram_fops);
+	return 0;
+}
+
+late_initcall(suspend_latency_init);
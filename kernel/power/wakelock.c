@@ -14,9 +14,11 @@
  */
 
 #include <linux/module.h>
+#include <linux/hash.h>
 #include <linux/platform_device.h>
 #include <linux/rtc.h>
 #include <linux/suspend.h>
+#include <linux/suspend_latency.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #ifdef CONFIG_WAKELOCK_STAT
@@ -40,20 +42,81 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 #define WAKE_LOCK_AUTO_EXPIRE            (1U << 10)
 #define WAKE_LOCK_PREVENTING_SUSPEND     (1U << 11)
 
-static DEFINE_SPINLOCK(list_lock);
-static LIST_HEAD(inactive_locks);
-static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
+#define WAKE_LOCK_HASH_BITS              4
+#define WAKE_LOCK_HASH_SIZE              (1 << WAKE_LOCK_HASH_BITS)
+
+/*
+ * Every wake lock sits in the bucket its address hashes to. The bucket lock
+ * protects the flags, expiry, timer and stats of the locks in it, so drivers
+ * toggling unrelated wake locks from their interrupt handlers rarely share a
+ * lock. Which locks are active is tracked by the per-type counts below rather
+ * than by lists, and a lock with a timeout expires from its own timer.
+ */
+static struct wake_lock_bucket {
+	spinlock_t lock;
+	struct hlist_head head;
+} ____cacheline_aligned_in_smp wake_lock_hash[WAKE_LOCK_HASH_SIZE] = {
+	[0 ... WAKE_LOCK_HASH_SIZE - 1] = {
+		.lock = __SPIN_LOCK_UNLOCKED(wake_lock_hash.lock),
+	},
+};
+
+/* Number of active locks of each type, and how many have no timeout */
+static atomic_t active_count[WAKE_LOCK_TYPE_COUNT];
+static atomic_t held_count[WAKE_LOCK_TYPE_COUNT];
+
 static int current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct wake_lock main_wake_lock;
 suspend_state_t requested_suspend_state = PM_SUSPEND_MEM;
 static struct wake_lock unknown_wakeup;
 
+static struct wake_lock_bucket *lock_bucket(struct wake_lock *lock,
+					    unsigned long *irqflags)
+{
+	struct wake_lock_bucket *b;
+
+	b = &wake_lock_hash[hash_ptr(lock, WAKE_LOCK_HASH_BITS)];
+	local_irq_save(*irqflags);
+	if (!spin_trylock(&b->lock)) {
+		spin_lock(&b->lock);
+#ifdef CONFIG_WAKELOCK_STAT
+		lock->stat.contended++;
+#endif
+	}
+	return b;
+}
+
+static void unlock_bucket(struct wake_lock_bucket *b, unsigned long irqflags)
+{
+	spin_unlock_irqrestore(&b->lock, irqflags);
+}
+
 #ifdef CONFIG_WAKELOCK_STAT
 static struct wake_lock deleted_wake_locks;
 static ktime_t last_sleep_time_update;
 static int wait_for_wakeup;
 
+/*
+ * sleep_stats_lock serializes update_sleep_wait_stats(), which takes the
+ * bucket locks one at a time. last_sleep_time_update is read under bucket
+ * locks, so it is published through its own seqlock instead.
+ */
+static DEFINE_SPINLOCK(sleep_stats_lock);
+static DEFINE_SEQLOCK(sleep_time_seq);
+
+static ktime_t get_last_sleep_time_update(void)
+{
+	unsigned long seq;
+	ktime_t ret;
+
+	do {
+		seq = read_seqbegin(&sleep_time_seq);
+		ret = last_sleep_time_update;
+	} while (read_seqretry(&sleep_time_seq, seq));
+	return ret;
+}
+
 int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 {
 	struct timespec ts;
@@ -104,38 +167,37 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 		total_time = ktime_add(total_time, add_time);
 		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND)
 			prevent_suspend_time = ktime_add(prevent_suspend_time,
-					ktime_sub(now, last_sleep_time_update));
+				ktime_sub(now, get_last_sleep_time_update()));
 		if (add_time.tv64 > max_time.tv64)
 			max_time = add_time;
 	}
 
 	return seq_printf(m,
-		     "\"%s\"\t%d\t%d\t%d\t%lld\t%lld\t%lld\t%lld\t%lld\n",
+		     "\"%s\"\t%d\t%d\t%d\t%lld\t%lld\t%lld\t%lld\t%lld\t%d\n",
 		     lock->name, lock_count, expire_count,
 		     lock->stat.wakeup_count, ktime_to_ns(active_time),
 		     ktime_to_ns(total_time),
 		     ktime_to_ns(prevent_suspend_time), ktime_to_ns(max_time),
-		     ktime_to_ns(lock->stat.last_time));
+		     ktime_to_ns(lock->stat.last_time), lock->stat.contended);
 }
 
 static int wakelock_stats_show(struct seq_file *m, void *unused)
 {
+	struct wake_lock_bucket *b;
 	unsigned long irqflags;
 	struct wake_lock *lock;
+	struct hlist_node *node;
 	int ret;
-	int type;
-
-	spin_lock_irqsave(&list_lock, irqflags);
 
 	ret = seq_puts(m, "name\tcount\texpire_count\twake_count\tactive_since"
-			"\ttotal_time\tsleep_time\tmax_time\tlast_change\n");
-	list_for_each_entry(lock, &inactive_locks, link)
-		ret = print_lock_stat(m, lock);
-	for (type = 0; type < WAKE_LOCK_TYPE_COUNT; type++) {
-		list_for_each_entry(lock, &active_wake_locks[type], link)
+			"\ttotal_time\tsleep_time\tmax_time\tlast_change"
+			"\tcontended\n");
+	for (b = wake_lock_hash; b < wake_lock_hash + WAKE_LOCK_HASH_SIZE; b++) {
+		spin_lock_irqsave(&b->lock, irqflags);
+		hlist_for_each_entry(lock, node, &b->head, link)
 			ret = print_lock_stat(m, lock);
+		spin_unlock_irqrestore(&b->lock, irqflags);
 	}
-	spin_unlock_irqrestore(&list_lock, irqflags);
 	return 0;
 }
 
@@ -158,109 +220,226 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 		lock->stat.max_time = duration;
 	lock->stat.last_time = ktime_get();
 	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-		duration = ktime_sub(now, last_sleep_time_update);
+		duration = ktime_sub(now, get_last_sleep_time_update());
 		lock->stat.prevent_suspend_time = ktime_add(
 			lock->stat.prevent_suspend_time, duration);
 		lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
 	}
 }
 
-static void update_sleep_wait_stats_locked(int done)
+/* Caller must not hold any bucket lock */
+static void update_sleep_wait_stats(int done)
 {
+	struct wake_lock_bucket *b;
 	struct wake_lock *lock;
+	struct hlist_node *node;
+	unsigned long irqflags;
 	ktime_t now, etime, elapsed, add;
 	int expired;
 
+	spin_lock_irqsave(&sleep_stats_lock, irqflags);
 	now = ktime_get();
 	elapsed = ktime_sub(now, last_sleep_time_update);
-	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link) {
-		expired = get_expired_time(lock, &etime);
-		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-			if (expired)
-				add = ktime_sub(etime, last_sleep_time_update);
+	for (b = wake_lock_hash; b < wake_lock_hash + WAKE_LOCK_HASH_SIZE; b++) {
+		spin_lock(&b->lock);
+		hlist_for_each_entry(lock, node, &b->head, link) {
+			if ((lock->flags & (WAKE_LOCK_TYPE_MASK |
+			     WAKE_LOCK_ACTIVE)) !=
+			    (WAKE_LOCK_SUSPEND | WAKE_LOCK_ACTIVE))
+				continue;
+			expired = get_expired_time(lock, &etime);
+			if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
+				if (expired)
+					add = ktime_sub(etime,
+							last_sleep_time_update);
+				else
+					add = elapsed;
+				lock->stat.prevent_suspend_time = ktime_add(
+					lock->stat.prevent_suspend_time, add);
+			}
+			if (done || expired)
+				lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
 			else
-				add = elapsed;
-			lock->stat.prevent_suspend_time = ktime_add(
-				lock->stat.prevent_suspend_time, add);
+				lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
 		}
-		if (done || expired)
-			lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
-		else
-			lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
+		spin_unlock(&b->lock);
 	}
+	write_seqlock(&sleep_time_seq);
 	last_sleep_time_update = now;
+	write_sequnlock(&sleep_time_seq);
+	spin_unlock_irqrestore(&sleep_stats_lock, irqflags);
 }
 #endif
 
 
+static void suspend(struct work_struct *work);
+static DECLARE_WORK(suspend_work, suspend);
+
+/*
+ * Updates the per-type counts after the flags of a lock changed from 'old',
+ * and starts suspend once the last suspend lock is gone.
+ * Caller must hold the lock's bucket lock.
+ */
+static void update_active_count(struct wake_lock *lock, int old)
+{
+	int type = lock->flags & WAKE_LOCK_TYPE_MASK;
+	int held_mask = WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE;
+	int was_held = (old & held_mask) == WAKE_LOCK_ACTIVE;
+	int is_held = (lock->flags & held_mask) == WAKE_LOCK_ACTIVE;
+
+	if (!(old & WAKE_LOCK_ACTIVE) && (lock->flags & WAKE_LOCK_ACTIVE))
+		atomic_inc(&active_count[type]);
+	if (is_held && !was_held)
+		atomic_inc(&held_count[type]);
+	else if (was_held && !is_held)
+		atomic_dec(&held_count[type]);
+	if ((old & WAKE_LOCK_ACTIVE) && !(lock->flags & WAKE_LOCK_ACTIVE) &&
+	    atomic_dec_and_test(&active_count[type]) &&
+	    type == WAKE_LOCK_SUSPEND)
+		queue_work(suspend_work_queue, &suspend_work);
+}
+
+/* Caller must hold the lock's bucket lock */
 static void expire_wake_lock(struct wake_lock *lock)
 {
+	int old = lock->flags;
+
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 1);
 #endif
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
-	list_add(&lock->link, &inactive_locks);
+	update_active_count(lock, old);
 	if (debug_mask & (DEBUG_WAKE_LOCK | DEBUG_EXPIRE))
 		pr_info("expired wake lock %s\n", lock->name);
 }
 
-/* Caller must acquire the list_lock spinlock */
+static void wake_lock_expire(unsigned long data)
+{
+	struct wake_lock *lock = (struct wake_lock *)data;
+	struct wake_lock_bucket *b;
+	unsigned long irqflags;
+
+	b = lock_bucket(lock, &irqflags);
+	/* it may have been relocked or unlocked since the timer was set */
+	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
+	    (long)(lock->expires - jiffies) <= 0)
+		expire_wake_lock(lock);
+	unlock_bucket(b, irqflags);
+}
+
 static void print_active_locks(int type)
 {
+	struct wake_lock_bucket *b;
 	struct wake_lock *lock;
+	struct hlist_node *node;
+	unsigned long irqflags;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry(lock, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				pr_info("wake lock %s, expired\n", lock->name);
-			else
-				pr_info("active wake lock %s, time left %ld\n",
-					lock->name, timeout);
-		} else
-			pr_info("active wake lock %s\n", lock->name);
+	for (b = wake_lock_hash; b < wake_lock_hash + WAKE_LOCK_HASH_SIZE; b++) {
+		spin_lock_irqsave(&b->lock, irqflags);
+		hlist_for_each_entry(lock, node, &b->head, link) {
+			if ((lock->flags & (WAKE_LOCK_TYPE_MASK |
+			     WAKE_LOCK_ACTIVE)) != (type | WAKE_LOCK_ACTIVE))
+				continue;
+			if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
+				long timeout = lock->expires - jiffies;
+				if (timeout <= 0)
+					pr_info("wake lock %s, expired\n",
+						lock->name);
+				else
+					pr_info("active wake lock %s, time "
+						"left %ld\n", lock->name,
+						timeout);
+			} else
+				pr_info("active wake lock %s\n", lock->name);
+		}
+		spin_unlock_irqrestore(&b->lock, irqflags);
 	}
 }
 
-static long has_wake_lock_locked(int type)
+/*
+ * Only needed when every active lock of the type has a timeout, which is
+ * the one case the counts cannot answer on their own.
+ */
+static long max_wake_lock_timeout(int type)
 {
-	struct wake_lock *lock, *n;
+	struct wake_lock_bucket *b;
+	struct wake_lock *lock;
+	struct hlist_node *node;
+	unsigned long irqflags;
 	long max_timeout = 0;
 
-	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
+	for (b = wake_lock_hash; b < wake_lock_hash + WAKE_LOCK_HASH_SIZE; b++) {
+		spin_lock_irqsave(&b->lock, irqflags);
+		hlist_for_each_entry(lock, node, &b->head, link) {
+			long timeout;
+
+			if ((lock->flags & (WAKE_LOCK_TYPE_MASK |
+			     WAKE_LOCK_ACTIVE)) != (type | WAKE_LOCK_ACTIVE))
+				continue;
+			if (!(lock->flags & WAKE_LOCK_AUTO_EXPIRE)) {
+				spin_unlock_irqrestore(&b->lock, irqflags);
+				return -1;
+			}
+			timeout = lock->expires - jiffies;
+			if (timeout > max_timeout)
 				max_timeout = timeout;
-		} else
-			return -1;
+		}
+		spin_unlock_irqrestore(&b->lock, irqflags);
 	}
 	return max_timeout;
 }
 
 long has_wake_lock(int type)
 {
-	long ret;
+	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
+	if (!atomic_read(&active_count[type]))
+		return 0;
+	if (atomic_read(&held_count[type]))
+		return -1;
+	return max_wake_lock_timeout(type);
+}
+
+#ifdef CONFIG_SUSPEND_LATENCY
+/* Records the first active suspend lock found as the reason for an abort */
+static void record_suspend_abort(ktime_t start)
+{
+	struct wake_lock_bucket *b;
+	struct wake_lock *lock;
+	struct hlist_node *node;
 	unsigned long irqflags;
-	spin_lock_irqsave(&list_lock, irqflags);
-	ret = has_wake_lock_locked(type);
-	spin_unlock_irqrestore(&list_lock, irqflags);
-	return ret;
+
+	for (b = wake_lock_hash; b < wake_lock_hash + WAKE_LOCK_HASH_SIZE; b++) {
+		spin_lock_irqsave(&b->lock, irqflags);
+		hlist_for_each_entry(lock, node, &b->head, link) {
+			if ((lock->flags & (WAKE_LOCK_TYPE_MASK |
+			     WAKE_LOCK_ACTIVE)) !=
+			    (WAKE_LOCK_SUSPEND | WAKE_LOCK_ACTIVE))
+				continue;
+			suspend_latency_record(SUSPEND_LATENCY_ABORT, NULL,
+					       lock->name, start, -EAGAIN);
+			spin_unlock_irqrestore(&b->lock, irqflags);
+			return;
+		}
+		spin_unlock_irqrestore(&b->lock, irqflags);
+	}
+	suspend_latency_record(SUSPEND_LATENCY_ABORT, NULL, "unknown", start,
+			       -EAGAIN);
 }
+#else
+static inline void record_suspend_abort(ktime_t start) {}
+#endif
 
 static void suspend(struct work_struct *work)
 {
 	int ret;
 	int entry_event_num;
+	ktime_t start = suspend_latency_start();
 
 	if (has_wake_lock(WAKE_LOCK_SUSPEND)) {
 		if (debug_mask & DEBUG_SUSPEND)
 			pr_info("suspend: abort suspend\n");
+		record_suspend_abort(start);
 		return;
 	}
 
@@ -268,7 +447,10 @@ static void suspend(struct work_struct *work)
 	sys_sync();
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("suspend: enter suspend\n");
+	start = suspend_latency_start();
 	ret = pm_suspend(requested_suspend_state);
+	suspend_latency_record(SUSPEND_LATENCY_SUSPEND, NULL, "pm_suspend",
+			       start, ret);
 	if (debug_mask & DEBUG_EXIT_SUSPEND) {
 		struct timespec ts;
 		struct rtc_time tm;
@@ -285,29 +467,13 @@ static void suspend(struct work_struct *work)
 		wake_lock_timeout(&unknown_wakeup, HZ / 2);
 	}
 }
-static DECLARE_WORK(suspend_work, suspend);
-
-static void expire_wake_locks(unsigned long data)
-{
-	long has_lock;
-	unsigned long irqflags;
-	if (debug_mask & DEBUG_EXPIRE)
-		pr_info("expire_wake_locks: start\n");
-	spin_lock_irqsave(&list_lock, irqflags);
-	if (debug_mask & DEBUG_SUSPEND)
-		print_active_locks(WAKE_LOCK_SUSPEND);
-	has_lock = has_wake_lock_locked(WAKE_LOCK_SUSPEND);
-	if (debug_mask & DEBUG_EXPIRE)
-		pr_info("expire_wake_locks: done, has_lock %ld\n", has_lock);
-	if (has_lock == 0)
-		queue_work(suspend_work_queue, &suspend_work);
-	spin_unlock_irqrestore(&list_lock, irqflags);
-}
-static DEFINE_TIMER(expire_timer, expire_wake_locks, 0, 0);
 
 static int power_suspend_late(struct platform_device *pdev, pm_message_t state)
 {
 	int ret = has_wake_lock(WAKE_LOCK_SUSPEND) ? -EAGAIN : 0;
+
+	if (ret)
+		record_suspend_abort(suspend_latency_start());
 #ifdef CONFIG_WAKELOCK_STAT
 	wait_for_wakeup = 1;
 #endif
@@ -326,6 +492,7 @@ static struct platform_device power_device = {
 
 void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 {
+	struct wake_lock_bucket *b;
 	unsigned long irqflags = 0;
 
 	if (name)
@@ -342,59 +509,79 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	lock->stat.prevent_suspend_time = ktime_set(0, 0);
 	lock->stat.max_time = ktime_set(0, 0);
 	lock->stat.last_time = ktime_set(0, 0);
+	lock->stat.contended = 0;
 #endif
 	lock->flags = (type & WAKE_LOCK_TYPE_MASK) | WAKE_LOCK_INITIALIZED;
+	setup_timer(&lock->timer, wake_lock_expire, (unsigned long)lock);
 
-	INIT_LIST_HEAD(&lock->link);
-	spin_lock_irqsave(&list_lock, irqflags);
-	list_add(&lock->link, &inactive_locks);
-	spin_unlock_irqrestore(&list_lock, irqflags);
+	INIT_HLIST_NODE(&lock->link);
+	b = lock_bucket(lock, &irqflags);
+	hlist_add_head(&lock->link, &b->head);
+	unlock_bucket(b, irqflags);
 }
 EXPORT_SYMBOL(wake_lock_init);
 
 void wake_lock_destroy(struct wake_lock *lock)
 {
+	struct wake_lock_bucket *b;
 	unsigned long irqflags;
+	int old;
+#ifdef CONFIG_WAKELOCK_STAT
+	struct wake_lock_stat dead;
+#endif
+
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_lock_destroy name=%s\n", lock->name);
-	spin_lock_irqsave(&list_lock, irqflags);
-	lock->flags &= ~WAKE_LOCK_INITIALIZED;
+	del_timer_sync(&lock->timer);
+	b = lock_bucket(lock, &irqflags);
+	old = lock->flags;
+	lock->flags &= ~(WAKE_LOCK_INITIALIZED | WAKE_LOCK_ACTIVE |
+			 WAKE_LOCK_AUTO_EXPIRE);
+	update_active_count(lock, old);
+#ifdef CONFIG_WAKELOCK_STAT
+	dead = lock->stat;
+#endif
+	hlist_del_init(&lock->link);
+	unlock_bucket(b, irqflags);
+
 #ifdef CONFIG_WAKELOCK_STAT
-	if (lock->stat.count) {
-		deleted_wake_locks.stat.count += lock->stat.count;
-		deleted_wake_locks.stat.expire_count += lock->stat.expire_count;
+	if (dead.count) {
+		b = lock_bucket(&deleted_wake_locks, &irqflags);
+		deleted_wake_locks.stat.count += dead.count;
+		deleted_wake_locks.stat.expire_count += dead.expire_count;
 		deleted_wake_locks.stat.total_time =
 			ktime_add(deleted_wake_locks.stat.total_time,
-				  lock->stat.total_time);
+				  dead.total_time);
 		deleted_wake_locks.stat.prevent_suspend_time =
 			ktime_add(deleted_wake_locks.stat.prevent_suspend_time,
-				  lock->stat.prevent_suspend_time);
+				  dead.prevent_suspend_time);
 		deleted_wake_locks.stat.max_time =
 			ktime_add(deleted_wake_locks.stat.max_time,
-				  lock->stat.max_time);
+				  dead.max_time);
+		deleted_wake_locks.stat.contended += dead.contended;
+		unlock_bucket(b, irqflags);
 	}
 #endif
-	list_del(&lock->link);
-	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 EXPORT_SYMBOL(wake_lock_destroy);
 
 static void wake_lock_internal(
 	struct wake_lock *lock, long timeout, int has_timeout)
 {
+	struct wake_lock_bucket *b;
 	int type;
 	unsigned long irqflags;
-	long expire_in;
+	int old;
 
-	spin_lock_irqsave(&list_lock, irqflags);
+	b = lock_bucket(lock, &irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
 	BUG_ON(!(lock->flags & WAKE_LOCK_INITIALIZED));
 #ifdef CONFIG_WAKELOCK_STAT
-	if (type == WAKE_LOCK_SUSPEND && wait_for_wakeup) {
+	if (type == WAKE_LOCK_SUSPEND && wait_for_wakeup &&
+	    xchg(&wait_for_wakeup, 0)) {
 		if (debug_mask & DEBUG_WAKEUP)
 			pr_info("wakeup wake lock: %s\n", lock->name);
-		wait_for_wakeup = 0;
 		lock->stat.wakeup_count++;
 	}
 	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
@@ -403,13 +590,13 @@ static void wake_lock_internal(
 		lock->stat.last_time = ktime_get();
 	}
 #endif
+	old = lock->flags;
 	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
 		lock->flags |= WAKE_LOCK_ACTIVE;
 #ifdef CONFIG_WAKELOCK_STAT
 		lock->stat.last_time = ktime_get();
 #endif
 	}
-	list_del(&lock->link);
 	if (has_timeout) {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d, timeout %ld.%03lu\n",
@@ -417,42 +604,27 @@ static void wake_lock_internal(
 				(timeout % HZ) * MSEC_PER_SEC / HZ);
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
-		list_add_tail(&lock->link, &active_wake_locks[type]);
+		mod_timer(&lock->timer, lock->expires);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
 		lock->expires = LONG_MAX;
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
-		list_add(&lock->link, &active_wake_locks[type]);
+		del_timer(&lock->timer);
 	}
-	if (type == WAKE_LOCK_SUSPEND) {
-		if (lock == &main_wake_lock)
-			current_event_num++;
+	update_active_count(lock, old);
+	if (lock == &main_wake_lock)
+		current_event_num++;
+	unlock_bucket(b, irqflags);
+
 #ifdef CONFIG_WAKELOCK_STAT
+	if (type == WAKE_LOCK_SUSPEND) {
 		if (lock == &main_wake_lock)
-			update_sleep_wait_stats_locked(1);
+			update_sleep_wait_stats(1);
 		else if (!wake_lock_active(&main_wake_lock))
-			update_sleep_wait_stats_locked(0);
-#endif
-		if (has_timeout)
-			expire_in = has_wake_lock_locked(type);
-		else
-			expire_in = -1;
-		if (expire_in > 0) {
-			if (debug_mask & DEBUG_EXPIRE)
-				pr_info("wake_lock: %s, start expire timer, "
-					"%ld\n", lock->name, expire_in);
-			mod_timer(&expire_timer, jiffies + expire_in);
-		} else {
-			if (del_timer(&expire_timer))
-				if (debug_mask & DEBUG_EXPIRE)
-					pr_info("wake_lock: %s, stop expire timer\n",
-						lock->name);
-			if (expire_in == 0)
-				queue_work(suspend_work_queue, &suspend_work);
-		}
+			update_sleep_wait_stats(0);
 	}
-	spin_unlock_irqrestore(&list_lock, irqflags);
+#endif
 }
 
 void wake_lock(struct wake_lock *lock)
@@ -469,42 +641,29 @@ EXPORT_SYMBOL(wake_lock_timeout);
 
 void wake_unlock(struct wake_lock *lock)
 {
-	int type;
+	struct wake_lock_bucket *b;
 	unsigned long irqflags;
-	spin_lock_irqsave(&list_lock, irqflags);
-	type = lock->flags & WAKE_LOCK_TYPE_MASK;
+	int old;
+
+	b = lock_bucket(lock, &irqflags);
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 0);
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
+	old = lock->flags;
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
-	list_add(&lock->link, &inactive_locks);
-	if (type == WAKE_LOCK_SUSPEND) {
-		long has_lock = has_wake_lock_locked(type);
-		if (has_lock > 0) {
-			if (debug_mask & DEBUG_EXPIRE)
-				pr_info("wake_unlock: %s, start expire timer, "
-					"%ld\n", lock->name, has_lock);
-			mod_timer(&expire_timer, jiffies + has_lock);
-		} else {
-			if (del_timer(&expire_timer))
-				if (debug_mask & DEBUG_EXPIRE)
-					pr_info("wake_unlock: %s, stop expire "
-						"timer\n", lock->name);
-			if (has_lock == 0)
-				queue_work(suspend_work_queue, &suspend_work);
-		}
-		if (lock == &main_wake_lock) {
-			if (debug_mask & DEBUG_SUSPEND)
-				print_active_locks(WAKE_LOCK_SUSPEND);
+	del_timer(&lock->timer);
+	update_active_count(lock, old);
+	unlock_bucket(b, irqflags);
+
+	if (lock == &main_wake_lock) {
+		if (debug_mask & DEBUG_SUSPEND)
+			print_active_locks(WAKE_LOCK_SUSPEND);
 #ifdef CONFIG_WAKELOCK_STAT
-			update_sleep_wait_stats_locked(0);
+		update_sleep_wait_stats(0);
 #endif
-		}
 	}
-	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 EXPORT_SYMBOL(wake_unlock);
 
@@ -530,10 +689,6 @@ static const struct file_operations wakelock_stats_fops = {
 static int __init wakelocks_init(void)
 {
 	int ret;
-	int i;
-
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
-		INIT_LIST_HEAD(&active_wake_locks[i]);
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
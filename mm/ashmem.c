@@ -22,11 +22,23 @@
 #include <linux/miscdevice.h>
 #include <linux/security.h>
 #include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/swap.h>
+#include <linux/radix-tree.h>
+#include <linux/lzo.h>
 #include <linux/mman.h>
 #include <linux/uaccess.h>
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 #include <asm/cacheflush.h>
@@ -37,50 +49,101 @@
 
 /*
  * ashmem_area - anonymous shared memory area
- * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Lifecycle: From our parent file's open() until its release(), or until
+ *	a shrinker pass that is purging it finishes, whichever is later
+ * Locking: Protected by its own `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
 	char name[ASHMEM_FULL_NAME_LEN];/* optional name for /proc/pid/maps */
-	struct list_head unpinned_list;	/* list of all ashmem areas */
+	struct rb_root unpinned_root;	/* unpinned ranges, by pgstart */
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long vm_start;		/* Start address of vm_area
 					 * which maps this ashmem */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+	int retain;			/* keep purged ranges compressed */
+#ifdef CONFIG_ASHMEM_RETAIN
+	struct radix_tree_root retained;/* compressed pages, by index */
+	unsigned long retained_pages;	/* number of pages in 'retained' */
+#endif
+	struct mutex mutex;		/* protects all of the above */
+	atomic_t refcount;		/* the file, plus the shrinker */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's mutex, the LRU linkage also by
+ *	`ashmem_lru_lock'
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
-	struct list_head unpinned;	/* entry in its area's unpinned list */
+	struct rb_node node;		/* node in its area's unpinned tree */
 	struct ashmem_area *asma;	/* associated area */
 	size_t pgstart;			/* starting page, inclusive */
 	size_t pgend;			/* ending page, inclusive */
-	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
+	unsigned int purged;		/* ASHMEM_NOT, _WAS_PURGED, or
+					 * _WAS_RESTORED if purged but its
+					 * contents are retained */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and lru_count
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock
+ *		  asma->mutex -> i_mutex -> i_alloc_sem
+ * The shrinker only ever trylocks an area's mutex under ashmem_lru_lock.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/* Largest number of ranges accepted by ASHMEM_PIN_VEC and ASHMEM_UNPIN_VEC */
+#define ASHMEM_PIN_VEC_MAX	512
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
+enum ashmem_stat_op {
+	ASHMEM_STAT_PIN,
+	ASHMEM_STAT_UNPIN,
+	ASHMEM_STAT_GET_PIN_STATUS,
+	ASHMEM_STAT_PIN_VEC,
+	ASHMEM_STAT_UNPIN_VEC,
+	ASHMEM_STAT_OPS
+};
+
+static const char *ashmem_stat_op_strings[] = {
+	"pin",
+	"unpin",
+	"get_pin_status",
+	"pin_vec",
+	"unpin_vec",
+};
+
+/* Per-cpu so that the ioctl fast path does not share a cacheline */
+struct ashmem_stats {
+	unsigned long calls[ASHMEM_STAT_OPS];
+	u64 total_ns[ASHMEM_STAT_OPS];
+	u64 max_ns[ASHMEM_STAT_OPS];
+	unsigned long purged_ranges;
+	unsigned long purged_pages;
+	unsigned long shrink_busy;	/* ranges skipped, area locked */
+	unsigned long vec_ranges;	/* ranges passed to the _VEC ioctls */
+	unsigned long retained_ranges;	/* purged ranges kept compressed */
+	unsigned long retain_failed;	/* retention attempts given up */
+	unsigned long restored_ranges;	/* pins that restored contents */
+};
+
+static DEFINE_PER_CPU(struct ashmem_stats, ashmem_stats);
+
+static struct dentry *ashmem_debugfs_dir;
+
 #define range_size(range) \
   ((range)->pgend - (range)->pgstart + 1)
 
@@ -93,13 +156,6 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 #define page_range_subsumed_by_range(range, start, end) \
   (((range)->pgstart <= (start)) && ((range)->pgend >= (end)))
 
-#define page_in_range(range, page) \
- (((range)->pgstart <= (page)) && ((range)->pgend >= (page)))
-
-#define page_range_in_range(range, start, end) \
-  (page_in_range(range, start) || page_in_range(range, end) || \
-   page_range_subsumes_range(range, start, end))
-
 #define range_before_page(range, page) \
   ((range)->pgend < (page))
 
@@ -107,29 +163,96 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
-static inline void lru_del(struct ashmem_range *range)
+/* Caller must hold ashmem_lru_lock */
+static inline void __lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
 	lru_count -= range_size(range);
 }
 
+static inline void lru_del(struct ashmem_range *range)
+{
+	spin_lock(&ashmem_lru_lock);
+	__lru_del(range);
+	spin_unlock(&ashmem_lru_lock);
+}
+
+static void ashmem_area_put(struct ashmem_area *asma)
+{
+	if (atomic_dec_and_test(&asma->refcount))
+		kmem_cache_free(ashmem_area_cachep, asma);
+}
+
+/*
+ * range_first - returns the lowest unpinned range that ends at or after
+ * 'page', or NULL if there is none.
+ *
+ * Ranges never overlap, so ordering them by pgstart also orders them by
+ * pgend and the ranges overlapping an interval are adjacent in the tree.
+ *
+ * Caller must hold asma->mutex.
+ */
+static struct ashmem_range *range_first(struct ashmem_area *asma, size_t page)
+{
+	struct rb_node *n = asma->unpinned_root.rb_node;
+	struct ashmem_range *range, *found = NULL;
+
+	while (n) {
+		range = rb_entry(n, struct ashmem_range, node);
+		if (range_before_page(range, page)) {
+			n = n->rb_right;
+		} else {
+			found = range;
+			n = n->rb_left;
+		}
+	}
+
+	return found;
+}
+
+static inline struct ashmem_range *range_next(struct ashmem_range *range)
+{
+	struct rb_node *n = rb_next(&range->node);
+
+	return n ? rb_entry(n, struct ashmem_range, node) : NULL;
+}
+
+static void range_insert(struct ashmem_area *asma, struct ashmem_range *range)
+{
+	struct rb_node **p = &asma->unpinned_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct ashmem_range *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct ashmem_range, node);
+		if (range->pgstart < entry->pgstart)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	rb_link_node(&range->node, parent, p);
+	rb_insert_color(&range->node, &asma->unpinned_root);
+}
+
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
  * 'asma' - associated ashmem_area
- * 'prev_range' - the previous ashmem_range in the sorted asma->unpinned list
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
-static int range_alloc(struct ashmem_area *asma,
-		       struct ashmem_range *prev_range, unsigned int purged,
+static int range_alloc(struct ashmem_area *asma, unsigned int purged,
 		       size_t start, size_t end)
 {
 	struct ashmem_range *range;
@@ -143,7 +266,7 @@ static int range_alloc(struct ashmem_area *asma,
 	range->pgend = end;
 	range->purged = purged;
 
-	list_add_tail(&range->unpinned, &prev_range->unpinned);
+	range_insert(asma, range);
 
 	if (range_on_lru(range))
 		lru_add(range);
@@ -153,7 +276,7 @@ static int range_alloc(struct ashmem_area *asma,
 
 static void range_del(struct ashmem_range *range)
 {
-	list_del(&range->unpinned);
+	rb_erase(&range->node, &range->asma->unpinned_root);
 	if (range_on_lru(range))
 		lru_del(range);
 	kmem_cache_free(ashmem_range_cachep, range);
@@ -162,7 +285,10 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Shrinking within the range's own interval keeps the tree ordered, so the
+ * node is left where it is.
+ *
+ * Caller must hold asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -172,10 +298,225 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
+}
+
+#ifdef CONFIG_ASHMEM_RETAIN
+/*
+ * Compressed retention: the pages of a purged range of an area that opted in
+ * are LZO-compressed into asma->retained before being truncated, and pinning
+ * the range writes them back to the backing file. The compressed data of all
+ * areas together is capped at retain_budget bytes.
+ */
+struct ashmem_zpage {
+	pgoff_t index;			/* page index in the area */
+	unsigned int len;		/* PAGE_SIZE if stored uncompressed */
+	unsigned char data[0];
+};
+
+static unsigned long ashmem_retain_budget = 4 * 1024 * 1024;
+module_param_named(retain_budget, ashmem_retain_budget, ulong,
+		   S_IWUSR | S_IRUGO);
+
+static atomic_long_t ashmem_retained_bytes = ATOMIC_LONG_INIT(0);
+
+/* Compression scratch space, only ever trylocked by the shrinker */
+static DEFINE_MUTEX(ashmem_zbuf_mutex);
+static unsigned char ashmem_zwork[LZO1X_MEM_COMPRESS];
+static unsigned char ashmem_zbuf[lzo1x_worst_compress(PAGE_SIZE)];
+
+static void ashmem_zpage_free(struct ashmem_area *asma,
+			      struct ashmem_zpage *zp)
+{
+	radix_tree_delete(&asma->retained, zp->index);
+	asma->retained_pages--;
+	atomic_long_sub(zp->len, &ashmem_retained_bytes);
+	kfree(zp);
+}
+
+/* Decompresses one page into 'buf' and writes it back to the backing file */
+static int ashmem_zpage_restore(struct ashmem_area *asma,
+				struct ashmem_zpage *zp, unsigned char *buf)
+{
+	struct file *file = asma->file;
+	loff_t pos = (loff_t)zp->index << PAGE_SHIFT;
+	size_t len = PAGE_SIZE;
+	mm_segment_t old_fs;
+	ssize_t ret;
+
+	if (zp->len == PAGE_SIZE)
+		memcpy(buf, zp->data, PAGE_SIZE);
+	else if (lzo1x_decompress_safe(zp->data, zp->len, buf, &len) !=
+		 LZO_E_OK || len != PAGE_SIZE)
+		return -EIO;
+
+	/* the last page can extend past the end of the area */
+	len = min_t(loff_t, PAGE_SIZE,
+		    i_size_read(file->f_dentry->d_inode) - pos);
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	ret = file->f_op->write(file, (char __user *)buf, len, &pos);
+	set_fs(old_fs);
+
+	if (ret < 0)
+		return ret;
+	return ret == (ssize_t)len ? 0 : -EIO;
+}
+
+/*
+ * ashmem_retained_release - frees the retained pages in [start, end], first
+ * writing them back to the area if 'restore' is set. Returns nonzero if any
+ * of them could not be restored.
+ *
+ * Caller must hold asma->mutex.
+ */
+static int ashmem_retained_release(struct ashmem_area *asma, size_t start,
+				   size_t end, int restore)
+{
+	struct ashmem_zpage *batch[16];
+	unsigned char *buf = NULL;
+	int ret = 0;
+	int i, n;
+
+	if (!asma->retained_pages)
+		return 0;
+
+	if (restore) {
+		buf = (unsigned char *)__get_free_page(GFP_KERNEL);
+		if (unlikely(!buf))
+			ret = -ENOMEM;
+	}
+
+	while ((n = radix_tree_gang_lookup(&asma->retained, (void **)batch,
+					   start, ARRAY_SIZE(batch)))) {
+		for (i = 0; i < n; i++) {
+			struct ashmem_zpage *zp = batch[i];
+
+			if (zp->index > end)
+				goto out;
+			if (buf && !ret)
+				ret = ashmem_zpage_restore(asma, zp, buf);
+			start = zp->index + 1;
+			ashmem_zpage_free(asma, zp);
+		}
+	}
+
+out:
+	if (buf)
+		free_page((unsigned long)buf);
+	return ret;
 }
 
+/*
+ * ashmem_retain_range - compresses the pages of a range that the shrinker is
+ * about to purge. Returns nonzero if all of them were kept.
+ *
+ * Called from reclaim with asma->mutex held, so nothing here blocks: the
+ * scratch buffers are trylocked and allocations do not wait. Pages that are
+ * not resident are only known to be zero when there is no swap, otherwise
+ * the range is not retained.
+ */
+static int ashmem_retain_range(struct ashmem_area *asma,
+			       struct ashmem_range *range)
+{
+	struct address_space *mapping = asma->file->f_mapping;
+	struct ashmem_zpage *zp;
+	struct page *page;
+	unsigned char *src;
+	size_t idx, len;
+	int ret;
+
+	if (!mutex_trylock(&ashmem_zbuf_mutex))
+		return 0;
+
+	for (idx = range->pgstart; idx <= range->pgend; idx++) {
+		page = find_get_page(mapping, idx);
+		if (!page) {
+			if (total_swap_pages)
+				goto fail;
+			continue;
+		}
+		if (!PageUptodate(page)) {
+			page_cache_release(page);
+			goto fail;
+		}
+
+		src = kmap_atomic(page, KM_USER0);
+		ret = lzo1x_1_compress(src, PAGE_SIZE, ashmem_zbuf, &len,
+				       ashmem_zwork);
+		if (ret != LZO_E_OK || len >= PAGE_SIZE) {
+			memcpy(ashmem_zbuf, src, PAGE_SIZE);
+			len = PAGE_SIZE;
+		}
+		kunmap_atomic(src, KM_USER0);
+		page_cache_release(page);
+
+		if (atomic_long_add_return(len, &ashmem_retained_bytes) >
+		    ashmem_retain_budget)
+			goto fail_budget;
+
+		zp = kmalloc(sizeof(*zp) + len, GFP_NOWAIT | __GFP_NOWARN);
+		if (!zp)
+			goto fail_budget;
+		zp->index = idx;
+		zp->len = len;
+		memcpy(zp->data, ashmem_zbuf, len);
+
+		if (radix_tree_preload(GFP_NOWAIT | __GFP_NOWARN))
+			goto fail_free;
+		ret = radix_tree_insert(&asma->retained, idx, zp);
+		radix_tree_preload_end();
+		if (ret)
+			goto fail_free;
+		asma->retained_pages++;
+	}
+
+	mutex_unlock(&ashmem_zbuf_mutex);
+	return 1;
+
+fail_free:
+	kfree(zp);
+fail_budget:
+	atomic_long_sub(len, &ashmem_retained_bytes);
+fail:
+	mutex_unlock(&ashmem_zbuf_mutex);
+	ashmem_retained_release(asma, range->pgstart, range->pgend, 0);
+	return 0;
+}
+
+static int set_retain(struct ashmem_area *asma, unsigned long retain)
+{
+	mutex_lock(&asma->mutex);
+	asma->retain = !!retain;
+	mutex_unlock(&asma->mutex);
+
+	return 0;
+}
+#else
+static inline int ashmem_retained_release(struct ashmem_area *asma,
+					  size_t start, size_t end,
+					  int restore)
+{
+	return 0;
+}
+
+static inline int ashmem_retain_range(struct ashmem_area *asma,
+				      struct ashmem_range *range)
+{
+	return 0;
+}
+
+static int set_retain(struct ashmem_area *asma, unsigned long retain)
+{
+	return retain ? -EINVAL : 0;
+}
+#endif
+
 static int ashmem_open(struct inode *inode, struct file *file)
 {
 	struct ashmem_area *asma;
@@ -189,9 +530,14 @@ static int ashmem_open(struct inode *inode, struct file *file)
 	if (unlikely(!asma))
 		return -ENOMEM;
 
-	INIT_LIST_HEAD(&asma->unpinned_list);
+	asma->unpinned_root = RB_ROOT;
+#ifdef CONFIG_ASHMEM_RETAIN
+	INIT_RADIX_TREE(&asma->retained, GFP_NOWAIT | __GFP_NOWARN);
+#endif
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
+	mutex_init(&asma->mutex);
+	atomic_set(&asma->refcount, 1);
 	file->private_data = asma;
 
 	return 0;
@@ -200,16 +546,17 @@ static int ashmem_open(struct inode *inode, struct file *file)
 static int ashmem_release(struct inode *ignored, struct file *file)
 {
 	struct ashmem_area *asma = file->private_data;
-	struct ashmem_range *range, *next;
+	struct rb_node *n;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
-		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
+	while ((n = rb_first(&asma->unpinned_root)))
+		range_del(rb_entry(n, struct ashmem_range, node));
+	ashmem_retained_release(asma, 0, ULONG_MAX, 0);
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
-	kmem_cache_free(ashmem_area_cachep, asma);
+	ashmem_area_put(asma);
 
 	return 0;
 }
@@ -220,7 +567,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -241,7 +588,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -250,7 +597,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -271,7 +618,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -288,7 +635,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -332,7 +679,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	asma->vm_start = vma->vm_start;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -350,10 +697,20 @@ out:
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
  * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
  * pages freed.
+ *
+ * Reclaim can be entered with an area's mutex held, so areas are only
+ * trylocked. A busy area is skipped rather than ending the scan, so the
+ * shrinker makes progress as long as any unpinned range is purgeable.
  */
 static int ashmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_stats *st;
+	struct ashmem_range *range;
+	struct ashmem_area *asma;
+	unsigned long busy;
+	struct inode *inode;
+	int retained;
+	loff_t start, end;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (nr_to_scan && !(gfp_mask & __GFP_FS))
@@ -361,24 +718,60 @@ static int ashmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	if (!nr_to_scan)
 		return lru_count;
 
-	/* Avoid deadlock caused by recursive locking  */
-	if (unlikely(!mutex_trylock(&ashmem_mutex)))
-		return -1;
-
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+	spin_lock(&ashmem_lru_lock);
+	while (nr_to_scan > 0) {
+		busy = 0;
+		asma = NULL;
+		list_for_each_entry(range, &ashmem_lru_list, lru) {
+			if (mutex_trylock(&range->asma->mutex)) {
+				asma = range->asma;
+				break;
+			}
+			busy++;
+		}
+		if (busy) {
+			st = &get_cpu_var(ashmem_stats);
+			st->shrink_busy += busy;
+			put_cpu_var(ashmem_stats);
+		}
+		if (!asma)
+			break;
 
-		vmtruncate_range(inode, start, end);
+		/* keeps asma around until after its mutex is unlocked */
+		atomic_inc(&asma->refcount);
+		__lru_del(range);
 		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+		spin_unlock(&ashmem_lru_lock);
+
+		retained = 0;
+		if (asma->retain) {
+			retained = ashmem_retain_range(asma, range);
+			if (retained)
+				range->purged = ASHMEM_WAS_RESTORED;
+		}
 
+		inode = asma->file->f_dentry->d_inode;
+		start = range->pgstart * PAGE_SIZE;
+		end = (range->pgend + 1) * PAGE_SIZE - 1;
+		vmtruncate_range(inode, start, end);
 		nr_to_scan -= range_size(range);
-		if (nr_to_scan <= 0)
-			break;
+
+		st = &get_cpu_var(ashmem_stats);
+		st->purged_ranges++;
+		st->purged_pages += range_size(range);
+		if (asma->retain) {
+			if (retained)
+				st->retained_ranges++;
+			else
+				st->retain_failed++;
+		}
+		put_cpu_var(ashmem_stats);
+
+		mutex_unlock(&asma->mutex);
+		ashmem_area_put(asma);
+		spin_lock(&ashmem_lru_lock);
 	}
-	mutex_unlock(&ashmem_mutex);
+	spin_unlock(&ashmem_lru_lock);
 
 	return lru_count;
 }
@@ -392,7 +785,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -407,7 +800,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -415,7 +808,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -429,7 +822,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -438,7 +831,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -455,26 +848,27 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
 
 /*
  * ashmem_pin - pin the given ashmem region, returning whether it was
- * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
+ * previously purged (ASHMEM_WAS_PURGED), purged and then restored from
+ * retained contents (ASHMEM_WAS_RESTORED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
+	struct ashmem_stats *st;
 	int ret = ASHMEM_NOT_PURGED;
 
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* moved past last applicable page; we can short circuit */
-		if (range_before_page(range, pgstart))
-			break;
+	for (range = range_first(asma, pgstart);
+	     range && range->pgstart <= pgend; range = next) {
+		next = range_next(range);
 
 		/*
 		 * The user can ask us to pin pages that span multiple ranges,
@@ -491,36 +885,50 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 		 *    so we have to update one side of the range and then
 		 *    create a new range for the other side.
 		 */
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret |= range->purged;
-
-			/* Case #1: Easy. Just nuke the whole thing. */
-			if (page_range_subsumes_range(range, pgstart, pgend)) {
-				range_del(range);
-				continue;
-			}
+		ret |= range->purged;
 
-			/* Case #2: We overlap from the start, so adjust it */
-			if (range->pgstart >= pgstart) {
-				range_shrink(range, pgend + 1, range->pgend);
-				continue;
-			}
+		/* Case #1: Easy. Just nuke the whole thing. */
+		if (page_range_subsumes_range(range, pgstart, pgend)) {
+			range_del(range);
+			continue;
+		}
 
-			/* Case #3: We overlap from the rear, so adjust it */
-			if (range->pgend <= pgend) {
-				range_shrink(range, range->pgstart, pgstart-1);
-				continue;
-			}
+		/* Case #2: We overlap from the start, so adjust it */
+		if (range->pgstart >= pgstart) {
+			range_shrink(range, pgend + 1, range->pgend);
+			continue;
+		}
 
-			/*
-			 * Case #4: We eat a chunk out of the middle. A bit
-			 * more complicated, we allocate a new range for the
-			 * second half and adjust the first chunk's endpoint.
-			 */
-			range_alloc(asma, range, range->purged,
-				    pgend + 1, range->pgend);
+		/* Case #3: We overlap from the rear, so adjust it */
+		if (range->pgend <= pgend) {
 			range_shrink(range, range->pgstart, pgstart - 1);
-			break;
+			continue;
+		}
+
+		/*
+		 * Case #4: We eat a chunk out of the middle. A bit
+		 * more complicated, we allocate a new range for the
+		 * second half and adjust the first chunk's endpoint.
+		 */
+		range_alloc(asma, range->purged, pgend + 1, range->pgend);
+		range_shrink(range, range->pgstart, pgstart - 1);
+		break;
+	}
+
+	/*
+	 * Retained contents are only worth writing back if nothing else in
+	 * the interval was lost, the caller regenerates all of it otherwise.
+	 */
+	if (ret & ASHMEM_WAS_RESTORED) {
+		int restore = !(ret & ASHMEM_WAS_PURGED);
+
+		if (ashmem_retained_release(asma, pgstart, pgend, restore) ||
+		    !restore) {
+			ret = ASHMEM_WAS_PURGED;
+		} else {
+			st = &get_cpu_var(ashmem_stats);
+			st->restored_ranges++;
+			put_cpu_var(ashmem_stats);
 		}
 	}
 
@@ -530,18 +938,16 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	unsigned int purged = ASHMEM_NOT_PURGED;
 
-restart:
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* short circuit: this is our insertion point */
-		if (range_before_page(range, pgstart))
-			break;
+	for (range = range_first(asma, pgstart);
+	     range && range->pgstart <= pgend; range = next) {
+		next = range_next(range);
 
 		/*
 		 * The user can ask us to unpin pages that are already entirely
@@ -549,40 +955,76 @@ restart:
 		 */
 		if (page_range_subsumed_by_range(range, pgstart, pgend))
 			return 0;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			pgstart = min_t(size_t, range->pgstart, pgstart),
-			pgend = max_t(size_t, range->pgend, pgend);
-			purged |= range->purged;
-			range_del(range);
-			goto restart;
-		}
+
+		pgstart = min_t(size_t, range->pgstart, pgstart);
+		pgend = max_t(size_t, range->pgend, pgend);
+		purged |= range->purged;
+		range_del(range);
+	}
+
+	/* merging with a range that lost its contents loses the rest too */
+	if (purged == (ASHMEM_WAS_PURGED | ASHMEM_WAS_RESTORED)) {
+		ashmem_retained_release(asma, pgstart, pgend, 0);
+		purged = ASHMEM_WAS_PURGED;
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	return range_alloc(asma, purged, pgstart, pgend);
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
 {
 	struct ashmem_range *range;
-	int ret = ASHMEM_IS_PINNED;
 
-	list_for_each_entry(range, &asma->unpinned_list, unpinned) {
-		if (range_before_page(range, pgstart))
-			break;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret = ASHMEM_IS_UNPINNED;
-			break;
-		}
-	}
+	range = range_first(asma, pgstart);
+	if (range && range->pgstart <= pgend)
+		return ASHMEM_IS_UNPINNED;
 
-	return ret;
+	return ASHMEM_IS_PINNED;
+}
+
+static void ashmem_stat_op(enum ashmem_stat_op op, ktime_t start)
+{
+	struct ashmem_stats *st = &get_cpu_var(ashmem_stats);
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	st->calls[op]++;
+	st->total_ns[op] += ns;
+	if (ns > st->max_ns[op])
+		st->max_ns[op] = ns;
+	put_cpu_var(ashmem_stats);
+}
+
+/*
+ * ashmem_pin_pages - checks a user supplied struct ashmem_pin against the
+ * area's size and converts it to an inclusive interval of pages.
+ */
+static int ashmem_pin_pages(struct ashmem_area *asma, struct ashmem_pin *pin,
+			    size_t *pgstart, size_t *pgend)
+{
+	/* per custom, you can pass zero for len to mean "everything onward" */
+	if (!pin->len)
+		pin->len = PAGE_ALIGN(asma->size) - pin->offset;
+
+	if (unlikely((pin->offset | pin->len) & ~PAGE_MASK))
+		return -EINVAL;
+
+	if (unlikely(((__u32) -1) - pin->offset < pin->len))
+		return -EINVAL;
+
+	if (unlikely(PAGE_ALIGN(asma->size) < pin->offset + pin->len))
+		return -EINVAL;
+
+	*pgstart = pin->offset / PAGE_SIZE;
+	*pgend = *pgstart + (pin->len / PAGE_SIZE) - 1;
+
+	return 0;
 }
 
 static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
@@ -591,6 +1033,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	struct ashmem_pin pin;
 	size_t pgstart, pgend;
 	int ret = -EINVAL;
+	ktime_t start;
 
 	if (unlikely(!asma->file))
 		return -EINVAL;
@@ -598,38 +1041,114 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	if (unlikely(copy_from_user(&pin, p, sizeof(pin))))
 		return -EFAULT;
 
-	/* per custom, you can pass zero for len to mean "everything onward" */
-	if (!pin.len)
-		pin.len = PAGE_ALIGN(asma->size) - pin.offset;
-
-	if (unlikely((pin.offset | pin.len) & ~PAGE_MASK))
-		return -EINVAL;
-
-	if (unlikely(((__u32) -1) - pin.offset < pin.len))
-		return -EINVAL;
-
-	if (unlikely(PAGE_ALIGN(asma->size) < pin.offset + pin.len))
+	if (unlikely(ashmem_pin_pages(asma, &pin, &pgstart, &pgend)))
 		return -EINVAL;
 
-	pgstart = pin.offset / PAGE_SIZE;
-	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
-
-	mutex_lock(&ashmem_mutex);
+	start = ktime_get();
+	mutex_lock(&asma->mutex);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
 		ret = ashmem_pin(asma, pgstart, pgend);
+		mutex_unlock(&asma->mutex);
+		ashmem_stat_op(ASHMEM_STAT_PIN, start);
 		break;
 	case ASHMEM_UNPIN:
 		ret = ashmem_unpin(asma, pgstart, pgend);
+		mutex_unlock(&asma->mutex);
+		ashmem_stat_op(ASHMEM_STAT_UNPIN, start);
 		break;
 	case ASHMEM_GET_PIN_STATUS:
 		ret = ashmem_get_pin_status(asma, pgstart, pgend);
+		mutex_unlock(&asma->mutex);
+		ashmem_stat_op(ASHMEM_STAT_GET_PIN_STATUS, start);
 		break;
+	default:
+		mutex_unlock(&asma->mutex);
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	return ret;
+}
+
+/*
+ * ashmem_pin_unpin_vec - ASHMEM_PIN_VEC and ASHMEM_UNPIN_VEC
+ *
+ * Every range is copied in and checked before the area is locked, so either
+ * none of them is applied or all are applied under a single hold of
+ * asma->mutex. Each range then costs one tree lookup plus the unpinned
+ * ranges it touches. The user copy has to happen first anyway: faulting
+ * with asma->mutex held would invert its order against mmap_sem.
+ *
+ * ASHMEM_PIN_VEC returns ASHMEM_WAS_PURGED if any of the ranges was purged,
+ * otherwise ASHMEM_WAS_RESTORED if any of them was restored.
+ * ASHMEM_UNPIN_VEC returns zero, or -ENOMEM with the ranges before the
+ * failing one left unpinned.
+ */
+static int ashmem_pin_unpin_vec(struct ashmem_area *asma, unsigned long cmd,
+				void __user *p)
+{
+	struct ashmem_pin_vec vec;
+	struct ashmem_pin *pins;
+	size_t *pages;
+	struct ashmem_stats *st;
+	ktime_t start;
+	__u32 i;
+	int ret;
+
+	if (unlikely(!asma->file))
+		return -EINVAL;
+
+	if (unlikely(copy_from_user(&vec, p, sizeof(vec))))
+		return -EFAULT;
+
+	if (unlikely(!vec.nr || vec.nr > ASHMEM_PIN_VEC_MAX))
+		return -EINVAL;
+
+	pins = kmalloc(vec.nr * (sizeof(*pins) + 2 * sizeof(*pages)),
+		       GFP_KERNEL);
+	if (unlikely(!pins))
+		return -ENOMEM;
+	pages = (size_t *)(pins + vec.nr);
+
+	if (unlikely(copy_from_user(pins, (void __user *)(unsigned long)vec.pins,
+				    vec.nr * sizeof(*pins)))) {
+		ret = -EFAULT;
+		goto out;
+	}
 
+	for (i = 0; i < vec.nr; i++) {
+		ret = ashmem_pin_pages(asma, &pins[i], &pages[2 * i],
+				       &pages[2 * i + 1]);
+		if (unlikely(ret))
+			goto out;
+	}
+
+	start = ktime_get();
+	mutex_lock(&asma->mutex);
+	ret = 0;
+	for (i = 0; i < vec.nr; i++) {
+		if (cmd == ASHMEM_PIN_VEC) {
+			ret |= ashmem_pin(asma, pages[2 * i],
+					  pages[2 * i + 1]);
+		} else {
+			ret = ashmem_unpin(asma, pages[2 * i],
+					   pages[2 * i + 1]);
+			if (unlikely(ret))
+				break;
+		}
+	}
+	mutex_unlock(&asma->mutex);
+	if (ret & ASHMEM_WAS_PURGED)
+		ret = ASHMEM_WAS_PURGED;
+	ashmem_stat_op(cmd == ASHMEM_PIN_VEC ? ASHMEM_STAT_PIN_VEC :
+		       ASHMEM_STAT_UNPIN_VEC, start);
+
+	st = &get_cpu_var(ashmem_stats);
+	st->vec_ranges += vec.nr;
+	put_cpu_var(ashmem_stats);
+
+out:
+	kfree(pins);
 	return ret;
 }
 
@@ -679,7 +1198,7 @@ static int ashmem_cache_op(struct ashmem_area *asma,
 #ifdef CONFIG_OUTER_CACHE
 	unsigned long vaddr;
 #endif
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 #ifndef CONFIG_OUTER_CACHE
 	cache_func(asma->vm_start, asma->size, 0);
 #else
@@ -688,13 +1207,15 @@ static int ashmem_cache_op(struct ashmem_area *asma,
 
 		unsigned long physaddr;
 		physaddr = virtaddr_to_physaddr(vaddr);
-		if (!physaddr)
+		if (!physaddr) {
+			mutex_unlock(&asma->mutex);
 			return -EINVAL;
+		}
 		cache_func(vaddr, PAGE_SIZE, physaddr);
 	}
 
 #endif
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return 0;
 }
 
@@ -712,10 +1233,12 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	case ASHMEM_SET_SIZE:
 		ret = -EINVAL;
+		mutex_lock(&asma->mutex);
 		if (!asma->file) {
 			ret = 0;
 			asma->size = (size_t) arg;
 		}
+		mutex_unlock(&asma->mutex);
 		break;
 	case ASHMEM_GET_SIZE:
 		ret = asma->size;
@@ -731,6 +1254,16 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case ASHMEM_GET_PIN_STATUS:
 		ret = ashmem_pin_unpin(asma, cmd, (void __user *) arg);
 		break;
+	case ASHMEM_PIN_VEC:
+	case ASHMEM_UNPIN_VEC:
+		ret = ashmem_pin_unpin_vec(asma, cmd, (void __user *) arg);
+		break;
+	case ASHMEM_SET_RETAIN:
+		ret = set_retain(asma, arg);
+		break;
+	case ASHMEM_GET_RETAIN:
+		ret = asma->retain;
+		break;
 	case ASHMEM_PURGE_ALL_CACHES:
 		ret = -EPERM;
 		if (capable(CAP_SYS_ADMIN)) {
@@ -805,6 +1338,66 @@ void put_ashmem_file(struct file *file)
 }
 EXPORT_SYMBOL(put_ashmem_file);
 
+static int ashmem_stats_show(struct seq_file *m, void *unused)
+{
+	struct ashmem_stats sum;
+	int cpu, i;
+
+	BUILD_BUG_ON(ARRAY_SIZE(ashmem_stat_op_strings) != ASHMEM_STAT_OPS);
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		struct ashmem_stats *st = &per_cpu(ashmem_stats, cpu);
+
+		for (i = 0; i < ASHMEM_STAT_OPS; i++) {
+			sum.calls[i] += st->calls[i];
+			sum.total_ns[i] += st->total_ns[i];
+			if (st->max_ns[i] > sum.max_ns[i])
+				sum.max_ns[i] = st->max_ns[i];
+		}
+		sum.purged_ranges += st->purged_ranges;
+		sum.purged_pages += st->purged_pages;
+		sum.shrink_busy += st->shrink_busy;
+		sum.vec_ranges += st->vec_ranges;
+		sum.retained_ranges += st->retained_ranges;
+		sum.retain_failed += st->retain_failed;
+		sum.restored_ranges += st->restored_ranges;
+	}
+
+	for (i = 0; i < ASHMEM_STAT_OPS; i++)
+		seq_printf(m, "%s: calls %lu avg %llu ns max %llu ns\n",
+			   ashmem_stat_op_strings[i], sum.calls[i],
+			   sum.calls[i] ? (unsigned long long)
+			   div64_u64(sum.total_ns[i], sum.calls[i]) : 0ULL,
+			   (unsigned long long)sum.max_ns[i]);
+	seq_printf(m, "lru pages: %lu\n", lru_count);
+	seq_printf(m, "purged: ranges %lu pages %lu\n",
+		   sum.purged_ranges, sum.purged_pages);
+	seq_printf(m, "shrink skipped busy: %lu\n", sum.shrink_busy);
+	seq_printf(m, "vec ranges: %lu\n", sum.vec_ranges);
+#ifdef CONFIG_ASHMEM_RETAIN
+	seq_printf(m, "retained: ranges %lu failed %lu restored %lu "
+		   "bytes %ld budget %lu\n", sum.retained_ranges,
+		   sum.retain_failed, sum.restored_ranges,
+		   atomic_long_read(&ashmem_retained_bytes),
+		   ashmem_retain_budget);
+#endif
+
+	return 0;
+}
+
+static int ashmem_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ashmem_stats_show, inode->i_private);
+}
+
+static const struct file_operations ashmem_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = ashmem_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static struct file_operations ashmem_fops = {
 	.owner = THIS_MODULE,
 	.open = ashmem_open,
@@ -850,6 +1443,11 @@ static int __init ashmem_init(void)
 
 	register_shrinker(&ashmem_shrinker);
 
+	ashmem_debugfs_dir = debugfs_create_dir("ashmem", NULL);
+	if (ashmem_debugfs_dir)
+		debugfs_create_file("stats", S_IRUGO, ashmem_debugfs_dir,
+				    NULL, &ashmem_stats_fops);
+
 	printk(KERN_INFO "ashmem: initialized\n");
 
 	return 0;
@@ -860,6 +1458,7 @@ static void __exit ashmem_exit(void)
 	int ret;
 
 	unregister_shrinker(&ashmem_shrinker);
+	debugfs_remove_recursive(ashmem_debugfs_dir);
 
 	ret = misc_deregister(&ashmem_misc);
 	if (unlikely(ret))
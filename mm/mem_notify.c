@@ -17,6 +17,7 @@
 #include <linux/vmstat.h>
 #include <linux/percpu.h>
 #include <linux/timer.h>
+#include <linux/notifier.h>
 #include <linux/mem_notify.h>
 
 #include <asm/atomic.h>
@@ -42,6 +43,20 @@ static atomic_t nr_fasync_task = ATOMIC_INIT(0);
 
 atomic_long_t last_mem_notify = ATOMIC_LONG_INIT(INITIAL_JIFFIES);
 
+static ATOMIC_NOTIFIER_HEAD(mem_notify_chain);
+
+int register_mem_notify_notifier(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_register(&mem_notify_chain, nb);
+}
+EXPORT_SYMBOL_GPL(register_mem_notify_notifier);
+
+int unregister_mem_notify_notifier(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_unregister(&mem_notify_chain, nb);
+}
+EXPORT_SYMBOL_GPL(unregister_mem_notify_notifier);
+
 static void mem_notify_kill_fasync_nr(int nr)
 {
 	struct mem_notify_file_info *iter, *saved_iter;
@@ -121,6 +136,8 @@ out:
 
 	if (nr_fasync_wakeup)
 		mem_notify_kill_fasync_nr(nr_fasync_wakeup);
+
+	atomic_notifier_call_chain(&mem_notify_chain, pressure, zone);
 }
 
 static int mem_notify_open(struct inode *inode, struct file *file)
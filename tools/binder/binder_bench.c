@@ -0,0 +1,311 @@
+/*
+ * binder_bench - binder transaction round-trip latency
+ *
+ * Forks a server that registers itself as the binder context manager
+ * and echoes every transaction back as a reply of the same size. The
+ * client times BC_TRANSACTION to BR_REPLY for a range of payload sizes
+ * and prints min/avg/p50/p99/max in microseconds.
+ *
+ * The context manager can only be set once, so run it with no
+ * servicemanager registered (e.g. after "stop servicemanager").
+ *
+ * Build:
+ *	gcc -O2 -Wall -I../../drivers/staging/android \
+ *		-o binder_bench binder_bench.c -lrt
+ *
+ * Usage:
+ *	binder_bench [-n iterations] [-w watermark] [size...]
+ *
+ * -w sets the per-process free page watermark of both ends with
+ * BINDER_SET_FREE_PAGE_WATERMARK, -w 0 gives the old map/unmap on
+ * every transaction for comparison.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(1024 * 1024)
+#define MAX_SIZE	(256 * 1024)
+#define READ_SIZE	256
+
+static const size_t default_sizes[] = {
+	32, 128, 512, 2048, 4096, 16384, 65536
+};
+
+struct bench_io {
+	int fd;
+	uint8_t wbuf[128];
+	size_t wlen;
+	uint32_t rbuf[READ_SIZE / sizeof(uint32_t)];
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void put_cmd(struct bench_io *io, uint32_t cmd, const void *arg,
+		    size_t len)
+{
+	memcpy(io->wbuf + io->wlen, &cmd, sizeof(cmd));
+	io->wlen += sizeof(cmd);
+	if (len) {
+		memcpy(io->wbuf + io->wlen, arg, len);
+		io->wlen += len;
+	}
+}
+
+/* Flushes pending commands and returns the number of bytes read back */
+static size_t bench_write_read(struct bench_io *io, int do_read)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (unsigned long)io->wbuf;
+	bwr.write_size = io->wlen;
+	if (do_read) {
+		bwr.read_buffer = (unsigned long)io->rbuf;
+		bwr.read_size = sizeof(io->rbuf);
+	}
+	while (ioctl(io->fd, BINDER_WRITE_READ, &bwr) < 0) {
+		if (errno != EINTR)
+			die("BINDER_WRITE_READ");
+	}
+	io->wlen = 0;
+	return bwr.read_consumed;
+}
+
+static int bench_open(int watermark)
+{
+	int fd;
+
+	fd = open("/dev/binder", O_RDWR);
+	if (fd < 0)
+		die("/dev/binder");
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0) == MAP_FAILED)
+		die("mmap");
+	if (watermark >= 0 &&
+	    ioctl(fd, BINDER_SET_FREE_PAGE_WATERMARK, &watermark) < 0)
+		perror("BINDER_SET_FREE_PAGE_WATERMARK");
+	return fd;
+}
+
+static void serve(int watermark, int ready_fd)
+{
+	struct bench_io io;
+	uint8_t *p, *end;
+	size_t len;
+
+	memset(&io, 0, sizeof(io));
+	io.fd = bench_open(watermark);
+	if (ioctl(io.fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR");
+	put_cmd(&io, BC_ENTER_LOOPER, NULL, 0);
+	bench_write_read(&io, 0);
+	if (write(ready_fd, "", 1) != 1)
+		die("ready pipe");
+	close(ready_fd);
+
+	for (;;) {
+		len = bench_write_read(&io, 1);
+		p = (uint8_t *)io.rbuf;
+		end = p + len;
+		while (p < end) {
+			uint32_t cmd = *(uint32_t *)p;
+
+			p += sizeof(uint32_t);
+			if (cmd == BR_TRANSACTION) {
+				struct binder_transaction_data *tr = (void *)p;
+				struct binder_transaction_data reply;
+				const void *data = tr->data.ptr.buffer;
+
+				memset(&reply, 0, sizeof(reply));
+				reply.data_size = tr->data_size;
+				reply.data.ptr.buffer = data;
+				put_cmd(&io, BC_REPLY, &reply, sizeof(reply));
+				put_cmd(&io, BC_FREE_BUFFER, &data,
+					sizeof(data));
+			} else if (cmd == BR_INCREFS || cmd == BR_ACQUIRE) {
+				put_cmd(&io, cmd == BR_INCREFS ?
+					BC_INCREFS_DONE : BC_ACQUIRE_DONE,
+					p, 2 * sizeof(void *));
+			}
+			p += _IOC_SIZE(cmd);
+		}
+	}
+}
+
+/* Sends one transaction of size bytes and waits for the reply */
+static void transact(struct bench_io *io, const void *payload, size_t size)
+{
+	struct binder_transaction_data tr;
+	uint8_t *p, *end;
+	size_t len;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = 0;
+	tr.code = 1;
+	tr.data_size = size;
+	tr.data.ptr.buffer = payload;
+	put_cmd(io, BC_TRANSACTION, &tr, sizeof(tr));
+
+	for (;;) {
+		len = bench_write_read(io, 1);
+		p = (uint8_t *)io->rbuf;
+		end = p + len;
+		while (p < end) {
+			uint32_t cmd = *(uint32_t *)p;
+
+			p += sizeof(uint32_t);
+			switch (cmd) {
+			case BR_REPLY: {
+				struct binder_transaction_data *reply =
+					(void *)p;
+				const void *data = reply->data.ptr.buffer;
+
+				/* freed with the next transaction */
+				put_cmd(io, BC_FREE_BUFFER, &data,
+					sizeof(data));
+				return;
+			}
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				fprintf(stderr, "transaction failed: %x\n",
+					cmd);
+				exit(1);
+			}
+			p += _IOC_SIZE(cmd);
+		}
+	}
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void run(struct bench_io *io, size_t size, int iterations,
+		uint64_t *samples)
+{
+	static uint8_t payload[MAX_SIZE];
+	uint64_t sum = 0;
+	int i;
+
+	/* warm up */
+	for (i = 0; i < 16; i++)
+		transact(io, payload, size);
+
+	for (i = 0; i < iterations; i++) {
+		uint64_t start = now_ns();
+
+		transact(io, payload, size);
+		samples[i] = now_ns() - start;
+		sum += samples[i];
+	}
+	qsort(samples, iterations, sizeof(samples[0]), cmp_u64);
+	printf("%8zu %8d %9.1f %9.1f %9.1f %9.1f %9.1f\n", size, iterations,
+	       samples[0] / 1000.0, sum / 1000.0 / iterations,
+	       samples[iterations / 2] / 1000.0,
+	       samples[iterations * 99 / 100] / 1000.0,
+	       samples[iterations - 1] / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_io io;
+	uint64_t *samples;
+	int iterations = 10000;
+	int watermark = -1;
+	int ready[2];
+	pid_t server;
+	char c;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "n:w:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'w':
+			watermark = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] "
+				"[-w watermark] [size...]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (iterations <= 0)
+		iterations = 1;
+
+	if (pipe(ready) < 0)
+		die("pipe");
+	server = fork();
+	if (server < 0)
+		die("fork");
+	if (server == 0) {
+		close(ready[0]);
+		serve(watermark, ready[1]);
+		_exit(0);
+	}
+	close(ready[1]);
+	if (read(ready[0], &c, 1) != 1) {
+		fprintf(stderr, "server failed to start\n");
+		return 1;
+	}
+
+	memset(&io, 0, sizeof(io));
+	io.fd = bench_open(watermark);
+	samples = malloc(iterations * sizeof(*samples));
+	if (!samples)
+		die("malloc");
+
+	printf("%8s %8s %9s %9s %9s %9s %9s\n", "size", "iters",
+	       "min(us)", "avg(us)", "p50(us)", "p99(us)", "max(us)");
+	if (optind < argc) {
+		for (i = optind; i < argc; i++) {
+			size_t size = strtoul(argv[i], NULL, 0);
+
+			if (size > MAX_SIZE) {
+				fprintf(stderr, "size %zu too large\n", size);
+				continue;
+			}
+			run(&io, size, iterations, samples);
+		}
+	} else {
+		for (i = 0; i < sizeof(default_sizes) / sizeof(default_sizes[0]);
+		     i++)
+			run(&io, default_sizes[i], iterations, samples);
+	}
+
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * logger_bench - Android logger write throughput and latency
+ *
+ * Starts N threads that each write entries to a log device with writev(),
+ * laid out the way liblog does (priority, tag, message), and prints the
+ * aggregate writes/s together with the p50/p99/max latency of a single
+ * write. Optionally runs a reader draining the log at the same time, to
+ * show how writers are affected by logcat.
+ *
+ * Build:
+ *	gcc -O2 -Wall -o logger_bench logger_bench.c -lpthread -lrt
+ *
+ * Usage:
+ *	logger_bench [-d device] [-t threads] [-n writes] [-s size] [-r]
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#define MAX_THREADS	256
+#define MAX_MSG		4000
+
+static const char *device = "/dev/log/main";
+static int nr_writes = 100000;
+static int msg_size = 64;
+static volatile int stop_reader;
+
+struct writer {
+	pthread_t thread;
+	int fd;
+	uint64_t *samples;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void *writer_fn(void *arg)
+{
+	struct writer *w = arg;
+	char msg[MAX_MSG];
+	unsigned char prio = 4;	/* ANDROID_LOG_INFO */
+	struct iovec vec[3];
+	int i;
+
+	memset(msg, 'x', msg_size);
+	msg[msg_size - 1] = '\0';
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = "logger_bench";
+	vec[1].iov_len = sizeof("logger_bench");
+	vec[2].iov_base = msg;
+	vec[2].iov_len = msg_size;
+
+	for (i = 0; i < nr_writes; i++) {
+		uint64_t start = now_ns();
+
+		while (writev(w->fd, vec, 3) < 0) {
+			if (errno != EINTR) {
+				perror("writev");
+				exit(1);
+			}
+		}
+		w->samples[i] = now_ns() - start;
+	}
+	return NULL;
+}
+
+static void *reader_fn(void *arg)
+{
+	char buf[5 * 1024];
+	int fd;
+
+	fd = open(device, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror(device);
+		return NULL;
+	}
+	while (!stop_reader) {
+		if (read(fd, buf, sizeof(buf)) < 0 && errno == EAGAIN)
+			usleep(1000);
+	}
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct writer writers[MAX_THREADS];
+	uint64_t *all, start, elapsed;
+	pthread_t reader;
+	int nr_threads = 4;
+	int with_reader = 0;
+	int opt, i;
+	size_t n;
+
+	while ((opt = getopt(argc, argv, "d:t:n:s:r")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			nr_writes = atoi(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 'r':
+			with_reader = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] [-t threads] "
+				"[-n writes] [-s size] [-r]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nr_threads < 1 || nr_threads > MAX_THREADS || nr_writes < 1 ||
+	    msg_size < 1 || msg_size > MAX_MSG) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	all = malloc((size_t)nr_threads * nr_writes * sizeof(*all));
+	if (!all) {
+		perror("malloc");
+		return 1;
+	}
+	for (i = 0; i < nr_threads; i++) {
+		writers[i].fd = open(device, O_WRONLY);
+		if (writers[i].fd < 0) {
+			perror(device);
+			return 1;
+		}
+		writers[i].samples = all + (size_t)i * nr_writes;
+	}
+
+	if (with_reader)
+		pthread_create(&reader, NULL, reader_fn, NULL);
+
+	start = now_ns();
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&writers[i].thread, NULL, writer_fn,
+			       &writers[i]);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(writers[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	if (with_reader) {
+		stop_reader = 1;
+		pthread_join(reader, NULL);
+	}
+
+	n = (size_t)nr_threads * nr_writes;
+	qsort(all, n, sizeof(*all), cmp_u64);
+	printf("%s: %d threads x %d writes of %d bytes%s\n", device,
+	       nr_threads, nr_writes, msg_size,
+	       with_reader ? ", one reader" : "");
+	printf("%.0f writes/s, latency p50 %.1f us, p99 %.1f us, "
+	       "max %.1f us\n", n * 1e9 / elapsed, all[n / 2] / 1000.0,
+	       all[n * 99 / 100] / 1000.0, all[n - 1] / 1000.0);
+	return 0;
+}
@@ -0,0 +1,273 @@
+/*
+ * squashfs_bench - parallel read throughput of a squashfs image
+ *
+ * Attaches a squashfs image to a free loop device, mounts it read-only and
+ * has N threads read every regular file in it from start to end, the files
+ * handed out round robin. The page cache is dropped before each run, so
+ * every byte read is decompressed. Prints the aggregate MB/s of each run
+ * and the p50/p99/max time to read one file.
+ *
+ * Build:
+ *	gcc -O2 -Wall -o squashfs_bench squashfs_bench.c -lpthread -lrt
+ *
+ * Usage (as root):
+ *	squashfs_bench [-m mountpoint] [-t threads] [-r runs] [-b bufsize]
+ *		       image.sqfs
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <linux/loop.h>
+
+#define MAX_THREADS	64
+#define MAX_LOOP	64
+
+static const char *mountpoint = "/tmp/squashfs_bench";
+static size_t bufsize = 65536;
+
+static char **files;
+static int nr_files, max_files;
+static uint64_t *samples;		/* ns per file, indexed like files */
+static uint64_t bytes_read;
+static pthread_mutex_t bytes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct reader {
+	pthread_t thread;
+	int id;
+	int nr_threads;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int add_file(const char *path, const struct stat *st, int type,
+		    struct FTW *ftw)
+{
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+	if (nr_files == max_files) {
+		max_files = max_files ? max_files * 2 : 1024;
+		files = realloc(files, max_files * sizeof(*files));
+		if (!files) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	files[nr_files++] = strdup(path);
+	return 0;
+}
+
+/* Returns the loop device the image was attached to, or NULL */
+static char *attach_loop(const char *image)
+{
+	static char dev[64];
+	struct loop_info64 info;
+	int i, fd, img;
+
+	img = open(image, O_RDONLY);
+	if (img < 0) {
+		perror(image);
+		return NULL;
+	}
+	for (i = 0; i < MAX_LOOP; i++) {
+		snprintf(dev, sizeof(dev), "/dev/block/loop%d", i);
+		fd = open(dev, O_RDONLY);
+		if (fd < 0) {
+			snprintf(dev, sizeof(dev), "/dev/loop%d", i);
+			fd = open(dev, O_RDONLY);
+		}
+		if (fd < 0)
+			continue;
+		/* A loop device that is in use has status */
+		if (ioctl(fd, LOOP_GET_STATUS64, &info) < 0 &&
+		    errno == ENXIO && ioctl(fd, LOOP_SET_FD, img) == 0) {
+			memset(&info, 0, sizeof(info));
+			info.lo_flags = LO_FLAGS_READ_ONLY;
+			ioctl(fd, LOOP_SET_STATUS64, &info);
+			close(fd);
+			close(img);
+			return dev;
+		}
+		close(fd);
+	}
+	fprintf(stderr, "no free loop device\n");
+	close(img);
+	return NULL;
+}
+
+static void detach_loop(const char *dev)
+{
+	int fd = open(dev, O_RDONLY);
+
+	if (fd >= 0) {
+		ioctl(fd, LOOP_CLR_FD, 0);
+		close(fd);
+	}
+}
+
+static void drop_caches(void)
+{
+	int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+
+	sync();
+	if (fd < 0 || write(fd, "3", 1) != 1)
+		fprintf(stderr, "warning: could not drop caches\n");
+	if (fd >= 0)
+		close(fd);
+}
+
+static void *reader_fn(void *arg)
+{
+	struct reader *r = arg;
+	uint64_t total = 0;
+	char *buf;
+	int i, fd;
+	ssize_t n;
+
+	buf = malloc(bufsize);
+	if (!buf)
+		return NULL;
+
+	for (i = r->id; i < nr_files; i += r->nr_threads) {
+		uint64_t start = now_ns();
+
+		fd = open(files[i], O_RDONLY);
+		if (fd < 0) {
+			perror(files[i]);
+			continue;
+		}
+		while ((n = read(fd, buf, bufsize)) > 0)
+			total += n;
+		if (n < 0)
+			perror(files[i]);
+		close(fd);
+		samples[i] = now_ns() - start;
+	}
+
+	pthread_mutex_lock(&bytes_lock);
+	bytes_read += total;
+	pthread_mutex_unlock(&bytes_lock);
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct reader readers[MAX_THREADS];
+	int nr_threads = 4, nr_runs = 3;
+	uint64_t start, elapsed;
+	const char *image;
+	char *dev;
+	int opt, i, run;
+
+	while ((opt = getopt(argc, argv, "m:t:r:b:")) != -1) {
+		switch (opt) {
+		case 'm':
+			mountpoint = optarg;
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'r':
+			nr_runs = atoi(optarg);
+			break;
+		case 'b':
+			bufsize = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+	image = argv[optind];
+	if (nr_threads < 1 || nr_threads > MAX_THREADS || nr_runs < 1 ||
+	    bufsize < 1) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	dev = attach_loop(image);
+	if (!dev)
+		return 1;
+	mkdir(mountpoint, 0755);
+	if (mount(dev, mountpoint, "squashfs", MS_RDONLY, NULL) < 0) {
+		perror("mount");
+		detach_loop(dev);
+		return 1;
+	}
+
+	nftw(mountpoint, add_file, 16, FTW_PHYS);
+	if (!nr_files) {
+		fprintf(stderr, "%s: no regular files\n", image);
+		goto out;
+	}
+	samples = calloc(nr_files, sizeof(*samples));
+	if (!samples) {
+		perror("calloc");
+		goto out;
+	}
+
+	printf("%s on %s: %d files, %d threads, %zu byte reads\n", image, dev,
+	       nr_files, nr_threads, bufsize);
+	for (run = 0; run < nr_runs; run++) {
+		drop_caches();
+		bytes_read = 0;
+		memset(samples, 0, nr_files * sizeof(*samples));
+
+		start = now_ns();
+		for (i = 0; i < nr_threads; i++) {
+			readers[i].id = i;
+			readers[i].nr_threads = nr_threads;
+			pthread_create(&readers[i].thread, NULL, reader_fn,
+				       &readers[i]);
+		}
+		for (i = 0; i < nr_threads; i++)
+			pthread_join(readers[i].thread, NULL);
+		elapsed = now_ns() - start;
+
+		qsort(samples, nr_files, sizeof(*samples), cmp_u64);
+		printf("run %d: %.1f MB/s, per file p50 %.2f ms, p99 %.2f ms, "
+		       "max %.2f ms\n", run, bytes_read * 1e3 / elapsed,
+		       samples[nr_files / 2] / 1e6,
+		       samples[nr_files * 99 / 100] / 1e6,
+		       samples[nr_files - 1] / 1e6);
+	}
+
+out:
+	umount(mountpoint);
+	detach_loop(dev);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-m mountpoint] [-t threads] [-r runs] "
+		"[-b bufsize] image.sqfs\n", argv[0]);
+	return 1;
+}